@@ -0,0 +1,50 @@
+/* lc3-trace prints the trace lc3-vm --trace=file wrote, one line per
+ * instruction: its index, PC, instruction word and opcode, the registers
+ * and flags it changed as they were afterwards and the words it wrote */
+#include "lc3vm_internal.h"
+
+int main(int argc, const char *argv[]) {
+  if (argc != 2) {
+    printf("lc3-trace trace-file\n");
+    exit(2);
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  struct trace_reader *r = f ? vm_trace_open(f) : NULL;
+  if (!r) {
+    printf("not a trace: %s\n", argv[1]);
+    exit(1);
+  }
+
+  static char output_buffer[OUTPUT_BUFFER_SIZE];
+  setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+  struct trace_record rec;
+  int status;
+  while ((status = vm_trace_next(r, &rec)) == 1) {
+    printf("%llu %04x %04x %-4s", (unsigned long long)rec.index, rec.pc, rec.instr,
+           vm_op_names[rec.instr >> 12]);
+    for (int i = 0; i < 8; i++) {
+      if (rec.changed & 1 << i) {
+        printf(" R%d=%04x", i, rec.reg[i]);
+      }
+    }
+    if (rec.flags & TRACE_COND) {
+      printf(" %c", rec.cond == FL_NEG ? 'N' : rec.cond == FL_ZRO ? 'Z' : 'P');
+    }
+    if (rec.flags & TRACE_PSR) {
+      printf(" PSR=%04x", rec.psr);
+    }
+    for (uint32_t i = 0; i < rec.write_count; i++) {
+      printf(" [%04x]=%04x", rec.writes[i][0], rec.writes[i][1]);
+    }
+    printf("\n");
+  }
+
+  if (status < 0) {
+    fflush(stdout);
+    fprintf(stderr, "trace is corrupt after %llu instructions\n", (unsigned long long)r->index);
+  }
+  vm_trace_reader_destroy(r);
+  fclose(f);
+  return status < 0;
+}
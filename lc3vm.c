@@ -0,0 +1,4647 @@
+#include "lc3vm_internal.h"
+
+/* used only in this file */
+static uint16_t sign_extend(uint16_t x, int bit_count);
+static void update_flags(struct lc3_vm *vm, uint16_t r);
+static uint16_t cond_flags(struct lc3_vm *vm);
+static void decode_instr(uint16_t instr, struct decoded_instr *d);
+static void invalidate_decode_pages(struct lc3_vm *vm, uint16_t address, size_t n);
+static void clear_page(struct lc3_vm *vm, int page);
+static int write_snapshot_page(struct lc3_vm *vm, int fd, int page);
+static int read_snapshot_page(struct lc3_vm *vm, int fd, int page);
+static void swap16_copy(uint16_t *dst, const uint16_t *src, size_t n);
+static void load_image(struct lc3_vm *vm, const uint16_t *image, size_t size);
+static uint16_t check_key(int fd);
+static void *keyboard_reader(void *arg);
+static void keyboard_wait(struct keyboard *kb, unsigned tail);
+static int keyboard_poll(struct keyboard *kb);
+static int keyboard_getc(struct keyboard *kb);
+static int host_poll_key(struct lc3_vm *vm);
+static int host_getc(struct lc3_vm *vm, FILE *in);
+static void write_varint(FILE *f, uint64_t v);
+static int read_varint(FILE *f, uint64_t *v);
+static void input_log_read_next(struct input_log *log);
+static void input_log_write(struct input_log *log, int kind, uint16_t value);
+static uint16_t input_log_consume(struct input_log *log);
+static struct input_log *input_log_create(FILE *file, int mode);
+static int input_log_poll_key(struct lc3_vm *vm);
+static int input_log_getc(struct lc3_vm *vm, FILE *in);
+static int input_getc(struct lc3_vm *vm, FILE *in);
+static uint16_t read_char(struct lc3_vm *vm, FILE *in);
+static void invalidate_decode(struct lc3_vm *vm, uint16_t address);
+static void invalidate_code(struct lc3_vm *vm, uint16_t address);
+static int fetch_key(struct lc3_vm *vm);
+static uint16_t kbsr_read(struct lc3_vm *vm, uint16_t address);
+static int kbsr_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+static uint16_t kbdr_read(struct lc3_vm *vm, uint16_t address);
+static void kbsr_idle(struct lc3_vm *vm);
+static void set_psr(struct lc3_vm *vm, uint16_t psr);
+static uint16_t psr_read(struct lc3_vm *vm, uint16_t address);
+static int psr_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+static uint16_t dsr_read(struct lc3_vm *vm, uint16_t address);
+static int ddr_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+static int mcr_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+static uint16_t tmr_read(struct lc3_vm *vm, uint16_t address);
+static int tmi_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+static void mark_devices(struct lc3_vm *vm);
+static void install_devices(struct lc3_vm *vm);
+static void reset_devices(struct lc3_vm *vm);
+static void raise_interrupt(struct lc3_vm *vm, uint8_t vector, int priority);
+static void raise_exception(struct lc3_vm *vm, uint8_t vector);
+static void exec_rti(struct lc3_vm *vm);
+static const struct decoded_instr *decode_follower(struct lc3_vm *vm, uint16_t address);
+static void fuse_instr(struct lc3_vm *vm, uint16_t address, struct decoded_instr *d);
+static void decode_cache_miss(struct lc3_vm *vm, uint16_t address, struct decoded_instr *d);
+static size_t pack_puts(const uint16_t *src, size_t n, char *dst, int *done);
+static size_t pack_putsp(const uint16_t *src, size_t n, char *dst, size_t *len, int *done);
+static void write_string(struct lc3_vm *vm, uint16_t address, int packed, FILE *out);
+static int mem_write_block(struct lc3_vm *vm, uint16_t address, const uint16_t *src, size_t n);
+static struct lc3_view vm_view(struct lc3_vm *vm, uint16_t address, size_t count);
+static int run_trap_hook(struct lc3_vm *vm, uint8_t vector);
+static int trap_readline(struct lc3_vm *vm, FILE *in, FILE *out);
+static int trap_read(struct lc3_vm *vm, FILE *in, FILE *out);
+static int trap_write(struct lc3_vm *vm, FILE *in, FILE *out);
+static int trap_memcpy(struct lc3_vm *vm, FILE *in, FILE *out);
+static int trap_memset(struct lc3_vm *vm, FILE *in, FILE *out);
+static void profile_end_block(struct profile *p);
+static void profile_instr(struct lc3_vm *vm, uint16_t pc, const struct decoded_instr *d);
+static int profile_select(const uint64_t *counts, int csv, int *picks);
+static uint8_t *lz4_emit(uint8_t *op, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len);
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst);
+static long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t size);
+static uint8_t *put_varint(uint8_t *p, uint32_t v);
+static uint16_t zigzag(uint16_t delta);
+static uint16_t unzigzag(uint16_t v);
+static void trace_publish(struct trace *t);
+static void trace_put(struct trace *t, const uint8_t *buf, size_t n);
+static void trace_write_chunk(FILE *f, const uint8_t *chunk, size_t len, uint8_t *out);
+static void *trace_writer(void *arg);
+static void trace_destroy(struct trace *t);
+static void trace_instr(struct lc3_vm *vm, uint16_t pc, uint16_t instr);
+static void trace_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+static int trace_read_chunk(struct trace_reader *r);
+static int trace_getc(struct trace_reader *r);
+static int trace_varint(struct trace_reader *r, uint16_t *v);
+static int run_to_halt(struct lc3_vm *vm, struct run_result (*engine)(struct lc3_vm *, uint64_t, FILE *), FILE *in, FILE *out);
+static int run_queue_push(struct run_queue *q, struct guest *g);
+static struct guest *run_queue_pop(struct run_queue *q, int steal);
+static void sched_park(struct scheduler *s, struct guest *g);
+static void sched_poll_parked(struct scheduler *s, struct run_queue *q);
+static int sched_run_slice(struct scheduler *s, struct guest *g);
+static void *sched_worker_main(void *arg);
+static int cfg_kind(const struct decoded_instr *d);
+static void cfg_leader(uint8_t *marks, uint16_t *work, int *n, uint16_t address);
+static void cfg_destroy(struct cfg *cfg);
+static struct cfg *cfg_build(struct lc3_vm *vm, uint16_t entry);
+static int debug_getc(struct debugger *dbg);
+static int debug_interrupted(struct debugger *dbg, int ms);
+static uint16_t debug_reg(struct lc3_vm *vm, int n);
+static void debug_set_reg(struct lc3_vm *vm, int n, uint16_t val);
+static int debug_watch_hit(struct lc3_vm *vm, uint16_t address);
+static int debug_resume(struct lc3_vm *vm, int step, char *reply, size_t size);
+static void jit_flush(struct lc3_vm *vm);
+static void jit_destroy(struct lc3_vm *vm);
+
+static inline int interrupt_pending(struct lc3_vm *vm) {
+  return atomic_load_explicit(&vm->irq_check, memory_order_relaxed);
+}
+
+/* mem_read() for the reference core, the I/O page is plain memory to it
+ * without CORE_MMIO */
+static inline uint16_t core_read(struct lc3_vm *vm, unsigned features, uint16_t address) {
+  return features & CORE_MMIO ? mem_read(vm, address) : vm->memory[address];
+}
+
+/* fetch the decoded form of the instruction at address */
+static inline const struct decoded_instr *fetch_decoded(struct lc3_vm *vm, uint16_t address) {
+  struct decoded_instr *d = &vm->decode_cache[address];
+  if (!d->valid) {
+    decode_cache_miss(vm, address, d);
+  }
+  return d;
+}
+
+
+/* SSE2 is part of x86-64, NEON of AArch64 */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_AVAILABLE 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_AVAILABLE 1
+#else
+#define SIMD_AVAILABLE 0
+#endif
+
+/* convert small bit number to 16-bit, keeping sign bit intact */
+static uint16_t sign_extend(uint16_t x, int bit_count) {
+  if ((x >> (bit_count - 1)) & 1) {
+    x |= (0xFFFF << bit_count);
+  }
+  return x;
+}
+
+/* mark n words from address, for anything that fills memory[] directly */
+void vm_mark_dirty(struct lc3_vm *vm, uint16_t address, size_t n) {
+  if (n > UINT16_MAX) {
+    memset(vm->dirty, 1, sizeof(vm->dirty));
+    return;
+  }
+  for (size_t i = 0; i < n; i += DIRTY_PAGE_WORDS) {
+    mark_dirty(vm, address + i);
+  }
+  if (n) {
+    mark_dirty(vm, address + n - 1);
+  }
+}
+
+/* update condition flags based on outcome of result (negative, zero, or
+ * positive */
+static void update_flags(struct lc3_vm *vm, uint16_t r) {
+  vm->flag_result = vm->reg[r];
+}
+
+/* current condition flags */
+static uint16_t cond_flags(struct lc3_vm *vm) {
+  if (vm->flag_result == FLAGS_SYNCED) {
+    return vm->reg[R_COND];
+  }
+  /* zero shifts FL_POS up to FL_ZRO, a 1 in the left-most bit up to FL_NEG */
+  return FL_POS << ((vm->flag_result == 0) + 2 * (vm->flag_result >> 15));
+}
+
+/* write pending condition flags back to reg[R_COND] */
+void vm_sync_flags(struct lc3_vm *vm) {
+  if (vm->flag_result != FLAGS_SYNCED) {
+    vm->reg[R_COND] = cond_flags(vm);
+    vm->flag_result = FLAGS_SYNCED;
+  }
+}
+
+static void decode_instr(uint16_t instr, struct decoded_instr *d) {
+  d->instr = instr;
+  d->op = instr >> 12;
+  d->dr = (instr >> 9) & 0x7;
+  d->sr1 = (instr >> 6) & 0x7;
+  d->sr2 = instr & 0x7;
+  d->imm_flag = 0;
+  d->imm = 0;
+
+  switch (d->op) {
+    case OP_ADD:
+    case OP_AND:
+      d->imm_flag = (instr >> 5) & 0x1;
+      d->imm = sign_extend(instr & 0x1f, 5);
+      break;
+    case OP_LDR:
+    case OP_STR:
+      d->imm = sign_extend(instr & 0x3f, 6);
+      break;
+    case OP_BR:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+      d->imm = sign_extend(instr & 0x1ff, 9);
+      break;
+    case OP_JSR:
+      d->imm_flag = (instr >> 11) & 0x1;
+      d->imm = sign_extend(instr & 0x7ff, 11);
+      break;
+  }
+  d->exec = d->op;
+  d->valid = 1;
+}
+
+/* forget the decodes on every page the n words from address touch before
+ * they are replaced, and on the one ahead for superinstructions running
+ * into them. clean pages have none to forget and aren't touched */
+static void invalidate_decode_pages(struct lc3_vm *vm, uint16_t address, size_t n) {
+  int first = (uint16_t)(address - 2) >> DIRTY_PAGE_SHIFT;
+  int last = (address + n - 1) >> DIRTY_PAGE_SHIFT;
+  for (int p = first <= last ? first : 0; p <= last && p < DIRTY_PAGES; p++) {
+    if (!vm->dirty[p]) {
+      continue;
+    }
+    size_t base = (size_t)p << DIRTY_PAGE_SHIFT;
+    memset(vm->decode_cache + base, 0, DIRTY_PAGE_WORDS * sizeof(vm->decode_cache[0]));
+    for (int i = 0; i < DIRTY_PAGE_WORDS; i++) {
+      vm->code_map[base + i] &= ~CODE_DECODED;
+    }
+  }
+}
+
+/* power-on state of one page of memory[] and everything cached for it */
+static void clear_page(struct lc3_vm *vm, int page) {
+  size_t base = (size_t)page << DIRTY_PAGE_SHIFT;
+  memset(vm->memory + base, 0, DIRTY_PAGE_WORDS * sizeof(vm->memory[0]));
+  memset(vm->code_map + base, 0, DIRTY_PAGE_WORDS * sizeof(vm->code_map[0]));
+  memset(vm->decode_cache + base, 0, DIRTY_PAGE_WORDS * sizeof(vm->decode_cache[0]));
+}
+
+/* put the machine back into its power-on state */
+void vm_reset(struct lc3_vm *vm) {
+  jit_flush(vm);
+  cfg_destroy(vm->cfg);
+  vm->cfg = NULL;
+  memset(vm->reg, 0, sizeof(vm->reg));
+  for (int p = 0; p < DIRTY_PAGES; p++) {
+    if (vm->dirty[p]) {
+      clear_page(vm, p);
+      vm->dirty[p] = 0;
+    }
+  }
+  vm->flag_result = FLAGS_SYNCED;
+  vm->reg[R_PC] = PC_START;
+  vm->psr = PSR_USER;
+  vm->saved_ssp = SSP_START;
+  vm->saved_usp = 0;
+  atomic_store(&vm->irq_check, 0);
+  vm->unflushed = NULL;
+  vm->stop = STOP_NONE;
+  reset_devices(vm);
+}
+
+/* vms are mapped rather than allocated: the pages come zeroed and aligned
+ * for snapshots, and only the ones a guest touches get backed */
+struct lc3_vm *vm_create() {
+  struct lc3_vm *vm = mmap(NULL, sizeof(*vm), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (vm == MAP_FAILED) {
+    return NULL;
+  }
+  vm->flag_result = FLAGS_SYNCED;
+  vm->reg[R_PC] = PC_START;
+  vm->psr = PSR_USER;
+  vm->saved_ssp = SSP_START;
+  vm->kbd = stdin;
+  vm->display = stdout;
+  install_devices(vm);
+  reset_devices(vm);
+  return vm;
+}
+
+void vm_destroy(struct lc3_vm *vm) {
+  if (vm) {
+    jit_destroy(vm);
+    vm_keyboard_destroy(vm->keyboard);
+    free(vm->profile);
+    vm_input_log_destroy(vm->input_log);
+    cfg_destroy(vm->cfg);
+    vm_debug_destroy(vm->debug);
+    trace_destroy(vm->trace);
+    munmap(vm, sizeof(*vm));
+  }
+}
+
+/* snapshots
+ *
+ * a snapshot keeps the registers and writes memory[], code_map[] and
+ * decode_cache[] to an unlinked file. restoring maps that file privately
+ * over the same range of the vm, so any number of vms can be started from
+ * one snapshot and only the pages a guest writes to ever get copied. the
+ * JIT isn't part of a snapshot, restored vms compile their code afresh.
+ * only dirty pages are written, the rest of the file is left as holes that
+ * read back as zeros. */
+
+/* write one page of memory[], code_map[] and decode_cache[] to the snapshot
+ * file, returns 0 on failure */
+static int write_snapshot_page(struct lc3_vm *vm, int fd, int page) {
+  size_t base = (size_t)page << DIRTY_PAGE_SHIFT;
+  uint8_t code_map[DIRTY_PAGE_WORDS];
+  struct decoded_instr decode[DIRTY_PAGE_WORDS];
+  size_t memory_size = DIRTY_PAGE_WORDS * sizeof(vm->memory[0]);
+
+  /* compiled code and the debugger stay behind, so drop their marks from
+   * the copy */
+  memcpy(decode, vm->decode_cache + base, sizeof(decode));
+  for (int i = 0; i < DIRTY_PAGE_WORDS; i++) {
+    code_map[i] = vm->code_map[base + i] & ~(CODE_COMPILED | CODE_BREAK | CODE_WATCH);
+    if (vm->code_map[base + i] & CODE_BREAK) {
+      decode[i].valid = 0;
+    }
+  }
+  return pwrite(fd, vm->memory + base, memory_size,
+                VM_SNAPSHOT_OFFSET(vm, vm->memory + base)) == (ssize_t)memory_size &&
+         pwrite(fd, code_map, sizeof(code_map),
+                VM_SNAPSHOT_OFFSET(vm, vm->code_map + base)) == (ssize_t)sizeof(code_map) &&
+         pwrite(fd, decode, sizeof(decode),
+                VM_SNAPSHOT_OFFSET(vm, vm->decode_cache + base)) == (ssize_t)sizeof(decode);
+}
+
+/* read one page back from the snapshot file, returns 0 on failure */
+static int read_snapshot_page(struct lc3_vm *vm, int fd, int page) {
+  size_t base = (size_t)page << DIRTY_PAGE_SHIFT;
+  size_t memory_size = DIRTY_PAGE_WORDS * sizeof(vm->memory[0]);
+  size_t code_map_size = DIRTY_PAGE_WORDS * sizeof(vm->code_map[0]);
+  size_t decode_size = DIRTY_PAGE_WORDS * sizeof(vm->decode_cache[0]);
+  return pread(fd, vm->memory + base, memory_size,
+               VM_SNAPSHOT_OFFSET(vm, vm->memory + base)) == (ssize_t)memory_size &&
+         pread(fd, vm->code_map + base, code_map_size,
+               VM_SNAPSHOT_OFFSET(vm, vm->code_map + base)) == (ssize_t)code_map_size &&
+         pread(fd, vm->decode_cache + base, decode_size,
+               VM_SNAPSHOT_OFFSET(vm, vm->decode_cache + base)) == (ssize_t)decode_size;
+}
+
+struct lc3_snapshot *vm_snapshot(struct lc3_vm *vm) {
+  struct lc3_snapshot *snap = calloc(1, sizeof(*snap));
+  if (!snap) {
+    return NULL;
+  }
+  memcpy(snap->reg, vm->reg, sizeof(vm->reg));
+  snap->flag_result = vm->flag_result;
+  snap->psr = vm->psr;
+  snap->saved_ssp = vm->saved_ssp;
+  snap->saved_usp = vm->saved_usp;
+  memcpy(snap->dirty, vm->dirty, sizeof(vm->dirty));
+
+  snap->file = tmpfile();
+  if (!snap->file) {
+    goto fail;
+  }
+  int fd = fileno(snap->file);
+  if (ftruncate(fd, VM_SNAPSHOT_SIZE(vm)) != 0) {
+    goto fail;
+  }
+  for (int p = 0; p < DIRTY_PAGES; p++) {
+    if (vm->dirty[p] && !write_snapshot_page(vm, fd, p)) {
+      goto fail;
+    }
+  }
+  return snap;
+
+fail:
+  if (snap->file) {
+    fclose(snap->file);
+  }
+  free(snap);
+  return NULL;
+}
+
+int vm_restore(struct lc3_vm *vm, const struct lc3_snapshot *snap) {
+  int fd = fileno(snap->file);
+  size_t size = VM_SNAPSHOT_SIZE(vm);
+  jit_flush(vm);
+
+  /* pages bigger than VM_PAGE_ALIGN can't be mapped over the range */
+  long page = sysconf(_SC_PAGESIZE);
+  int mapped = page > 0 && (uintptr_t)VM_SNAPSHOT_START(vm) % page == 0 && size % page == 0 &&
+               mmap(VM_SNAPSHOT_START(vm), size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+  if (!mapped) {
+    /* copying, only the pages either side touched */
+    for (int p = 0; p < DIRTY_PAGES; p++) {
+      if (snap->dirty[p] && !read_snapshot_page(vm, fd, p)) {
+        return 0;
+      }
+      if (!snap->dirty[p] && vm->dirty[p]) {
+        clear_page(vm, p);
+      }
+    }
+  }
+  memcpy(vm->dirty, snap->dirty, sizeof(vm->dirty));
+
+  /* the snapshot has the device marks of the vm it was taken from */
+  mark_devices(vm);
+  memcpy(vm->reg, snap->reg, sizeof(vm->reg));
+  vm->flag_result = snap->flag_result;
+  vm->psr = snap->psr;
+  vm->saved_ssp = snap->saved_ssp;
+  vm->saved_usp = snap->saved_usp;
+  atomic_store(&vm->irq_check, 1);
+  vm->kbd_empty_polls = 0;
+  vm->unflushed = NULL;
+  vm->stop = STOP_NONE;
+  return 1;
+}
+
+void vm_snapshot_destroy(struct lc3_snapshot *snap) {
+  if (snap) {
+    fclose(snap->file);
+    free(snap);
+  }
+}
+
+/* change endianness */
+uint16_t vm_swap16(uint16_t x) {
+    return (x << 8) | (x >> 8);
+}
+
+/* copy n big endian words from src to dst in host order */
+static void swap16_copy(uint16_t *dst, const uint16_t *src, size_t n) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i w = _mm_loadu_si128((const __m128i *)(src + i));
+    w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+    _mm_storeu_si128((__m128i *)(dst + i), w);
+  }
+#elif SIMD_AVAILABLE
+  for (; i + 8 <= n; i += 8) {
+    vst1q_u8((uint8_t *)(dst + i), vrev16q_u8(vld1q_u8((const uint8_t *)(src + i))));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = vm_swap16(src[i]);
+  }
+}
+
+/* place an image of size bytes (origin word first) into memory */
+static void load_image(struct lc3_vm *vm, const uint16_t *image, size_t size) {
+  if (size < sizeof(uint16_t)) {
+    return;
+  }
+
+  /* the origin tells us where in memory to place the image */
+  uint16_t origin = vm_swap16(image[0]);
+  size_t max_read = sizeof(vm->memory) / sizeof(vm->memory[0]) - origin;
+  size_t read = size / sizeof(uint16_t) - 1;
+  if (read > max_read) {
+    read = max_read;
+  }
+
+  if (read == 0) {
+    return;
+  }
+  invalidate_decode_pages(vm, origin, read);
+  jit_flush(vm);
+  swap16_copy(vm->memory + origin, image + 1, read);
+  vm_mark_dirty(vm, origin, read);
+}
+
+/* load program into memory from a file */
+void vm_read_image_file(struct lc3_vm *vm, FILE *file) {
+  /* origin plus the largest image that fits, in one fread */
+  size_t max_read = UINT16_MAX + 2;
+  uint16_t *image = malloc(max_read * sizeof(uint16_t));
+  if (!image) {
+    return;
+  }
+  size_t read = fread(image, sizeof(uint16_t), max_read, file);
+  load_image(vm, image, read * sizeof(uint16_t));
+  free(image);
+}
+
+/* images are mapped rather than read so the swap runs straight from the
+ * page cache into guest memory, anything that can't be mapped is read */
+int vm_read_image(struct lc3_vm *vm, const char* image_path) {
+  int fd = open(image_path, O_RDONLY);
+  if (fd < 0) { return 0; };
+
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  if (image != MAP_FAILED) {
+    load_image(vm, image, st.st_size);
+    munmap(image, st.st_size);
+    close(fd);
+    return 1;
+  }
+
+  FILE *file = fdopen(fd, "rb");
+  if (!file) {
+    close(fd);
+    return 0;
+  }
+  vm_read_image_file(vm, file);
+  fclose(file);
+  return 1;
+}
+
+/* get keyboard status, streams without a descriptor always have a key */
+static uint16_t check_key(int fd) {
+  if (fd < 0) {
+    return 1;
+  }
+
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(fd, &readfds);
+
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+  return select(fd + 1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+/* asynchronous keyboard
+ *
+ * a reader thread blocks in read() on the keyboard descriptor and pushes what
+ * arrives into a ring buffer, so a guest polling KBSR only has to compare two
+ * indices instead of making a select() call per read. a guest that keeps
+ * finding KBSR empty can optionally be put to sleep until a key comes in. */
+
+static void *keyboard_reader(void *arg) {
+  struct keyboard *kb = arg;
+  for (;;) {
+    /* wait for room */
+    pthread_mutex_lock(&kb->lock);
+    while (atomic_load(&kb->head) - atomic_load(&kb->tail) == KBD_RING_SIZE && !kb->closing) {
+      pthread_cond_wait(&kb->changed, &kb->lock);
+    }
+    int closing = kb->closing;
+    pthread_mutex_unlock(&kb->lock);
+
+    /* a key or vm_keyboard_destroy(), whichever comes first */
+    struct pollfd fds[2] = {{kb->fd, POLLIN, 0}, {kb->wake[0], POLLIN, 0}};
+    if (closing || poll(fds, 2, -1) < 0 || fds[1].revents) {
+      return NULL;
+    }
+    uint8_t c;
+    ssize_t n = read(kb->fd, &c, 1);
+    pthread_mutex_lock(&kb->lock);
+    if (n <= 0) {
+      atomic_store(&kb->eof, 1);
+    }
+    else {
+      unsigned head = atomic_load(&kb->head);
+      kb->ring[head % KBD_RING_SIZE] = c;
+      atomic_store(&kb->head, head + 1);
+      if (kb->notify) {
+        atomic_store(kb->notify, 1);
+      }
+    }
+    pthread_cond_broadcast(&kb->changed);
+    pthread_mutex_unlock(&kb->lock);
+
+    if (n <= 0) {
+      return NULL;
+    }
+  }
+}
+
+struct keyboard *vm_keyboard_create(int fd, int idle_sleep) {
+  struct keyboard *kb = calloc(1, sizeof(*kb));
+  if (!kb) {
+    return NULL;
+  }
+  kb->fd = fd;
+  kb->idle_sleep = idle_sleep;
+  if (pipe(kb->wake) != 0) {
+    free(kb);
+    return NULL;
+  }
+  pthread_mutex_init(&kb->lock, NULL);
+  pthread_cond_init(&kb->changed, NULL);
+  if (pthread_create(&kb->thread, NULL, keyboard_reader, kb) != 0) {
+    pthread_cond_destroy(&kb->changed);
+    pthread_mutex_destroy(&kb->lock);
+    close(kb->wake[0]);
+    close(kb->wake[1]);
+    free(kb);
+    return NULL;
+  }
+  return kb;
+}
+
+void vm_keyboard_destroy(struct keyboard *kb) {
+  if (!kb) {
+    return;
+  }
+  /* the reader waits for room on the condition or for a key in poll(),
+   * wake it from either */
+  pthread_mutex_lock(&kb->lock);
+  kb->closing = 1;
+  pthread_cond_broadcast(&kb->changed);
+  pthread_mutex_unlock(&kb->lock);
+  while (write(kb->wake[1], "", 1) < 0 && errno == EINTR) {
+  }
+  pthread_join(kb->thread, NULL);
+  close(kb->wake[0]);
+  close(kb->wake[1]);
+  pthread_cond_destroy(&kb->changed);
+  pthread_mutex_destroy(&kb->lock);
+  free(kb);
+}
+
+/* sleep until a key comes in after tail, the input ends or KBD_IDLE_MS pass */
+static void keyboard_wait(struct keyboard *kb, unsigned tail) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += KBD_IDLE_MS * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&kb->lock);
+  int waited = 0;
+  while (atomic_load(&kb->head) == tail && !atomic_load(&kb->eof) && !waited) {
+    waited = pthread_cond_timedwait(&kb->changed, &kb->lock, &deadline) != 0;
+  }
+  pthread_mutex_unlock(&kb->lock);
+}
+
+/* take the next key, returns -1 if none is buffered. no syscalls unless the
+ * guest has been spinning long enough to be put to sleep */
+static int keyboard_poll(struct keyboard *kb) {
+  unsigned tail = atomic_load_explicit(&kb->tail, memory_order_relaxed);
+  if (atomic_load_explicit(&kb->head, memory_order_acquire) == tail) {
+    if (!kb->idle_sleep || ++kb->spins < KBD_SPIN_POLLS) {
+      return -1;
+    }
+    kb->spins = 0;
+    keyboard_wait(kb, tail);
+    if (atomic_load(&kb->head) == tail) {
+      return -1;
+    }
+  }
+
+  kb->spins = 0;
+  int c = kb->ring[tail % KBD_RING_SIZE];
+  atomic_store_explicit(&kb->tail, tail + 1, memory_order_release);
+  /* the reader only needs waking when the ring was full */
+  if (atomic_load(&kb->head) - tail == KBD_RING_SIZE) {
+    pthread_mutex_lock(&kb->lock);
+    pthread_cond_broadcast(&kb->changed);
+    pthread_mutex_unlock(&kb->lock);
+  }
+  return c;
+}
+
+/* wait for the next key, EOF once the input is exhausted */
+static int keyboard_getc(struct keyboard *kb) {
+  pthread_mutex_lock(&kb->lock);
+  while (atomic_load(&kb->head) == atomic_load(&kb->tail) && !atomic_load(&kb->eof)) {
+    pthread_cond_wait(&kb->changed, &kb->lock);
+  }
+  pthread_mutex_unlock(&kb->lock);
+
+  if (atomic_load(&kb->head) == atomic_load(&kb->tail)) {
+    return EOF;
+  }
+  return keyboard_poll(kb);
+}
+
+/* read the guest keyboard through a ring buffer from now on. GETC and IN
+ * take their input from it as well, whatever stream they were handed */
+int vm_attach_keyboard(struct lc3_vm *vm, int idle_sleep) {
+  struct keyboard *kb = vm_keyboard_create(fileno(vm->kbd), idle_sleep);
+  if (!kb) {
+    return 0;
+  }
+  vm_keyboard_destroy(vm->keyboard);
+  vm->keyboard = kb;
+  /* a key coming in may raise a keyboard interrupt */
+  pthread_mutex_lock(&kb->lock);
+  kb->notify = &vm->irq_check;
+  pthread_mutex_unlock(&kb->lock);
+  return 1;
+}
+
+/* key for a KBSR read straight from the host, -1 when none is waiting. a
+ * stream at end of file always has EOF ready, as 0xFFFF. blocking input
+ * skips the select() and lets the read wait for the key */
+static int host_poll_key(struct lc3_vm *vm) {
+  if (vm->keyboard) {
+    return keyboard_poll(vm->keyboard);
+  }
+  if (!vm->kbd) {
+    return -1;
+  }
+  if (vm->kbd_blocking || check_key(fileno(vm->kbd))) {
+    return (uint16_t)getc(vm->kbd);
+  }
+  return -1;
+}
+
+/* character for an input trap straight from the host */
+static int host_getc(struct lc3_vm *vm, FILE *in) {
+  if (vm->keyboard) {
+    return keyboard_getc(vm->keyboard);
+  }
+  return getc(in);
+}
+
+/* input record/replay
+ *
+ * a recording logs every answer the guest got from the keyboard: each
+ * character an input trap read and each key a KBSR read found, together with
+ * the number of empty KBSR reads before it and the instruction it happened
+ * at. replaying the log hands the guest the same answers without a terminal,
+ * so an interactive program runs the same way again as fast as it can.
+ * replays either make the guest wait out the recorded empty reads or, when
+ * skipping spins, hand over the next key at the first read that wants one.
+ *
+ * the log is a "LC3I" header and a version byte followed by one record per
+ * event: a kind byte, then the instructions since the previous event, the
+ * empty KBSR reads since the previous event and the value as LEB128 varints.
+ * instructions are only counted by the reference core, see vm_run_engine(). */
+
+static void write_varint(FILE *f, uint64_t v) {
+  while (v >= 0x80) {
+    putc((int)(v & 0x7F) | 0x80, f);
+    v >>= 7;
+  }
+  putc((int)v, f);
+}
+
+static int read_varint(FILE *f, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(f);
+    if (c == EOF) {
+      return 0;
+    }
+    *v |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void input_log_read_next(struct input_log *log) {
+  struct input_event *e = &log->next;
+  uint64_t delta, value;
+  e->kind = getc(log->file);
+  if ((e->kind != EVENT_TRAP && e->kind != EVENT_KBSR) ||
+      !read_varint(log->file, &delta) || !read_varint(log->file, &e->polls) ||
+      !read_varint(log->file, &value)) {
+    e->kind = EVENT_NONE;
+    return;
+  }
+  e->retired = log->last + delta;
+  e->value = (uint16_t)value;
+  log->last = e->retired;
+}
+
+static void input_log_write(struct input_log *log, int kind, uint16_t value) {
+  putc(kind, log->file);
+  write_varint(log->file, log->retired - log->last);
+  write_varint(log->file, log->polls);
+  write_varint(log->file, value);
+  log->last = log->retired;
+  log->polls = 0;
+  log->events++;
+}
+
+/* hand the guest the pending event */
+static uint16_t input_log_consume(struct input_log *log) {
+  uint16_t value = log->next.value;
+  if (log->mode == INPUT_REPLAY && log->counted && log->next.retired != log->retired &&
+      !log->diverged) {
+    log->diverged = log->events + 1;
+  }
+  log->events++;
+  input_log_read_next(log);
+  return value;
+}
+
+/* record to or replay from file, which the caller keeps open. NULL when a
+ * replay file has no valid header */
+static struct input_log *input_log_create(FILE *file, int mode) {
+  static const char magic[4] = {'L', 'C', '3', 'I'};
+  char header[5];
+  if (mode == INPUT_RECORD) {
+    fwrite(magic, 1, sizeof(magic), file);
+    putc(INPUT_LOG_VERSION, file);
+  }
+  else if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+           memcmp(header, magic, sizeof(magic)) != 0 || header[4] != INPUT_LOG_VERSION) {
+    return NULL;
+  }
+
+  struct input_log *log = calloc(1, sizeof(*log));
+  if (!log) {
+    return NULL;
+  }
+  log->file = file;
+  log->mode = mode;
+  if (mode != INPUT_RECORD) {
+    input_log_read_next(log);
+  }
+  return log;
+}
+
+void vm_input_log_destroy(struct input_log *log) {
+  if (log) {
+    fflush(log->file);
+    free(log);
+  }
+}
+
+int vm_attach_input_log(struct lc3_vm *vm, FILE *file, int mode) {
+  struct input_log *log = input_log_create(file, mode);
+  if (!log) {
+    return 0;
+  }
+  vm_input_log_destroy(vm->input_log);
+  vm->input_log = log;
+  return 1;
+}
+
+/* key for a KBSR read, -1 when none is waiting */
+static int input_log_poll_key(struct lc3_vm *vm) {
+  struct input_log *log = vm->input_log;
+  if (log->mode == INPUT_RECORD) {
+    int c = host_poll_key(vm);
+    if (c < 0) {
+      log->polls++;
+    }
+    else {
+      input_log_write(log, EVENT_KBSR, c);
+    }
+    return c;
+  }
+
+  /* past the end the keyboard reads like a stream at end of file */
+  if (log->next.kind == EVENT_NONE) {
+    return 0xFFFF;
+  }
+  if (log->next.kind != EVENT_KBSR) {
+    return -1;
+  }
+  if (log->mode == INPUT_REPLAY && log->next.polls > 0) {
+    log->next.polls--;
+    return -1;
+  }
+  return input_log_consume(log);
+}
+
+static int input_log_getc(struct lc3_vm *vm, FILE *in) {
+  struct input_log *log = vm->input_log;
+  if (log->mode == INPUT_RECORD) {
+    int c = host_getc(vm, in);
+    input_log_write(log, EVENT_TRAP, (uint16_t)c);
+    return c;
+  }
+
+  if (log->next.kind != EVENT_TRAP) {
+    /* the guest wants input the recording never gave it */
+    if (log->next.kind != EVENT_NONE && !log->diverged) {
+      log->diverged = log->events + 1;
+    }
+    return EOF;
+  }
+  uint16_t c = input_log_consume(log);
+  return c == 0xFFFF ? EOF : c;
+}
+
+/* next character for the input traps, EOF at end of input */
+static int input_getc(struct lc3_vm *vm, FILE *in) {
+  if (vm->input_log) {
+    return input_log_getc(vm, in);
+  }
+  return host_getc(vm, in);
+}
+
+/* next character for GETC and IN */
+static uint16_t read_char(struct lc3_vm *vm, FILE *in) {
+  return input_getc(vm, in);
+}
+
+/* guest output
+ *
+ * traps write into the stdio buffer of their stream and only flush when the
+ * guest is about to wait for input or halts. interactive output is line
+ * buffered on top of that so complete lines show up as they are written,
+ * batch output goes out whenever the buffer fills. */
+
+void vm_set_output_mode(FILE *out, char *buffer, size_t size, int mode) {
+  setvbuf(out, buffer, mode == OUTPUT_BATCH ? _IOFBF : _IOLBF, size);
+}
+
+/* push out whatever the guest wrote, called before it waits on the keyboard.
+ * input from a file or a replayed log never waits on what the guest printed */
+void vm_flush_output(struct lc3_vm *vm) {
+  int replaying = vm->input_log && vm->input_log->mode != INPUT_RECORD;
+  if (vm->unflushed && !vm->kbd_blocking && !replaying) {
+    fflush(vm->unflushed);
+    vm->unflushed = NULL;
+  }
+}
+
+/* drop the decode of address and any superinstruction that covers it */
+static void invalidate_decode(struct lc3_vm *vm, uint16_t address) {
+  vm->decode_cache[address].valid = 0;
+  vm->decode_cache[(uint16_t)(address - 1)].valid = 0;
+  vm->decode_cache[(uint16_t)(address - 2)].valid = 0;
+}
+
+/* drop everything derived from the word at address after it changed */
+static void invalidate_code(struct lc3_vm *vm, uint16_t address) {
+  invalidate_decode(vm, address);
+  if (vm->code_map[address] & CODE_COMPILED) {
+    jit_flush(vm);
+  }
+  vm->code_map[address] &= CODE_DEVICE | CODE_BREAK | CODE_WATCH;
+}
+
+int vm_mem_write_slow(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  if (TRACING && vm->trace) {
+    trace_write(vm, address, val);
+    if (!vm->code_map[address]) {
+      return 0;
+    }
+  }
+  if (vm->code_map[address] & CODE_DEVICE) {
+    return vm->devices[address - MR_DEVICE_BASE].write(vm, address, val);
+  }
+  invalidate_code(vm, address);
+  if (vm->code_map[address] & CODE_WATCH) {
+    return debug_watch_hit(vm, address);
+  }
+  return 0;
+}
+
+/* move the next key, if there is one, into KBDR */
+static int fetch_key(struct lc3_vm *vm) {
+  int c = vm->input_log ? input_log_poll_key(vm) : host_poll_key(vm);
+  if (c < 0) {
+    return 0;
+  }
+  vm->memory[MR_KBSR] |= KBSR_READY;
+  vm->memory[MR_KBDR] = c;
+  return 1;
+}
+
+/* reading the memory mapped keyboard register triggers a key check unless
+ * a key is still waiting in KBDR */
+static uint16_t kbsr_read(struct lc3_vm *vm, uint16_t address) {
+  if (!(vm->memory[MR_KBSR] & KBSR_READY) && !fetch_key(vm)) {
+    vm->kbd_empty_polls++;
+    vm_flush_output(vm);
+  }
+  return vm->memory[address];
+}
+
+static int kbsr_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[address] = val & (KBSR_READY | KBSR_IE);
+  if (val & KBSR_IE) {
+    atomic_store(&vm->irq_check, 1);
+  }
+  return 0;
+}
+
+static uint16_t kbdr_read(struct lc3_vm *vm, uint16_t address) {
+  vm->memory[MR_KBSR] &= ~KBSR_READY;
+  return vm->memory[address];
+}
+
+/* the guest sits in a loop that does nothing but read KBSR and just found it
+ * empty, so there is no point in asking again right away. waits for the
+ * reader thread to bring a key, other inputs are polled at full speed as
+ * before and replays don't take any wall clock time */
+static void kbsr_idle(struct lc3_vm *vm) {
+  struct keyboard *kb = vm->keyboard;
+  if (kb && (!vm->input_log || vm->input_log->mode == INPUT_RECORD)) {
+    keyboard_wait(kb, atomic_load(&kb->tail));
+  }
+}
+
+static void set_psr(struct lc3_vm *vm, uint16_t psr) {
+  vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+  vm->reg[R_COND] = psr & (FL_NEG | FL_ZRO | FL_POS);
+  vm->flag_result = FLAGS_SYNCED;
+  /* a lower priority may let a pending interrupt in */
+  atomic_store(&vm->irq_check, 1);
+}
+
+static uint16_t psr_read(struct lc3_vm *vm, uint16_t address) {
+  return vm->psr | cond_flags(vm);
+}
+
+/* user mode can't change the PSR. compiled code keeps the condition codes
+ * in host flags, so a block that writes them has to be left */
+static int psr_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  if (!(vm->psr & PSR_USER)) {
+    set_psr(vm, val);
+    jit_flush(vm);
+  }
+  return 0;
+}
+
+/* the display is always ready, DDR writes go out with the trap output */
+static uint16_t dsr_read(struct lc3_vm *vm, uint16_t address) {
+  return 1 << 15;
+}
+
+static int ddr_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  putc((char)(val & 0xff), vm->display);
+  vm->unflushed = vm->display;
+  return 0;
+}
+
+static int mcr_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  if (val & (1 << 15)) {
+    return 0;
+  }
+  vm->stop = STOP_MCR;
+  return 1;
+}
+
+uint64_t vm_monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/* the timer only looks at the clock when TMR is read */
+static uint16_t tmr_read(struct lc3_vm *vm, uint16_t address) {
+  vm->memory[MR_TMR] = 0;
+  if (vm->timer_deadline && vm->memory[MR_TMI]) {
+    uint64_t now = vm_monotonic_ns();
+    if (now >= vm->timer_deadline) {
+      uint64_t interval = vm->memory[MR_TMI] * 1000000ull;
+      /* ticks missed while nobody looked collapse into one */
+      vm->timer_deadline += ((now - vm->timer_deadline) / interval + 1) * interval;
+      vm->memory[MR_TMR] = 1 << 15;
+    }
+  }
+  return vm->memory[MR_TMR];
+}
+
+static int tmi_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->timer_deadline = val ? vm_monotonic_ns() + val * 1000000ull : 0;
+  return 0;
+}
+
+/* put handlers on the register at address, NULL ones leave it to memory */
+void vm_map_device(struct lc3_vm *vm, uint16_t address,
+                   uint16_t (*read)(struct lc3_vm *, uint16_t),
+                   int (*write)(struct lc3_vm *, uint16_t, uint16_t)) {
+  struct device *dev = &vm->devices[address - MR_DEVICE_BASE];
+  dev->read = read;
+  dev->write = write;
+  mark_devices(vm);
+}
+
+/* flag the registers with write handlers in code_map */
+static void mark_devices(struct lc3_vm *vm) {
+  vm_mark_dirty(vm, MR_DEVICE_BASE, DEVICE_PAGE_SIZE);
+  for (int i = 0; i < DEVICE_PAGE_SIZE; i++) {
+    uint8_t *entry = &vm->code_map[MR_DEVICE_BASE + i];
+    *entry = vm->devices[i].write ? (*entry | CODE_DEVICE) : (*entry & ~CODE_DEVICE);
+  }
+}
+
+static void install_devices(struct lc3_vm *vm) {
+  vm_map_device(vm, MR_KBSR, kbsr_read, kbsr_write);
+  vm_map_device(vm, MR_KBDR, kbdr_read, NULL);
+  vm_map_device(vm, MR_DSR, dsr_read, NULL);
+  vm_map_device(vm, MR_DDR, NULL, ddr_write);
+  vm_map_device(vm, MR_TMR, tmr_read, NULL);
+  vm_map_device(vm, MR_TMI, NULL, tmi_write);
+  vm_map_device(vm, MR_PSR, psr_read, psr_write);
+  vm_map_device(vm, MR_MCR, NULL, mcr_write);
+}
+
+/* power-on state of the devices, vm_reset() has already cleared memory */
+static void reset_devices(struct lc3_vm *vm) {
+  mark_devices(vm);
+  vm->memory[MR_MCR] = 1 << 15;
+  vm->timer_deadline = 0;
+}
+
+uint16_t vm_device_page_read(struct lc3_vm *vm, uint16_t address) {
+  struct device *dev = &vm->devices[address - MR_DEVICE_BASE];
+  return dev->read ? dev->read(vm, address) : vm->memory[address];
+}
+
+/* interrupts
+ *
+ * an interrupt or exception pushes the PSR and PC onto the supervisor stack,
+ * switching R6 over to it first when coming from user mode, and continues at
+ * the address in its entry of the vector table. RTI undoes that. interrupts
+ * are only looked for between basic blocks, and only when irq_check is set:
+ * by the keyboard reader thread when a key comes in, by enabling KBSR_IE and
+ * by anything that lowers the priority. without a reader thread to report
+ * keys the check stays armed and polls the keyboard at every block boundary
+ * while the interrupt is enabled. */
+
+static void raise_interrupt(struct lc3_vm *vm, uint8_t vector, int priority) {
+  uint16_t psr = vm->psr | cond_flags(vm);
+  if (psr & PSR_USER) {
+    vm->saved_usp = vm->reg[R_R6];
+    vm->reg[R_R6] = vm->saved_ssp;
+  }
+  mem_write(vm, --vm->reg[R_R6], psr);
+  mem_write(vm, --vm->reg[R_R6], vm->reg[R_PC]);
+  vm->psr = priority << PSR_PRIORITY_SHIFT;
+  vm->reg[R_COND] = FL_ZRO;
+  vm->flag_result = FLAGS_SYNCED;
+  vm->reg[R_PC] = mem_read(vm, IVT_BASE + vector);
+}
+
+/* exceptions keep the priority they were raised at */
+static void raise_exception(struct lc3_vm *vm, uint8_t vector) {
+  raise_interrupt(vm, vector, (vm->psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT);
+}
+
+static void exec_rti(struct lc3_vm *vm) {
+  if (vm->psr & PSR_USER) {
+    raise_exception(vm, VEC_PRIVILEGE);
+    return;
+  }
+  vm->reg[R_PC] = mem_read(vm, vm->reg[R_R6]++);
+  uint16_t psr = mem_read(vm, vm->reg[R_R6]++);
+  set_psr(vm, psr);
+  if (psr & PSR_USER) {
+    vm->saved_ssp = vm->reg[R_R6];
+    vm->reg[R_R6] = vm->saved_usp;
+  }
+}
+
+/* take the keyboard interrupt if it is enabled, has a key and outranks the
+ * running code */
+void vm_check_interrupts(struct lc3_vm *vm) {
+  atomic_store_explicit(&vm->irq_check, 0, memory_order_relaxed);
+  uint16_t kbsr = vm->memory[MR_KBSR];
+  if (!(kbsr & KBSR_IE) || (vm->psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT >= KBD_PRIORITY) {
+    return;
+  }
+  if (!(kbsr & KBSR_READY) && !fetch_key(vm)) {
+    if (!vm->keyboard) {
+      atomic_store_explicit(&vm->irq_check, 1, memory_order_relaxed);
+    }
+    return;
+  }
+  raise_interrupt(vm, VEC_KEYBOARD, KBD_PRIORITY);
+}
+
+/* superinstructions
+ *
+ * vm_run() runs a few common sequences through one handler: a constant load
+ * (AND Rx, Ry, #0 then ADD Rx, Rx, #imm), a flag-setting ADD or AND straight
+ * into a BR, an LDR/ADD/STR read-modify-write and the two idle loops below.
+ * the decode of the first
+ * word carries the fused handler in exec, which reads the rest of the
+ * sequence from the decodes right after it. fusing makes sure those are
+ * valid and invalidate_code() drops a decode together with the two before
+ * it, so a store into a sequence refuses its head. a jump into the middle of
+ * one just runs the plain decode there.
+ *
+ * a guest waiting for a key in an LDI from KBSR and a BRzp back to it asks
+ * the keyboard once per kbsr_idle() wait rather than as fast as it can, and
+ * a countdown of an ADD of a negative immediate and a BRp back to it runs all
+ * its iterations at once. the instructions they retire and the state they
+ * leave are those of the loop run one instruction at a time. */
+
+/* the decode of a word that a fused sequence covers */
+static const struct decoded_instr *decode_follower(struct lc3_vm *vm, uint16_t address) {
+  struct decoded_instr *d = &vm->decode_cache[address];
+  if (!d->valid) {
+    decode_instr(vm->memory[address], d);
+    vm->code_map[address] |= CODE_DECODED;
+    mark_dirty(vm, address);
+  }
+  return d;
+}
+
+static void fuse_instr(struct lc3_vm *vm, uint16_t address, struct decoded_instr *d) {
+  /* sequences stay clear of the device page and of breakpoints */
+  if (address + 2 >= MR_DEVICE_BASE ||
+      (vm->code_map[address + 1] | vm->code_map[address + 2]) & CODE_BREAK) {
+    return;
+  }
+
+  int next = vm->memory[address + 1] >> 12;
+  int after = vm->memory[address + 2] >> 12;
+  /* a BR right behind that goes back to the head and nowhere else */
+  const struct decoded_instr *br = next == OP_BR ? decode_follower(vm, address + 1) : NULL;
+  int loop = br && br->imm == (uint16_t)-2;
+  if (loop && d->op == OP_LDI && br->dr == (FL_ZRO | FL_POS) &&
+      vm->memory[(uint16_t)(address + 1 + d->imm)] == MR_KBSR) {
+    d->exec = EXEC_KBSR_SPIN;
+  }
+  else if (loop && d->op == OP_ADD && br->dr == FL_POS && d->imm_flag &&
+           d->dr == d->sr1 && (int16_t)d->imm < 0) {
+    d->exec = EXEC_COUNTDOWN;
+  }
+  else if (d->op == OP_AND && d->imm_flag && d->imm == 0 && next == OP_ADD) {
+    const struct decoded_instr *add = decode_follower(vm, address + 1);
+    if (add->imm_flag && add->dr == d->dr && add->sr1 == d->dr) {
+      d->exec = EXEC_CONST;
+    }
+  }
+  else if ((d->op == OP_ADD || d->op == OP_AND) && br) {
+    d->exec = d->op == OP_ADD ? EXEC_ADD_BR : EXEC_AND_BR;
+  }
+  else if (d->op == OP_LDR && next == OP_ADD && after == OP_STR) {
+    decode_follower(vm, address + 1);
+    decode_follower(vm, address + 2);
+    d->exec = EXEC_LDR_ADD_STR;
+  }
+}
+
+/* fill in the decode cache entry for address */
+static void decode_cache_miss(struct lc3_vm *vm, uint16_t address, struct decoded_instr *d) {
+  /* the device page can change under us, never keep a decode from it */
+  if (address >= MR_DEVICE_BASE) {
+    decode_instr(vm_device_page_read(vm, address), d);
+    d->valid = 0;
+  }
+  else {
+    decode_instr(vm->memory[address], d);
+    vm->code_map[address] |= CODE_DECODED;
+    mark_dirty(vm, address);
+    fuse_instr(vm, address, d);
+    if (vm->code_map[address] & CODE_BREAK) {
+      d->exec = EXEC_BREAK;
+    }
+  }
+}
+
+/* string traps
+ *
+ * PUTS and PUTSP gather their string into a local buffer and hand it to
+ * stdio in one fwrite(). the scan looks at 8 words at a time with SSE2 or
+ * NEON, chunks without a terminator (or, for PUTSP, an odd length) are
+ * copied whole and only the last one is finished word by word. strings stop
+ * at the end of memory whether or not they are terminated. */
+
+/* one char per word. packs up to n words from src into dst, returns the
+ * number of words consumed, stopping at a zero word which *done is set for */
+static size_t pack_puts(const uint16_t *src, size_t n, char *dst, int *done) {
+  size_t i = 0;
+#if SIMD_AVAILABLE
+  for (; i + 8 <= n; i += 8) {
+#if defined(__SSE2__)
+    __m128i w = _mm_loadu_si128((const __m128i *)(src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(w, _mm_setzero_si128()))) {
+      break;
+    }
+    w = _mm_and_si128(w, _mm_set1_epi16(0xFF));
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(w, w));
+#else
+    uint16x8_t w = vld1q_u16(src + i);
+    if (vminvq_u16(w) == 0) {
+      break;
+    }
+    vst1_u8((uint8_t *)(dst + i), vmovn_u16(w));
+#endif
+  }
+#endif
+  for (; i < n; i++) {
+    if (!src[i]) {
+      *done = 1;
+      return i;
+    }
+    dst[i] = (char)(src[i] & 0xff);
+  }
+  return i;
+}
+
+/* two chars per word, low byte first, a zero high byte is skipped. returns
+ * the number of words consumed as above, *len is the number of chars */
+static size_t pack_putsp(const uint16_t *src, size_t n, char *dst, size_t *len, int *done) {
+  size_t i = 0;
+  size_t out = 0;
+#if SIMD_AVAILABLE
+  /* chunks where every word has a nonzero high byte are already laid out
+   * as the chars they're printed as on a little endian host */
+  for (; i + 8 <= n; i += 8) {
+#if defined(__SSE2__)
+    __m128i w = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i high = _mm_and_si128(w, _mm_set1_epi16((short)0xFF00));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128()))) {
+      break;
+    }
+    _mm_storeu_si128((__m128i *)(dst + out), w);
+#else
+    uint16x8_t w = vld1q_u16(src + i);
+    if (vminvq_u16(vandq_u16(w, vdupq_n_u16(0xFF00))) == 0) {
+      break;
+    }
+    vst1q_u16((uint16_t *)(dst + out), w);
+#endif
+    out += 16;
+  }
+#endif
+  for (; i < n; i++) {
+    if (!src[i]) {
+      *done = 1;
+      break;
+    }
+    dst[out++] = (char)(src[i] & 0xff);
+    char c = src[i] >> 8;
+    if (c) {
+      dst[out++] = c;
+    }
+  }
+  *len = out;
+  return i;
+}
+
+/* PUTS and PUTSP on the string at address */
+static void write_string(struct lc3_vm *vm, uint16_t address, int packed, FILE *out) {
+  char buf[2 * STRING_CHUNK];
+  size_t left = sizeof(vm->memory) / sizeof(vm->memory[0]) - address;
+  const uint16_t *word = vm->memory + address;
+  int done = 0;
+
+  while (!done && left > 0) {
+    size_t n = left < STRING_CHUNK ? left : STRING_CHUNK;
+    size_t len;
+    if (packed) {
+      n = pack_putsp(word, n, buf, &len, &done);
+    }
+    else {
+      n = len = pack_puts(word, n, buf, &done);
+    }
+    fwrite(buf, 1, len, out);
+    word += n;
+    left -= n;
+  }
+}
+
+/* bulk I/O traps
+ *
+ * vectors past HALT that move a whole buffer per TRAP. buffers are given as
+ * an address and a length in words and wrap around the top of memory like
+ * any other guest access. stores go through mem_write() so cached code and
+ * devices see them. */
+
+/* store n words from src at address, returns nonzero if a device stopped
+ * the machine */
+static int mem_write_block(struct lc3_vm *vm, uint16_t address, const uint16_t *src, size_t n) {
+  int stop = 0;
+  for (size_t i = 0; i < n; i++) {
+    stop |= mem_write(vm, address + i, src[i]);
+  }
+  return stop;
+}
+
+/* count words at address handed out for the host to use in place. nothing
+ * cached for them survives, so the host may change code through the view.
+ * watchpoints and the trace only hear of its writes through the view of a
+ * trap hook, see run_trap_hook() */
+static struct lc3_view vm_view(struct lc3_vm *vm, uint16_t address, size_t count) {
+  struct lc3_view view = {NULL, 0};
+  if (address + count > MR_DEVICE_BASE) {
+    return view;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (vm->code_map[address + i]) {
+      invalidate_code(vm, address + i);
+    }
+  }
+  vm_mark_dirty(vm, address, count);
+  view.data = vm->memory + address;
+  view.len = count;
+  return view;
+}
+
+/* run the host routine for vector on a view of the R1 words at R0. what it
+ * stored in place is caught up on once it returns: the words are dropped
+ * from the caches again, and with a debugger or a trace attached the ones
+ * that changed go through mem_write() for their watchpoints and records.
+ * returns 0 to stop the machine */
+static int run_trap_hook(struct lc3_vm *vm, uint8_t vector) {
+  const struct trap_hook *hook = &vm->trap_hooks[vector];
+  struct lc3_view view = vm_view(vm, vm->reg[R_R0], vm->reg[R_R1]);
+  int replay = vm->debug || vm->trace;
+  uint16_t *before = replay && view.len ? malloc(view.len * sizeof(before[0])) : NULL;
+  if (before) {
+    memcpy(before, view.data, view.len * sizeof(before[0]));
+  }
+  int running = hook->fn(vm, vector, view, hook->ctx);
+
+  uint16_t address = view.data ? view.data - vm->memory : 0;
+  int stop = 0;
+  for (size_t i = 0; i < view.len; i++) {
+    /* without a copy to compare with every word counts as written */
+    if (replay && (!before || before[i] != view.data[i])) {
+      stop |= mem_write(vm, address + i, view.data[i]);
+    }
+    else if (vm->code_map[address + i]) {
+      invalidate_code(vm, address + i);
+    }
+  }
+  vm_mark_dirty(vm, address, view.len);
+  free(before);
+  return running && !stop;
+}
+
+/* R0 = buffer, R1 = size in words. reads up to R1 - 1 characters, through
+ * the first newline, and zero terminates them. R0 = characters read */
+static int trap_readline(struct lc3_vm *vm, FILE *in, FILE *out) {
+  uint16_t address = vm->reg[R_R0];
+  uint16_t size = vm->reg[R_R1];
+  if (size == 0) {
+    vm->reg[R_R0] = 0;
+    return 1;
+  }
+
+  vm_flush_output(vm);
+  uint16_t n = 0;
+  int stop = 0;
+  while (n < size - 1) {
+    int c = input_getc(vm, in);
+    if (c == EOF) {
+      break;
+    }
+    stop |= mem_write(vm, address + n++, (uint16_t)c);
+    if (c == '\n') {
+      break;
+    }
+  }
+  stop |= mem_write(vm, address + n, 0);
+  vm->reg[R_R0] = n;
+  return !stop;
+}
+
+/* R0 = buffer, R1 = count. reads R1 characters, one per word, stopping
+ * early at end of input. R0 = characters read */
+static int trap_read(struct lc3_vm *vm, FILE *in, FILE *out) {
+  uint16_t address = vm->reg[R_R0];
+  uint16_t count = vm->reg[R_R1];
+  uint16_t buf[STRING_CHUNK];
+  uint16_t n = 0;
+  int stop = 0;
+
+  vm_flush_output(vm);
+  while (n < count) {
+    size_t len = 0;
+    size_t want = count - n < STRING_CHUNK ? count - n : STRING_CHUNK;
+    if (vm->keyboard || vm->input_log) {
+      for (int c; len < want && (c = input_getc(vm, in)) != EOF;) {
+        buf[len++] = (uint16_t)c;
+      }
+    }
+    else {
+      /* let stdio hand over its buffer in one go */
+      char bytes[STRING_CHUNK];
+      len = fread(bytes, 1, want, in);
+      for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)bytes[i];
+      }
+    }
+    stop |= mem_write_block(vm, address + n, buf, len);
+    n += len;
+    if (len < want) {
+      break;
+    }
+  }
+  vm->reg[R_R0] = n;
+  return !stop;
+}
+
+/* R0 = buffer, R1 = count. writes the low byte of R1 words */
+static int trap_write(struct lc3_vm *vm, FILE *in, FILE *out) {
+  uint16_t address = vm->reg[R_R0];
+  size_t left = vm->reg[R_R1];
+  char buf[STRING_CHUNK];
+  while (left > 0) {
+    size_t n = left < STRING_CHUNK ? left : STRING_CHUNK;
+    for (size_t i = 0; i < n; i++) {
+      buf[i] = (char)(vm->memory[(uint16_t)(address + i)] & 0xff);
+    }
+    fwrite(buf, 1, n, out);
+    address += n;
+    left -= n;
+  }
+  vm->unflushed = out;
+  return 1;
+}
+
+/* R0 = destination, R1 = source, R2 = count. overlapping blocks copy like
+ * memmove(): backward when the destination starts inside the source, so
+ * every source word is read before it is overwritten. a block longer than
+ * half of memory can overlap at both ends, then the words that wrap around
+ * are read after they were copied to */
+static int trap_memcpy(struct lc3_vm *vm, FILE *in, FILE *out) {
+  uint16_t dst = vm->reg[R_R0];
+  uint16_t src = vm->reg[R_R1];
+  size_t n = vm->reg[R_R2];
+  int stop = 0;
+  if (dst != src && (uint16_t)(dst - src) < n) {
+    for (size_t i = n; i-- > 0;) {
+      stop |= mem_write(vm, dst + i, vm->memory[(uint16_t)(src + i)]);
+    }
+  }
+  else {
+    for (size_t i = 0; i < n; i++) {
+      stop |= mem_write(vm, dst + i, vm->memory[(uint16_t)(src + i)]);
+    }
+  }
+  return !stop;
+}
+
+/* R0 = destination, R1 = value, R2 = count */
+static int trap_memset(struct lc3_vm *vm, FILE *in, FILE *out) {
+  uint16_t dst = vm->reg[R_R0];
+  uint16_t val = vm->reg[R_R1];
+  int stop = 0;
+  for (size_t i = 0; i < vm->reg[R_R2]; i++) {
+    stop |= mem_write(vm, dst + i, val);
+  }
+  return !stop;
+}
+
+static const struct trap_ext trap_exts[0x100] = {
+  [TRAP_READLINE] = {trap_readline, 1},
+  [TRAP_READ] = {trap_read, 1},
+  [TRAP_WRITE] = {trap_write, 0},
+  [TRAP_MEMCPY] = {trap_memcpy, 0},
+  [TRAP_MEMSET] = {trap_memset, 0}
+};
+
+/* execute trap routine */
+int vm_execute_trap(struct lc3_vm *vm, uint16_t instr, FILE *in, FILE *out) {
+  int running = 1;
+  switch (instr & 0xFF) {
+    case TRAP_GETC:
+      {
+        vm_flush_output(vm);
+        uint16_t c = read_char(vm, in);
+        if (c == 0xFFFF && vm->eof_stops) {
+          vm->stop = STOP_EOF;
+          running = 0;
+          break;
+        }
+        vm->reg[R_R0] = c;
+      }
+      break;
+    case TRAP_OUT:
+      {
+        char c = (char)vm->reg[R_R0 & 0xff];
+        putc(c, out);
+        vm->unflushed = out;
+      }
+      break;
+    case TRAP_PUTS:
+      {
+        /* one char per word */
+        write_string(vm, vm->reg[R_R0], 0, out);
+        vm->unflushed = out;
+      }
+      break;
+    case TRAP_IN:
+      {
+        /* the prompt only has to be out before a wait on the terminal */
+        fprintf(out, "Enter a character: ");
+        vm->unflushed = out;
+        vm_flush_output(vm);
+
+        uint16_t c = read_char(vm, in);
+        if (c == 0xFFFF && vm->eof_stops) {
+          vm->stop = STOP_EOF;
+          running = 0;
+          break;
+        }
+        putc((char)c, out);
+        vm->unflushed = out;
+
+        vm->reg[R_R0] = c;
+      }
+      break;
+    case TRAP_PUTSP:
+      {
+        /* two chars per word */
+        write_string(vm, vm->reg[R_R0], 1, out);
+        vm->unflushed = out;
+      }
+      break;
+    case TRAP_HALT:
+      {
+        vm_flush_output(vm);
+        if (!vm->quiet_halt) {
+          fputs("HALT", out);
+        }
+        fflush(out);
+        vm->stop = STOP_HALT;
+        running = 0;
+      }
+      break;
+    default:
+      if (trap_exts[instr & 0xFF].run) {
+        running = trap_exts[instr & 0xFF].run(vm, in, out);
+      }
+      else if (vm->trap_hooks[instr & 0xFF].fn) {
+        running = run_trap_hook(vm, instr & 0xFF);
+      }
+      break;
+  }
+  return running;
+}
+
+/* profiler
+ *
+ * counts what the reference core retires: instructions per opcode, trap
+ * vector and PC, taken and not taken branches, and how often each basic
+ * block (a run ending in BR, JMP, JSR or TRAP) was entered. the counters
+ * only exist when built with PROFILING and only run for vms with a profile
+ * attached, they are per vm and never locked. */
+
+int vm_attach_profile(struct lc3_vm *vm) {
+  if (!vm->profile) {
+    vm->profile = calloc(1, sizeof(*vm->profile));
+  }
+  return vm->profile != NULL;
+}
+
+static void profile_end_block(struct profile *p) {
+  if (p->in_block) {
+    p->block_entries[p->block]++;
+    p->block_retired[p->block] += p->block_len;
+    p->in_block = 0;
+  }
+}
+
+/* called before the instruction d at pc executes */
+static void profile_instr(struct lc3_vm *vm, uint16_t pc, const struct decoded_instr *d) {
+  struct profile *p = vm->profile;
+  if (!p->in_block) {
+    p->block = pc;
+    p->block_len = 0;
+    p->in_block = 1;
+  }
+  p->retired++;
+  p->block_len++;
+  p->ops[d->op]++;
+  p->pcs[pc]++;
+
+  switch (d->op) {
+    case OP_BR:
+      if (cond_flags(vm) & d->dr) {
+        p->taken[pc]++;
+      }
+      else {
+        p->not_taken[pc]++;
+      }
+      profile_end_block(p);
+      break;
+    case OP_TRAP:
+      p->traps[d->instr & 0xFF]++;
+      profile_end_block(p);
+      break;
+    case OP_JMP:
+    case OP_JSR:
+      profile_end_block(p);
+      break;
+  }
+}
+
+const char *vm_op_names[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+/* the PCs to report for counts: every nonzero one in address order for CSV,
+ * the PROFILE_TOP largest for text. profiles are written once, so one pass
+ * per pick is plenty */
+static int profile_select(const uint64_t *counts, int csv, int *picks) {
+  int n = 0;
+  if (csv) {
+    for (int i = 0; i <= UINT16_MAX; i++) {
+      if (counts[i]) {
+        picks[n++] = i;
+      }
+    }
+    return n;
+  }
+
+  while (n < PROFILE_TOP) {
+    int best = -1;
+    for (int i = 0; i <= UINT16_MAX; i++) {
+      /* only what ranks after the previous pick, by count then address */
+      if (!counts[i] || (n > 0 && (counts[i] > counts[picks[n - 1]] ||
+                                   (counts[i] == counts[picks[n - 1]] && i <= picks[n - 1])))) {
+        continue;
+      }
+      if (best < 0 || counts[i] > counts[best]) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    picks[n++] = best;
+  }
+  return n;
+}
+
+/* flat text, or CSV rows of kind,key,values when csv is set */
+void vm_write_profile(struct lc3_vm *vm, FILE *f, int csv) {
+  struct profile *p = vm->profile;
+  profile_end_block(p);
+
+  uint64_t *branches = p->branches;
+  for (int i = 0; i <= UINT16_MAX; i++) {
+    branches[i] = p->taken[i] + p->not_taken[i];
+  }
+
+  if (csv) {
+    fprintf(f, "kind,key,count,extra\n");
+    fprintf(f, "retired,,%llu,\n", (unsigned long long)p->retired);
+  }
+  else {
+    fprintf(f, "retired instructions: %llu\n\nopcodes:\n", (unsigned long long)p->retired);
+  }
+  for (int op = 0; op < 16; op++) {
+    if (csv) {
+      fprintf(f, "opcode,%s,%llu,\n", vm_op_names[op], (unsigned long long)p->ops[op]);
+    }
+    else if (p->ops[op]) {
+      fprintf(f, "  %-5s %12llu %6.2f%%\n", vm_op_names[op], (unsigned long long)p->ops[op],
+              100.0 * p->ops[op] / p->retired);
+    }
+  }
+
+  if (!csv) {
+    fprintf(f, "\ntraps:\n");
+  }
+  for (int v = 0; v < 256; v++) {
+    if (p->traps[v]) {
+      fprintf(f, csv ? "trap,0x%02x,%llu,\n" : "  x%02x %12llu\n", v, (unsigned long long)p->traps[v]);
+    }
+  }
+
+  int *picks = p->picks;
+  int n;
+
+  if (!csv) {
+    fprintf(f, "\nhottest blocks:          entries      retired\n");
+  }
+  n = profile_select(p->block_retired, csv, picks);
+  for (int k = 0; k < n; k++) {
+    int i = picks[k];
+    fprintf(f, csv ? "block,0x%04x,%llu,%llu\n" : "  x%04x %24llu %12llu\n", i,
+            (unsigned long long)p->block_entries[i], (unsigned long long)p->block_retired[i]);
+  }
+
+  if (!csv) {
+    fprintf(f, "\nhottest instructions:\n");
+  }
+  n = profile_select(p->pcs, csv, picks);
+  for (int k = 0; k < n; k++) {
+    fprintf(f, csv ? "pc,0x%04x,%llu,\n" : "  x%04x %12llu\n", picks[k], (unsigned long long)p->pcs[picks[k]]);
+  }
+
+  if (!csv) {
+    fprintf(f, "\nbranches:                  taken    not taken\n");
+  }
+  n = profile_select(branches, csv, picks);
+  for (int k = 0; k < n; k++) {
+    int i = picks[k];
+    fprintf(f, csv ? "branch,0x%04x,%llu,%llu\n" : "  x%04x %24llu %12llu\n", i,
+            (unsigned long long)p->taken[i], (unsigned long long)p->not_taken[i]);
+  }
+}
+
+/* execution trace
+ *
+ * --trace writes a record for every instruction the reference core retires:
+ * its PC, the instruction word, the registers it changed and a record ahead
+ * of it for each memory word it wrote. records only carry what differs from
+ * the state the previous ones left: the PC as a distance from the word after
+ * the last one, registers as the difference from their old value, zigzag
+ * encoded, and write addresses against the previous write, all as varints.
+ * the stream starts with the full register state it is encoded against.
+ *
+ * the guest fills a ring of TRACE_CHUNK_SIZE chunks and only takes the lock
+ * when it hands one over. a writer thread compresses full chunks in the LZ4
+ * block format and appends them to the file after a "LC3T" header and a
+ * version byte, each behind its little endian raw and stored sizes (equal
+ * for a chunk stored as it is). a guest that gets a whole ring ahead of the
+ * writer waits for it, so the trace is never missing anything. while a
+ * trace is attached every mem_write() takes the slow path, which records the
+ * write whatever resets and restores do to code_map[]. */
+
+/* one LZ4 sequence: literals, then a match of match_len bytes offset back,
+ * or no match for the last one */
+static uint8_t *lz4_emit(uint8_t *op, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len) {
+  uint8_t *token = op++;
+  *token = (literal_len < 15 ? literal_len : 15) << 4;
+  if (literal_len >= 15) {
+    size_t n = literal_len - 15;
+    for (; n >= 255; n -= 255) {
+      *op++ = 255;
+    }
+    *op++ = n;
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+  if (match_len) {
+    size_t n = match_len - 4;
+    *token |= n < 15 ? n : 15;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (n >= 15) {
+      for (n -= 15; n >= 255; n -= 255) {
+        *op++ = 255;
+      }
+      *op++ = n;
+    }
+  }
+  return op;
+}
+
+/* greedy LZ4 block compression of n bytes into dst, which has room for
+ * LZ4_BOUND(n). returns the compressed size */
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  uint32_t table[1 << LZ4_HASH_BITS] = {0};
+  uint8_t *op = dst;
+  size_t anchor = 0;
+  /* the format wants the last match to start 12 bytes and end 5 bytes
+   * before the end */
+  for (size_t ip = 0; n > 12 && ip < n - 12;) {
+    uint32_t seq;
+    memcpy(&seq, src + ip, sizeof(seq));
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+    size_t ref = table[h];
+    table[h] = ip;
+    uint32_t candidate;
+    memcpy(&candidate, src + ref, sizeof(candidate));
+    if (ref >= ip || ip - ref > UINT16_MAX || candidate != seq) {
+      ip++;
+      continue;
+    }
+    size_t len = 4;
+    while (ip + len < n - 5 && src[ref + len] == src[ip + len]) {
+      len++;
+    }
+    op = lz4_emit(op, src + anchor, ip - anchor, ip - ref, len);
+    ip += len;
+    anchor = ip;
+  }
+  op = lz4_emit(op, src + anchor, n - anchor, 0, 0);
+  return op - dst;
+}
+
+/* returns the size of the block decompressed into dst, -1 if it's corrupt
+ * or needs more than size bytes */
+static long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t size) {
+  size_t ip = 0, op = 0;
+  while (ip < n) {
+    int token = src[ip++];
+    size_t len = token >> 4;
+    if (len == 15) {
+      int c;
+      do {
+        if (ip >= n) {
+          return -1;
+        }
+        c = src[ip++];
+        len += c;
+      } while (c == 255);
+    }
+    if (len > n - ip || len > size - op) {
+      return -1;
+    }
+    memcpy(dst + op, src + ip, len);
+    ip += len;
+    op += len;
+    if (ip == n) {
+      break;
+    }
+
+    if (n - ip < 2) {
+      return -1;
+    }
+    size_t offset = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    len = (token & 15) + 4;
+    if ((token & 15) == 15) {
+      int c;
+      do {
+        if (ip >= n) {
+          return -1;
+        }
+        c = src[ip++];
+        len += c;
+      } while (c == 255);
+    }
+    if (offset == 0 || offset > op || len > size - op) {
+      return -1;
+    }
+    /* byte by byte, a match may overlap what it produces */
+    for (size_t i = 0; i < len; i++, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+/* small differences either way become small numbers */
+static uint16_t zigzag(uint16_t delta) {
+  return (uint16_t)(delta << 1) ^ (delta & 0x8000 ? 0xFFFF : 0);
+}
+
+static uint16_t unzigzag(uint16_t v) {
+  return (v >> 1) ^ -(v & 1);
+}
+
+/* hand the chunk being filled to the writer and start on the next one */
+static void trace_publish(struct trace *t) {
+  pthread_mutex_lock(&t->lock);
+  t->chunk_len[t->head % TRACE_CHUNKS] = t->fill;
+  t->head++;
+  pthread_cond_broadcast(&t->changed);
+  while (t->head - t->tail == TRACE_CHUNKS) {
+    pthread_cond_wait(&t->changed, &t->lock);
+  }
+  pthread_mutex_unlock(&t->lock);
+  t->fill = 0;
+}
+
+static void trace_put(struct trace *t, const uint8_t *buf, size_t n) {
+  /* the one thread that moves head reads it without the lock */
+  while (n > 0) {
+    size_t room = TRACE_CHUNK_SIZE - t->fill;
+    size_t k = n < room ? n : room;
+    memcpy(t->ring[t->head % TRACE_CHUNKS] + t->fill, buf, k);
+    t->fill += k;
+    buf += k;
+    n -= k;
+    if (t->fill == TRACE_CHUNK_SIZE) {
+      trace_publish(t);
+    }
+  }
+}
+
+/* compress and append one chunk, out has room for LZ4_BOUND of it or is
+ * NULL to store it as it is */
+static void trace_write_chunk(FILE *f, const uint8_t *chunk, size_t len, uint8_t *out) {
+  size_t stored = out ? lz4_compress(chunk, len, out) : len;
+  if (stored >= len) {
+    stored = len;
+    out = NULL;
+  }
+  uint8_t sizes[8];
+  for (int i = 0; i < 4; i++) {
+    sizes[i] = len >> (8 * i);
+    sizes[4 + i] = stored >> (8 * i);
+  }
+  fwrite(sizes, 1, sizeof(sizes), f);
+  fwrite(out ? out : chunk, 1, stored, f);
+}
+
+static void *trace_writer(void *arg) {
+  struct trace *t = arg;
+  uint8_t *out = malloc(LZ4_BOUND(TRACE_CHUNK_SIZE));
+  pthread_mutex_lock(&t->lock);
+  for (;;) {
+    while (t->tail == t->head && !t->closing) {
+      pthread_cond_wait(&t->changed, &t->lock);
+    }
+    if (t->tail == t->head) {
+      break;
+    }
+    unsigned i = t->tail % TRACE_CHUNKS;
+    size_t len = t->chunk_len[i];
+    pthread_mutex_unlock(&t->lock);
+    trace_write_chunk(t->file, t->ring[i], len, out);
+    pthread_mutex_lock(&t->lock);
+    t->tail++;
+    pthread_cond_broadcast(&t->changed);
+  }
+  pthread_mutex_unlock(&t->lock);
+  free(out);
+  return NULL;
+}
+
+/* trace what the reference core runs into file from now on */
+int vm_attach_trace(struct lc3_vm *vm, FILE *file) {
+  struct trace *t = calloc(1, sizeof(*t));
+  if (!t) {
+    return 0;
+  }
+  t->file = file;
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->changed, NULL);
+  fwrite("LC3T\1", 1, 5, file);
+
+  /* the state the first record is encoded against */
+  memcpy(t->reg, vm->reg, sizeof(t->reg));
+  t->cond = cond_flags(vm);
+  t->psr = vm->psr;
+  t->next_pc = vm->reg[R_PC];
+  uint8_t start[TRACE_RECORD_MAX];
+  uint8_t *p = start;
+  for (int r = 0; r < 8; r++) {
+    p = put_varint(p, t->reg[r]);
+  }
+  p = put_varint(p, t->cond);
+  p = put_varint(p, t->psr);
+  p = put_varint(p, t->next_pc);
+  trace_put(t, start, p - start);
+
+  if (pthread_create(&t->thread, NULL, trace_writer, t) != 0) {
+    pthread_cond_destroy(&t->changed);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    return 0;
+  }
+  vm_detach_trace(vm);
+  vm->trace = t;
+  return 1;
+}
+
+/* write out everything that is left, the file stays open */
+static void trace_destroy(struct trace *t) {
+  if (!t) {
+    return;
+  }
+  if (t->fill > 0) {
+    trace_publish(t);
+  }
+  pthread_mutex_lock(&t->lock);
+  t->closing = 1;
+  pthread_cond_broadcast(&t->changed);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->thread, NULL);
+  fflush(t->file);
+  pthread_cond_destroy(&t->changed);
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+}
+
+void vm_detach_trace(struct lc3_vm *vm) {
+  if (!vm->trace) {
+    return;
+  }
+  trace_destroy(vm->trace);
+  vm->trace = NULL;
+}
+
+/* the record of the instruction at pc, which just retired */
+static void trace_instr(struct lc3_vm *vm, uint16_t pc, uint16_t instr) {
+  struct trace *t = vm->trace;
+  uint8_t record[TRACE_RECORD_MAX];
+  uint8_t *p = record + 2;
+  uint8_t flags = 0;
+  uint8_t changed = 0;
+  if (pc != t->next_pc) {
+    flags |= TRACE_JUMP;
+    p = put_varint(p, zigzag(pc - t->next_pc));
+  }
+  p = put_varint(p, instr);
+  for (int r = 0; r < 8; r++) {
+    if (vm->reg[r] != t->reg[r]) {
+      changed |= 1 << r;
+      p = put_varint(p, zigzag(vm->reg[r] - t->reg[r]));
+      t->reg[r] = vm->reg[r];
+    }
+  }
+  uint16_t cond = cond_flags(vm);
+  if (cond != t->cond) {
+    flags |= TRACE_COND;
+    *p++ = cond;
+    t->cond = cond;
+  }
+  if (vm->psr != t->psr) {
+    flags |= TRACE_PSR;
+    p = put_varint(p, vm->psr);
+    t->psr = vm->psr;
+  }
+  t->next_pc = pc + 1;
+  record[0] = flags;
+  record[1] = changed;
+  trace_put(t, record, p - record);
+}
+
+/* a word written by the instruction being traced */
+static void trace_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  struct trace *t = vm->trace;
+  uint8_t record[TRACE_RECORD_MAX];
+  uint8_t *p = record;
+  *p++ = TRACE_WRITE;
+  p = put_varint(p, zigzag(address - t->last_write));
+  p = put_varint(p, val);
+  t->last_write = address;
+  trace_put(t, record, p - record);
+}
+
+/* next chunk of the trace, 0 at the end of the file and -1 if it's corrupt */
+static int trace_read_chunk(struct trace_reader *r) {
+  uint8_t sizes[8];
+  size_t n = fread(sizes, 1, sizeof(sizes), r->file);
+  if (n == 0) {
+    return 0;
+  }
+  uint32_t len = 0, stored = 0;
+  for (int i = 0; i < 4; i++) {
+    len |= (uint32_t)sizes[i] << (8 * i);
+    stored |= (uint32_t)sizes[4 + i] << (8 * i);
+  }
+  if (n != sizeof(sizes) || len > TRACE_CHUNK_SIZE || stored > len ||
+      fread(r->stored, 1, stored, r->file) != stored) {
+    return -1;
+  }
+  if (stored == len) {
+    memcpy(r->chunk, r->stored, len);
+  }
+  else if (lz4_decompress(r->stored, stored, r->chunk, len) != (long)len) {
+    return -1;
+  }
+  r->len = len;
+  r->pos = 0;
+  return 1;
+}
+
+/* next byte of the record stream, -1 at the end and -2 if it's corrupt */
+static int trace_getc(struct trace_reader *r) {
+  while (r->pos == r->len) {
+    int status = trace_read_chunk(r);
+    if (status <= 0) {
+      return status - 1;
+    }
+  }
+  return r->chunk[r->pos++];
+}
+
+static int trace_varint(struct trace_reader *r, uint16_t *v) {
+  uint32_t val = 0;
+  for (int shift = 0; shift < 21; shift += 7) {
+    int c = trace_getc(r);
+    if (c < 0) {
+      return 0;
+    }
+    val |= (uint32_t)(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      *v = val;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* start reading a trace written by vm_attach_trace(), NULL if file isn't one */
+struct trace_reader *vm_trace_open(FILE *file) {
+  char magic[5];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, "LC3T\1", 5) != 0) {
+    return NULL;
+  }
+  struct trace_reader *r = calloc(1, sizeof(*r));
+  if (!r) {
+    return NULL;
+  }
+  r->file = file;
+  int ok = 1;
+  for (int i = 0; i < 8; i++) {
+    ok = ok && trace_varint(r, &r->reg[i]);
+  }
+  ok = ok && trace_varint(r, &r->cond) && trace_varint(r, &r->psr) && trace_varint(r, &r->next_pc);
+  if (!ok) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+/* read the next instruction into rec, returns 0 at the end of the trace and
+ * -1 if it's corrupt. rec->writes stays valid until the next call */
+int vm_trace_next(struct trace_reader *r, struct trace_record *rec) {
+  rec->write_count = 0;
+  int flags;
+  /* the writes come first */
+  while ((flags = trace_getc(r)) == TRACE_WRITE) {
+    uint16_t delta, val;
+    if (!trace_varint(r, &delta) || !trace_varint(r, &val)) {
+      return -1;
+    }
+    if (rec->write_count == r->write_cap) {
+      uint32_t cap = r->write_cap ? 2 * r->write_cap : 64;
+      void *writes = realloc(r->writes, cap * sizeof(r->writes[0]));
+      if (!writes) {
+        return -1;
+      }
+      r->writes = writes;
+      r->write_cap = cap;
+    }
+    r->last_write += unzigzag(delta);
+    r->writes[rec->write_count][0] = r->last_write;
+    r->writes[rec->write_count][1] = val;
+    rec->write_count++;
+  }
+  if (flags == -1 && rec->write_count == 0) {
+    return 0;
+  }
+
+  int changed = trace_getc(r);
+  uint16_t delta = 0;
+  if (flags < 0 || changed < 0 || ((flags & TRACE_JUMP) && !trace_varint(r, &delta)) ||
+      !trace_varint(r, &rec->instr)) {
+    return -1;
+  }
+  rec->pc = r->next_pc + unzigzag(delta);
+  for (int i = 0; i < 8; i++) {
+    if ((changed & 1 << i) && !trace_varint(r, &delta)) {
+      return -1;
+    }
+    r->reg[i] += changed & 1 << i ? unzigzag(delta) : 0;
+  }
+  if (flags & TRACE_COND) {
+    int cond = trace_getc(r);
+    if (cond < 0) {
+      return -1;
+    }
+    r->cond = cond;
+  }
+  if ((flags & TRACE_PSR) && !trace_varint(r, &r->psr)) {
+    return -1;
+  }
+
+  r->next_pc = rec->pc + 1;
+  rec->index = r->index++;
+  rec->flags = flags & (TRACE_COND | TRACE_PSR);
+  rec->changed = changed;
+  memcpy(rec->reg, r->reg, sizeof(rec->reg));
+  rec->cond = r->cond;
+  rec->psr = r->psr;
+  rec->writes = r->writes;
+  return 1;
+}
+
+void vm_trace_reader_destroy(struct trace_reader *r) {
+  if (r) {
+    free(r->writes);
+    free(r);
+  }
+}
+
+/* read and execute instruction
+ *
+ * one instruction of the reference core, written once over the mask of
+ * CORE_* features the vm needs. every loop the switch engine runs expands it
+ * for one constant mask, so what a run doesn't use is compiled out of it:
+ * the device page check on loads, the overflow check and the profile and
+ * trace hooks. the loop is picked once per run from vm_core_features(), and
+ * vm_read_and_execute_instruction() works the mask out at every step */
+static inline __attribute__((always_inline)) int execute_instruction(struct lc3_vm *vm, const unsigned features) {
+  int running = 1;
+
+  /* FETCH */
+  uint16_t pc = vm->reg[R_PC]++;
+  int is_max = (features & CORE_OVERFLOW) && pc == UINT16_MAX;
+  const struct decoded_instr *d = fetch_decoded(vm, pc);
+#if PROFILING
+  if (features & CORE_PROFILE) {
+    profile_instr(vm, pc, d);
+  }
+#endif
+
+  switch (d->op) {
+    case OP_ADD:
+      {
+        /* whether we are in immediate mode */
+        if (d->imm_flag) {
+          vm->reg[d->dr] = vm->reg[d->sr1] + d->imm;
+        }
+        else {
+          vm->reg[d->dr] = vm->reg[d->sr1] + vm->reg[d->sr2];
+        }
+
+        update_flags(vm, d->dr);
+      }
+      break;
+    case OP_AND:
+      {
+        /* whether we are in immediate mode */
+        if (d->imm_flag) {
+          vm->reg[d->dr] = vm->reg[d->sr1] & d->imm;
+        }
+        else {
+          vm->reg[d->dr] = vm->reg[d->sr1] & vm->reg[d->sr2];
+        }
+        update_flags(vm, d->dr);
+      }
+      break;
+    case OP_NOT:
+      {
+        vm->reg[d->dr] = ~vm->reg[d->sr1];
+        update_flags(vm, d->dr);
+      }
+      break;
+    case OP_BR:
+      {
+        /* advance program counter if any of the n, z, p bits matches the
+         * condition flag; the nzp field lines up with FL_NEG/FL_ZRO/FL_POS */
+        if (cond_flags(vm) & d->dr) {
+          vm->reg[R_PC] += d->imm;
+        }
+      }
+      break;
+    case OP_JMP:
+      {
+        vm->reg[R_PC] = vm->reg[d->sr1];
+      }
+      break;
+    case OP_JSR:
+      {
+        /* save PC in R7 to jump back to later */
+        vm->reg[R_R7] = vm->reg[R_PC];
+
+        /* whether we are in immediate mode */
+        if (d->imm_flag) {
+          /* add PCoffset 11 to program counter */
+          vm->reg[R_PC] += d->imm;
+        }
+        else {
+          /* assign contents of base register directly to program counter */
+          vm->reg[R_PC] = vm->reg[d->sr1];
+        }
+      }
+      break;
+    case OP_LD:
+      {
+        /* add pc_offset to the current PC and load that memory location */
+        vm->reg[d->dr] = core_read(vm, features, vm->reg[R_PC] + d->imm);
+        update_flags(vm, d->dr);
+      }
+      break;
+    case OP_LDI:
+      {
+        /* add pc_offset to the current PC, look at that memory location to
+         * get the final address */
+        uint16_t address = core_read(vm, features, vm->reg[R_PC] + d->imm);
+        vm->reg[d->dr] = core_read(vm, features, address);
+        update_flags(vm, d->dr);
+        if (d->exec == EXEC_KBSR_SPIN && address == MR_KBSR && !(vm->reg[d->dr] & KBSR_READY)) {
+          kbsr_idle(vm);
+        }
+      }
+      break;
+    case OP_LDR:
+      {
+        vm->reg[d->dr] = core_read(vm, features, vm->reg[d->sr1] + d->imm);
+        update_flags(vm, d->dr);
+      }
+      break;
+    case OP_LEA:
+      {
+        vm->reg[d->dr] = vm->reg[R_PC] + d->imm;
+        update_flags(vm, d->dr);
+      }
+      break;
+    case OP_ST:
+      {
+        running = !mem_write(vm, vm->reg[R_PC] + d->imm, vm->reg[d->dr]);
+      }
+      break;
+    case OP_STI:
+      {
+        running = !mem_write(vm, core_read(vm, features, vm->reg[R_PC] + d->imm), vm->reg[d->dr]);
+      }
+      break;
+    case OP_STR:
+      {
+        running = !mem_write(vm, vm->reg[d->sr1] + d->imm, vm->reg[d->dr]);
+      }
+      break;
+    case OP_TRAP:
+      running = vm_execute_trap(vm, d->instr, vm->kbd, vm->display);
+      break;
+    case OP_RTI:
+      exec_rti(vm);
+      break;
+    case OP_RES:
+    default:
+      raise_exception(vm, VEC_ILLEGAL);
+      break;
+  }
+
+#if TRACING
+  if (features & CORE_TRACE) {
+    trace_instr(vm, pc, d->instr);
+  }
+#endif
+
+  if (running && (BLOCK_END_OPS >> d->op & 1) && interrupt_pending(vm)) {
+    vm_check_interrupts(vm);
+  }
+
+  if (running && is_max) {
+    fputs("Program counter overflow!", vm->display);
+    vm->stop = STOP_OVERFLOW;
+    return 0;
+  }
+
+  return running;
+}
+
+int vm_read_and_execute_instruction(struct lc3_vm *vm) {
+  return execute_instruction(vm, vm_core_features(vm));
+}
+
+/* the features the reference core needs to run vm as it is set up now */
+unsigned vm_core_features(struct lc3_vm *vm) {
+  return (vm->plain_memory ? 0 : CORE_MMIO) | (vm->check_overflow ? CORE_OVERFLOW : 0) |
+         (vm->profile ? CORE_PROFILE : 0) | (vm->trace ? CORE_TRACE : 0) |
+         (vm->input_log ? CORE_COUNT : 0);
+}
+
+/* run at most budget instructions with features fixed for all of them */
+#define CORE_LOOP(features) \
+  static struct run_result run_core_##features(struct lc3_vm *vm, uint64_t budget) { \
+    struct run_result result = {0, RUN_BUDGET, 0}; \
+    while (result.retired < budget) { \
+      result.retired++; \
+      if ((features) & CORE_COUNT) { \
+        vm->input_log->retired++; \
+      } \
+      if (!execute_instruction(vm, (features))) { \
+        result.exit = RUN_HALTED; \
+        break; \
+      } \
+    } \
+    return result; \
+  }
+CORE_VARIANTS(CORE_LOOP)
+#undef CORE_LOOP
+
+#define CORE_LOOP(features) run_core_##features,
+struct run_result (*const vm_core_loops[CORE_MASK + 1])(struct lc3_vm *vm, uint64_t budget) = {
+  CORE_VARIANTS(CORE_LOOP)
+};
+#undef CORE_LOOP
+
+/* batched run loop
+ *
+ * vm_run() executes up to budget instructions in one call and reports how many
+ * retired and why it stopped. output traps are run in place on out; traps that
+ * wait for input are handed back with the PC already past the TRAP so the host
+ * can service them with vm_execute_trap() and call vm_run() again. pending
+ * interrupts are taken after each instruction that ends a basic block. */
+
+/* traps that block on the host for input */
+int vm_trap_needs_input(uint16_t instr) {
+  uint16_t vector = instr & 0xFF;
+  return vector == TRAP_GETC || vector == TRAP_IN || trap_exts[vector].needs_input;
+}
+
+/* threaded-code interpreter core
+ *
+ * each handler ends by fetching the next decoded instruction and jumping
+ * straight to its handler, so every opcode gets its own indirect branch
+ * instead of sharing the one behind the switch above. compilers without
+ * labels-as-values go through a switch instead.
+ * vm_read_and_execute_instruction() stays the reference implementation. */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+
+struct run_result vm_run(struct lc3_vm *vm, uint64_t budget, FILE *out) {
+#if THREADED_DISPATCH
+  static void *const dispatch[EXEC_COUNT] = {
+    [OP_BR] = &&op_br,   [OP_ADD] = &&op_add, [OP_LD] = &&op_ld,
+    [OP_ST] = &&op_st,   [OP_JSR] = &&op_jsr, [OP_AND] = &&op_and,
+    [OP_LDR] = &&op_ldr, [OP_STR] = &&op_str, [OP_RTI] = &&op_rti,
+    [OP_NOT] = &&op_not, [OP_LDI] = &&op_ldi, [OP_STI] = &&op_sti,
+    [OP_JMP] = &&op_jmp, [OP_RES] = &&op_res, [OP_LEA] = &&op_lea,
+    [OP_TRAP] = &&op_trap,
+    [EXEC_CONST] = &&exec_const, [EXEC_ADD_BR] = &&exec_add_br,
+    [EXEC_AND_BR] = &&exec_and_br, [EXEC_LDR_ADD_STR] = &&exec_ldr_add_str,
+    [EXEC_KBSR_SPIN] = &&exec_kbsr_spin, [EXEC_COUNTDOWN] = &&exec_countdown,
+    [EXEC_BREAK] = &&exec_break
+  };
+#define DISPATCH() \
+  do { \
+    if (left == 0) { \
+      goto out_of_budget; \
+    } \
+    left--; \
+    d = fetch_decoded(vm, vm->reg[R_PC]++); \
+    goto *dispatch[d->exec]; \
+  } while (0)
+#else
+#define DISPATCH() goto dispatch
+#endif
+#define END_BLOCK() \
+  do { \
+    if (interrupt_pending(vm)) { \
+      vm_check_interrupts(vm); \
+    } \
+    DISPATCH(); \
+  } while (0)
+
+  struct run_result result = {0, RUN_BUDGET, 0};
+  uint64_t left = budget;
+  const struct decoded_instr *d;
+
+#if !THREADED_DISPATCH
+dispatch:
+  if (left == 0) {
+    goto out_of_budget;
+  }
+  left--;
+  d = fetch_decoded(vm, vm->reg[R_PC]++);
+  switch (d->exec) {
+    case OP_BR: goto op_br;
+    case OP_ADD: goto op_add;
+    case OP_LD: goto op_ld;
+    case OP_ST: goto op_st;
+    case OP_JSR: goto op_jsr;
+    case OP_AND: goto op_and;
+    case OP_LDR: goto op_ldr;
+    case OP_STR: goto op_str;
+    case OP_NOT: goto op_not;
+    case OP_LDI: goto op_ldi;
+    case OP_STI: goto op_sti;
+    case OP_JMP: goto op_jmp;
+    case OP_LEA: goto op_lea;
+    case OP_TRAP: goto op_trap;
+    case OP_RTI: goto op_rti;
+    case EXEC_CONST: goto exec_const;
+    case EXEC_ADD_BR: goto exec_add_br;
+    case EXEC_AND_BR: goto exec_and_br;
+    case EXEC_LDR_ADD_STR: goto exec_ldr_add_str;
+    case EXEC_KBSR_SPIN: goto exec_kbsr_spin;
+    case EXEC_COUNTDOWN: goto exec_countdown;
+    case EXEC_BREAK: goto exec_break;
+    default: goto op_res;
+  }
+#endif
+
+  DISPATCH();
+
+op_add:
+  vm->reg[d->dr] = vm->reg[d->sr1] + (d->imm_flag ? d->imm : vm->reg[d->sr2]);
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_and:
+  vm->reg[d->dr] = vm->reg[d->sr1] & (d->imm_flag ? d->imm : vm->reg[d->sr2]);
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_not:
+  vm->reg[d->dr] = ~vm->reg[d->sr1];
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_br:
+  if (cond_flags(vm) & d->dr) {
+    vm->reg[R_PC] += d->imm;
+  }
+  END_BLOCK();
+op_jmp:
+  vm->reg[R_PC] = vm->reg[d->sr1];
+  END_BLOCK();
+op_jsr:
+  vm->reg[R_R7] = vm->reg[R_PC];
+  if (d->imm_flag) {
+    vm->reg[R_PC] += d->imm;
+  }
+  else {
+    vm->reg[R_PC] = vm->reg[d->sr1];
+  }
+  END_BLOCK();
+op_ld:
+  vm->reg[d->dr] = mem_read(vm, vm->reg[R_PC] + d->imm);
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_ldi:
+  vm->reg[d->dr] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + d->imm));
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_ldr:
+  vm->reg[d->dr] = mem_read(vm, vm->reg[d->sr1] + d->imm);
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_lea:
+  vm->reg[d->dr] = vm->reg[R_PC] + d->imm;
+  update_flags(vm, d->dr);
+  DISPATCH();
+op_st:
+  if (mem_write(vm, vm->reg[R_PC] + d->imm, vm->reg[d->dr])) {
+    goto stopped;
+  }
+  DISPATCH();
+op_sti:
+  if (mem_write(vm, mem_read(vm, vm->reg[R_PC] + d->imm), vm->reg[d->dr])) {
+    goto stopped;
+  }
+  DISPATCH();
+op_str:
+  if (mem_write(vm, vm->reg[d->sr1] + d->imm, vm->reg[d->dr])) {
+    goto stopped;
+  }
+  DISPATCH();
+op_trap:
+  /* output traps run in place, input traps go back to the host */
+  if (vm_trap_needs_input(d->instr)) {
+    result.exit = RUN_TRAP;
+    result.trap = d->instr;
+    goto done;
+  }
+  if (!vm_execute_trap(vm, d->instr, NULL, out)) {
+    goto stopped;
+  }
+  END_BLOCK();
+op_rti:
+  exec_rti(vm);
+  END_BLOCK();
+op_res:
+  raise_exception(vm, VEC_ILLEGAL);
+  DISPATCH();
+
+  /* superinstructions, each runs just its first instruction when the budget
+   * doesn't cover the whole sequence */
+exec_const:
+  if (left == 0) {
+    goto op_and;
+  }
+  left--;
+  vm->reg[d->dr] = d[1].imm;
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  DISPATCH();
+exec_add_br:
+  if (left == 0) {
+    goto op_add;
+  }
+  left--;
+  vm->reg[d->dr] = vm->reg[d->sr1] + (d->imm_flag ? d->imm : vm->reg[d->sr2]);
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  d++;
+  goto op_br;
+exec_and_br:
+  if (left == 0) {
+    goto op_and;
+  }
+  left--;
+  vm->reg[d->dr] = vm->reg[d->sr1] & (d->imm_flag ? d->imm : vm->reg[d->sr2]);
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  d++;
+  goto op_br;
+exec_ldr_add_str:
+  if (left < 2) {
+    goto op_ldr;
+  }
+  left -= 2;
+  /* the ADD sets the flags the LDR would have */
+  vm->reg[d->dr] = mem_read(vm, vm->reg[d->sr1] + d->imm);
+  d++;
+  vm->reg[d->dr] = vm->reg[d->sr1] + (d->imm_flag ? d->imm : vm->reg[d->sr2]);
+  update_flags(vm, d->dr);
+  d++;
+  vm->reg[R_PC] += 2;
+  goto op_str;
+exec_kbsr_spin:
+  {
+    uint16_t pointer = vm->reg[R_PC] + d->imm;
+    if (left == 0 || pointer >= MR_DEVICE_BASE || vm->memory[pointer] != MR_KBSR) {
+      goto op_ldi;
+    }
+    left--;
+    /* each time round is the BR back and the next LDI */
+    while (!((vm->reg[d->dr] = mem_read(vm, MR_KBSR)) & KBSR_READY) && left >= 2 &&
+           !interrupt_pending(vm)) {
+      if (!vm->kbd && !vm->keyboard && !vm->input_log) {
+        /* nothing can ever put a key there, spin through the budget */
+        uint64_t rounds = left / 2;
+        left -= rounds * 2;
+        vm->kbd_empty_polls += rounds;
+        break;
+      }
+      if (vm->spin_yield) {
+        /* finish the LDI and the BR back to it, and come back to the LDI
+         * once there may be a key */
+        update_flags(vm, d->dr);
+        vm->reg[R_PC]--;
+        vm->spun = 1;
+        goto out_of_budget;
+      }
+      kbsr_idle(vm);
+      left -= 2;
+    }
+    update_flags(vm, d->dr);
+    vm->reg[R_PC]++;
+    d++;
+    goto op_br;
+  }
+exec_countdown:
+  {
+    int16_t count = vm->reg[d->dr];
+    uint16_t step = -d->imm;
+    /* past zero, or with an interrupt to take, it's just an ADD and a BR */
+    if (left == 0 || count <= 0 || interrupt_pending(vm)) {
+      goto exec_add_br;
+    }
+    uint64_t rounds = (count + step - 1) / step;
+    int finished = 1;
+    /* the ADD of the first round has been counted already */
+    if (rounds * 2 - 1 > left) {
+      rounds = (left + 1) / 2;
+      finished = 0;
+    }
+    left -= rounds * 2 - 1;
+    vm->reg[d->dr] = count - rounds * step;
+    update_flags(vm, d->dr);
+    vm->reg[R_PC] += finished ? 1 : -1;
+    END_BLOCK();
+  }
+#undef END_BLOCK
+#undef DISPATCH
+
+exec_break:
+  /* stop in front of it without running it */
+  left++;
+  vm->reg[R_PC]--;
+  result.exit = RUN_BREAK;
+  goto done;
+out_of_budget:
+  result.exit = RUN_BUDGET;
+  goto done;
+stopped:
+  /* HALT, or the MCR clock was switched off */
+  result.exit = RUN_HALTED;
+done:
+  result.retired = budget - left;
+  vm_sync_flags(vm);
+  return result;
+}
+
+/* runs engine until the program halts, servicing input traps from in */
+static int run_to_halt(struct lc3_vm *vm,
+                struct run_result (*engine)(struct lc3_vm *, uint64_t, FILE *),
+                FILE *in, FILE *out) {
+  for (;;) {
+    struct run_result result = engine(vm, UINT64_MAX, out);
+    switch (result.exit) {
+      case RUN_TRAP:
+        if (!vm_execute_trap(vm, result.trap, in, out)) {
+          return 0;
+        }
+        break;
+      case RUN_BREAK:
+        /* no debugger to stop for, step over the mark */
+        if (!vm_read_and_execute_instruction(vm)) {
+          return 0;
+        }
+        break;
+      case RUN_HALTED:
+        return 0;
+    }
+  }
+}
+
+int vm_run_threaded(struct lc3_vm *vm, FILE *in, FILE *out) {
+  return run_to_halt(vm, vm_run, in, out);
+}
+
+/* basic block JIT
+ *
+ * straight-line runs of instructions ending in BR, JMP, JSR or TRAP are
+ * compiled to x86-64. inside a block the guest registers R0-R7 live in the
+ * host registers r8d-r15d, rbx points at memory[], rbp at the vm (whose first
+ * member is reg[]) and rdi holds the remaining instruction budget. blocks are entered through jit->enter and
+ * leave through jit->exit, which spill the guest registers back to reg[] and
+ * return 0 to keep going, JIT_EXIT_BOUNDARY when an interrupt may be due or
+ * the TRAP instruction word of a trap that waits for input, for vm_jit_run() to
+ * hand back. the other traps are called from the block itself through
+ * jit_trap(). exits to already compiled blocks are chained with direct jumps.
+ *
+ * the condition codes are only written back when a block ends; a BR tests the
+ * host flags of the last flag-writing register directly. stores to words with
+ * nothing cached for them are done inline, the rest go through mem_write(). a
+ * store that lands on compiled code flushes the whole cache and leaves the
+ * block right after the store. */
+
+#if JIT_AVAILABLE
+struct jit_patch {
+  uint8_t *site; /* rel32 of a jmp that currently falls through to an exit */
+  uint16_t target;
+  int boundary;  /* jumps to the interrupt check rather than past it */
+};
+
+/* per-VM code cache, created by the first vm_jit_run() on a VM */
+struct jit_state {
+  struct lc3_vm *vm;
+  uint8_t *code;
+  uint8_t *ptr;
+  uint8_t *code_start; /* first byte after the stubs, reset by jit_flush() */
+  uint8_t *exit;
+  int (*enter)(int64_t budget, void *code);
+  int64_t budget_left;
+  unsigned generation; /* bumped by every jit_flush() */
+  int stopped;         /* the last jit_store() or jit_trap() stopped the machine */
+  FILE *out;           /* output of the vm_jit_run() in progress, for jit_trap() */
+  int patch_count;
+  struct jit_patch patches[JIT_MAX_PATCHES];
+  void *blocks[UINT16_MAX + 1];
+};
+
+/* host register numbers */
+enum {
+  H_RAX = 0, H_RCX = 1, H_RDX = 2, H_RBX = 3,
+  H_RSP = 4, H_RBP = 5, H_RSI = 6, H_RDI = 7,
+  H_R8 = 8
+};
+
+/* guest register r lives in host register r8 + r */
+#define HREG(r) (H_R8 + (r))
+
+static void emit8(struct jit_state *j, uint8_t b) { *j->ptr++ = b; }
+
+static void emit32(struct jit_state *j, uint32_t v) {
+  memcpy(j->ptr, &v, sizeof(v));
+  j->ptr += sizeof(v);
+}
+
+static void emit64(struct jit_state *j, uint64_t v) {
+  memcpy(j->ptr, &v, sizeof(v));
+  j->ptr += sizeof(v);
+}
+
+/* REX prefix for a reg/rm pair, only emitted when needed */
+static void emit_rex(struct jit_state *j, int w, int r, int b) {
+  uint8_t rex = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+  if (rex != 0x40) {
+    emit8(j, rex);
+  }
+}
+
+static void emit_modrm(struct jit_state *j, int mod, int r, int rm) {
+  emit8(j, (mod << 6) | ((r & 7) << 3) | (rm & 7));
+}
+
+/* <op> dst, src on 32-bit registers (mov 0x89, add 0x01, and 0x21) */
+static void emit_alu_rr(struct jit_state *j, uint8_t op, int dst, int src) {
+  emit_rex(j, 0, src, dst);
+  emit8(j, op);
+  emit_modrm(j, 3, src, dst);
+}
+
+/* <op> dst, imm32 where ext is the /digit (add 0, and 4, xor 6, cmp 7) */
+static void emit_alu_ri(struct jit_state *j, int ext, int dst, uint32_t imm) {
+  emit_rex(j, 0, 0, dst);
+  emit8(j, 0x81);
+  emit_modrm(j, 3, ext, dst);
+  emit32(j, imm);
+}
+
+static void emit_mov_ri(struct jit_state *j, int dst, uint32_t imm) {
+  emit_rex(j, 0, 0, dst);
+  emit8(j, 0xB8 + (dst & 7));
+  emit32(j, imm);
+}
+
+/* movzx dst, src16 */
+static void emit_zext16(struct jit_state *j, int dst, int src) {
+  emit_rex(j, 0, dst, src);
+  emit8(j, 0x0F);
+  emit8(j, 0xB7);
+  emit_modrm(j, 3, dst, src);
+}
+
+/* movzx dst, word [rbp + 2 * r] */
+static void emit_load_reg_file(struct jit_state *j, int dst, int r) {
+  emit_rex(j, 0, dst, H_RBP);
+  emit8(j, 0x0F);
+  emit8(j, 0xB7);
+  emit_modrm(j, 1, dst, H_RBP);
+  emit8(j, 2 * r);
+}
+
+/* mov word [rbp + 2 * r], src16 */
+static void emit_store_reg_file(struct jit_state *j, int r, int src) {
+  emit8(j, 0x66);
+  emit_rex(j, 0, src, H_RBP);
+  emit8(j, 0x89);
+  emit_modrm(j, 1, src, H_RBP);
+  emit8(j, 2 * r);
+}
+
+/* mov word [rbp + 2 * r], imm16 */
+static void emit_store_reg_file_imm(struct jit_state *j, int r, uint16_t imm) {
+  emit8(j, 0x66);
+  emit8(j, 0xC7);
+  emit_modrm(j, 1, 0, H_RBP);
+  emit8(j, 2 * r);
+  emit8(j, imm & 0xff);
+  emit8(j, imm >> 8);
+}
+
+/* jmp/jcc with a rel32 to be filled in by jit_patch_rel32() */
+static uint8_t *emit_jmp32(struct jit_state *j) {
+  emit8(j, 0xE9);
+  emit32(j, 0);
+  return j->ptr - 4;
+}
+
+static uint8_t *emit_jcc32(struct jit_state *j, int cc) {
+  emit8(j, 0x0F);
+  emit8(j, 0x80 + cc);
+  emit32(j, 0);
+  return j->ptr - 4;
+}
+
+static void jit_patch_rel32(uint8_t *site, uint8_t *target) {
+  int32_t rel = (int32_t)(target - (site + 4));
+  memcpy(site, &rel, sizeof(rel));
+}
+
+/* x86 condition codes */
+enum {
+  CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8, CC_NS = 0x9,
+  CC_AE = 0x3, CC_L = 0xC, CC_LE = 0xE, CC_G = 0xF
+};
+
+static void emit_call(struct jit_state *j, void *fn) {
+  emit8(j, 0x48);
+  emit8(j, 0xB8);
+  emit64(j, (uint64_t)(uintptr_t)fn);
+  emit8(j, 0xFF);
+  emit8(j, 0xD0);
+}
+
+/* calls fn(vm, ecx, edx) keeping the caller-saved guest registers and the budget,
+ * the result is left in eax */
+static void emit_helper_call(struct jit_state *j, void *fn) {
+  int r;
+  for (r = R_R0; r <= R_R3; r++) {
+    emit8(j, 0x41);
+    emit8(j, 0x50 + r);
+  }
+  emit8(j, 0x57);                      /* push rdi */
+  emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xEC); emit8(j, 0x08); /* sub rsp, 8 */
+  emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0xEF); /* mov rdi, rbp */
+  emit_alu_rr(j, 0x89, H_RSI, H_RCX);  /* mov esi, ecx */
+  emit_call(j, fn);
+  emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xC4); emit8(j, 0x08); /* add rsp, 8 */
+  emit8(j, 0x5F);                      /* pop rdi */
+  for (r = R_R3; r >= R_R0; r--) {
+    emit8(j, 0x41);
+    emit8(j, 0x58 + r);
+  }
+}
+
+static uint32_t jit_load(struct lc3_vm *vm, uint32_t address) {
+  return mem_read(vm, address);
+}
+
+/* the load of a KBSR spin loop, see kbsr_idle() */
+static uint32_t jit_load_idle(struct lc3_vm *vm, uint32_t address) {
+  uint16_t val = mem_read(vm, address);
+  if (address == MR_KBSR && !(val & KBSR_READY)) {
+    kbsr_idle(vm);
+  }
+  return val;
+}
+
+/* returns nonzero when the store flushed the compiled code or stopped the
+ * machine */
+static uint32_t jit_store(struct lc3_vm *vm, uint32_t address, uint32_t val) {
+  unsigned generation = vm->jit->generation;
+  vm->jit->stopped = mem_write(vm, address, val);
+  return vm->jit->stopped || generation != vm->jit->generation;
+}
+
+/* a trap that never waits for input, run without leaving compiled code.
+ * returns nonzero when it stopped the machine or flushed the compiled code */
+static uint32_t jit_trap(struct lc3_vm *vm, uint32_t instr) {
+  unsigned generation = vm->jit->generation;
+  vm->jit->stopped = !vm_execute_trap(vm, instr, NULL, vm->jit->out);
+  vm_sync_flags(vm);
+  return vm->jit->stopped || generation != vm->jit->generation;
+}
+
+/* run the TRAP instr in place: the guest registers go through reg[] since
+ * the trap may read and change any of them, and the block is left with the
+ * PC past the TRAP if jit_trap() says so */
+static void emit_trap_call(struct jit_state *j, uint16_t instr) {
+  int r;
+  for (r = R_R0; r <= R_R7; r++) {
+    emit_store_reg_file(j, r, HREG(r));
+  }
+  emit8(j, 0x57);                      /* push rdi */
+  emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xEC); emit8(j, 0x08); /* sub rsp, 8 */
+  emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0xEF); /* mov rdi, rbp */
+  emit_mov_ri(j, H_RSI, instr);
+  emit_call(j, (void *)jit_trap);
+  emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xC4); emit8(j, 0x08); /* add rsp, 8 */
+  emit8(j, 0x5F);                      /* pop rdi */
+  for (r = R_R0; r <= R_R7; r++) {
+    emit_load_reg_file(j, HREG(r), r);
+  }
+  emit8(j, 0x85); emit8(j, 0xC0);      /* test eax, eax */
+  uint8_t *ok = emit_jcc32(j, CC_E);
+  emit_mov_ri(j, H_RAX, JIT_EXIT_BOUNDARY);
+  jit_patch_rel32(emit_jmp32(j), j->exit);
+  jit_patch_rel32(ok, j->ptr);
+}
+
+static void emit_flags_writeback(struct jit_state *j, int r);
+
+/* dst = memory[ecx], with the device page going through read. the pending
+ * condition codes are written back first since devices like the PSR can read
+ * them */
+static void emit_load_device(struct jit_state *j, int dst, int flag_reg,
+                      uint32_t (*read)(struct lc3_vm *, uint32_t)) {
+  emit_alu_ri(j, 7, H_RCX, MR_DEVICE_BASE); /* cmp ecx, 0xFE00 */
+  uint8_t *slow = emit_jcc32(j, CC_AE);
+
+  /* movzx dst, word [rbx + rcx * 2] */
+  emit_rex(j, 0, dst, 0);
+  emit8(j, 0x0F);
+  emit8(j, 0xB7);
+  emit_modrm(j, 0, dst, 4);
+  emit8(j, 0x4B);
+  uint8_t *done = emit_jmp32(j);
+
+  jit_patch_rel32(slow, j->ptr);
+  if (flag_reg >= 0) {
+    emit8(j, 0x51);                    /* push rcx */
+    emit_flags_writeback(j, flag_reg);
+    emit8(j, 0x59);                    /* pop rcx */
+  }
+  emit_helper_call(j, (void *)read);
+  emit_alu_rr(j, 0x89, dst, H_RAX);
+  jit_patch_rel32(done, j->ptr);
+}
+
+static void emit_load_dynamic(struct jit_state *j, int dst, int flag_reg) {
+  emit_load_device(j, dst, flag_reg, jit_load);
+}
+
+/* dst = memory[address] for an address known at compile time */
+static void emit_load_const(struct jit_state *j, int dst, uint16_t address, int flag_reg) {
+  if (address >= MR_DEVICE_BASE) {
+    emit_mov_ri(j, H_RCX, address);
+    emit_load_dynamic(j, dst, flag_reg);
+    return;
+  }
+
+  /* movzx dst, word [rbx + 2 * address] */
+  emit_rex(j, 0, dst, H_RBX);
+  emit8(j, 0x0F);
+  emit8(j, 0xB7);
+  emit_modrm(j, 2, dst, H_RBX);
+  emit32(j, 2u * address);
+}
+
+/* leave the block at next_pc with the budget for the rest of it refunded */
+static void emit_exit_early(struct jit_state *j, uint16_t next_pc, int refund) {
+  emit_store_reg_file_imm(j, R_PC, next_pc);
+  if (refund) {
+    emit8(j, 0x48); emit8(j, 0x81); emit8(j, 0xC7); emit32(j, refund); /* add rdi, imm */
+  }
+  emit_alu_rr(j, 0x31, H_RAX, H_RAX);  /* xor eax, eax */
+  jit_patch_rel32(emit_jmp32(j), j->exit);
+}
+
+/* memory[ecx] = edx, leaving the block if that hit compiled code. words
+ * without anything cached for them outside the device page are stored
+ * directly and mark their page dirty, the rest see the condition codes
+ * written back */
+static void emit_store(struct jit_state *j, uint16_t next_pc, int refund, int flag_reg) {
+  emit_alu_ri(j, 7, H_RCX, MR_DEVICE_BASE); /* cmp ecx, 0xFE00 */
+  uint8_t *device = emit_jcc32(j, CC_AE);
+  emit8(j, 0x48); emit8(j, 0xB8); emit64(j, (uint64_t)(uintptr_t)j->vm->code_map); /* movabs rax */
+  emit8(j, 0x80); emit8(j, 0x3C); emit8(j, 0x08); emit8(j, 0x00); /* cmp byte [rax + rcx], 0 */
+  uint8_t *cached = emit_jcc32(j, CC_NE);
+  emit8(j, 0x66); emit8(j, 0x89); emit8(j, 0x14); emit8(j, 0x4B); /* mov [rbx + rcx * 2], dx */
+  emit8(j, 0xC1); emit8(j, 0xE9); emit8(j, DIRTY_PAGE_SHIFT);       /* shr ecx, DIRTY_PAGE_SHIFT */
+  emit8(j, 0xC6); emit8(j, 0x84); emit8(j, 0x0B);                   /* mov byte [rbx + rcx + dirty], 1 */
+  emit32(j, (uint32_t)(offsetof(struct lc3_vm, dirty) - offsetof(struct lc3_vm, memory)));
+  emit8(j, 1);
+  uint8_t *done = emit_jmp32(j);
+
+  jit_patch_rel32(device, j->ptr);
+  jit_patch_rel32(cached, j->ptr);
+  if (flag_reg >= 0) {
+    emit8(j, 0x51);                    /* push rcx */
+    emit8(j, 0x52);                    /* push rdx */
+    emit_flags_writeback(j, flag_reg);
+    emit8(j, 0x5A);                    /* pop rdx */
+    emit8(j, 0x59);                    /* pop rcx */
+  }
+  emit_helper_call(j, (void *)jit_store);
+  emit8(j, 0x85); emit8(j, 0xC0);      /* test eax, eax */
+  uint8_t *ok = emit_jcc32(j, CC_E);
+  emit_exit_early(j, next_pc, refund);
+  jit_patch_rel32(ok, j->ptr);
+  jit_patch_rel32(done, j->ptr);
+}
+
+/* write the condition codes of guest register r back to reg[R_COND], leaving
+ * the host flags of `test r16, r16` intact for a following jcc */
+static void emit_flags_writeback(struct jit_state *j, int r) {
+  int h = HREG(r);
+  emit8(j, 0x66);
+  emit_rex(j, 0, h, h);
+  emit8(j, 0x85);
+  emit_modrm(j, 3, h, h);
+  emit8(j, 0xB8); emit32(j, FL_POS);   /* mov eax, FL_POS */
+  emit8(j, 0xB9); emit32(j, FL_ZRO);   /* mov ecx, FL_ZRO */
+  emit8(j, 0xBA); emit32(j, FL_NEG);   /* mov edx, FL_NEG */
+  emit8(j, 0x0F); emit8(j, 0x44); emit8(j, 0xC1); /* cmovz eax, ecx */
+  emit8(j, 0x0F); emit8(j, 0x48); emit8(j, 0xC2); /* cmovs eax, edx */
+  emit_store_reg_file(j, R_COND, H_RAX);
+}
+
+/* leave the block at pc for vm_jit_run() to look for interrupts */
+static void emit_exit_boundary(struct jit_state *j, uint16_t pc) {
+  emit_store_reg_file_imm(j, R_PC, pc);
+  emit_mov_ri(j, H_RAX, JIT_EXIT_BOUNDARY);
+  jit_patch_rel32(emit_jmp32(j), j->exit);
+}
+
+/* jump to the block at pc, chaining to it directly if it is already compiled
+ * or leaving an exit that jit_compile() patches once it is. interrupts are
+ * only checked for when the jump ends a basic block */
+static void emit_exit_to(struct jit_state *j, uint16_t pc, int boundary) {
+  if (j->blocks[pc]) {
+    uint8_t *target = j->blocks[pc];
+    jit_patch_rel32(emit_jmp32(j), boundary ? target : target + JIT_IRQ_CHECK_SIZE);
+    return;
+  }
+
+  uint8_t *site = emit_jmp32(j);
+  jit_patch_rel32(site, j->ptr);
+  if (j->patch_count < JIT_MAX_PATCHES) {
+    j->patches[j->patch_count].site = site;
+    j->patches[j->patch_count].target = pc;
+    j->patches[j->patch_count].boundary = boundary;
+    j->patch_count++;
+  }
+  if (boundary) {
+    emit_exit_boundary(j, pc);
+  }
+  else {
+    emit_exit_early(j, pc, 0);
+  }
+}
+
+/* jump to the block at the PC held in ecx */
+static void emit_exit_dynamic(struct jit_state *j) {
+  emit_store_reg_file(j, R_PC, H_RCX);
+  emit8(j, 0x48); emit8(j, 0xB8); emit64(j, (uint64_t)(uintptr_t)j->blocks); /* movabs rax */
+  emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x04); emit8(j, 0xC8); /* mov rax, [rax + rcx * 8] */
+  emit8(j, 0x48); emit8(j, 0x85); emit8(j, 0xC0); /* test rax, rax */
+  uint8_t *miss = emit_jcc32(j, CC_E);
+  emit8(j, 0xFF); emit8(j, 0xE0);      /* jmp rax */
+  jit_patch_rel32(miss, j->ptr);
+  emit_mov_ri(j, H_RAX, JIT_EXIT_BOUNDARY);
+  jit_patch_rel32(emit_jmp32(j), j->exit);
+}
+
+static void jit_emit_stubs(struct jit_state *j) {
+  int r;
+
+  /* j->exit: spill guest registers and the budget, then return eax */
+  j->exit = j->ptr;
+  for (r = R_R0; r <= R_R7; r++) {
+    emit_store_reg_file(j, r, HREG(r));
+  }
+  emit8(j, 0x48); emit8(j, 0xB9); emit64(j, (uint64_t)(uintptr_t)&j->budget_left); /* movabs rcx */
+  emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0x39); /* mov [rcx], rdi */
+  emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xC4); emit8(j, 0x08); /* add rsp, 8 */
+  emit8(j, 0x41); emit8(j, 0x5F);      /* pop r15 */
+  emit8(j, 0x41); emit8(j, 0x5E);      /* pop r14 */
+  emit8(j, 0x41); emit8(j, 0x5D);      /* pop r13 */
+  emit8(j, 0x41); emit8(j, 0x5C);      /* pop r12 */
+  emit8(j, 0x5D);                      /* pop rbp */
+  emit8(j, 0x5B);                      /* pop rbx */
+  emit8(j, 0xC3);                      /* ret */
+
+  /* j->enter(budget, code) */
+  j->enter = (int (*)(int64_t, void *))j->ptr;
+  emit8(j, 0x53);                      /* push rbx */
+  emit8(j, 0x55);                      /* push rbp */
+  emit8(j, 0x41); emit8(j, 0x54);      /* push r12 */
+  emit8(j, 0x41); emit8(j, 0x55);      /* push r13 */
+  emit8(j, 0x41); emit8(j, 0x56);      /* push r14 */
+  emit8(j, 0x41); emit8(j, 0x57);      /* push r15 */
+  emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xEC); emit8(j, 0x08); /* sub rsp, 8 */
+  emit8(j, 0x48); emit8(j, 0xBB); emit64(j, (uint64_t)(uintptr_t)j->vm->memory); /* movabs rbx */
+  emit8(j, 0x48); emit8(j, 0xBD); emit64(j, (uint64_t)(uintptr_t)j->vm);         /* movabs rbp */
+  for (r = R_R0; r <= R_R7; r++) {
+    emit_load_reg_file(j, HREG(r), r);
+  }
+  emit8(j, 0xFF); emit8(j, 0xE6);      /* jmp rsi */
+
+  j->code_start = j->ptr;
+}
+
+static int jit_init(struct lc3_vm *vm) {
+  if (vm->jit) {
+    return 1;
+  }
+
+  /* mapped like the vm, so blocks[] only gets backed for the pages that
+   * have compiled code. malloc() may hand back reused memory it has to clear */
+  struct jit_state *j = mmap(NULL, sizeof(*j), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (j == MAP_FAILED) {
+    return 0;
+  }
+
+  /* the arena is never writable and executable at once, see jit_compile().
+   * most guests only ever fill a few pages of it */
+  void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (code == MAP_FAILED) {
+    munmap(j, sizeof(*j));
+    return 0;
+  }
+
+  j->vm = vm;
+  j->code = j->ptr = code;
+  jit_emit_stubs(j);
+  if (mprotect(code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, JIT_CODE_SIZE);
+    munmap(j, sizeof(*j));
+    return 0;
+  }
+  vm->jit = j;
+  return 1;
+}
+
+static void jit_destroy(struct lc3_vm *vm) {
+  if (vm->jit) {
+    munmap(vm->jit->code, JIT_CODE_SIZE);
+    munmap(vm->jit, sizeof(*vm->jit));
+    vm->jit = NULL;
+  }
+}
+
+static void jit_flush(struct lc3_vm *vm) {
+  struct jit_state *j = vm->jit;
+  if (!j) {
+    return;
+  }
+
+  /* everything compiled is on a dirty page */
+  for (int p = 0; p < DIRTY_PAGES; p++) {
+    if (vm->dirty[p]) {
+      int base = p << DIRTY_PAGE_SHIFT;
+      for (int i = base; i < base + DIRTY_PAGE_WORDS; i++) {
+        vm->code_map[i] &= ~CODE_COMPILED;
+      }
+      memset(j->blocks + base, 0, DIRTY_PAGE_WORDS * sizeof(j->blocks[0]));
+    }
+  }
+  j->ptr = j->code_start;
+  j->patch_count = 0;
+  j->generation++;
+}
+
+/* BR condition for nzp when the flags come from `test r16, r16` */
+static int jit_branch_cc(int nzp) {
+  switch (nzp) {
+    case FL_NEG: return CC_S;
+    case FL_ZRO: return CC_E;
+    case FL_POS: return CC_G;
+    case FL_NEG | FL_ZRO: return CC_LE;
+    case FL_NEG | FL_POS: return CC_NE;
+    case FL_ZRO | FL_POS: return CC_NS;
+  }
+  return -1;
+}
+
+/* emit the block starting at pc at j->ptr, see jit_compile() */
+static uint8_t *jit_emit_block(struct lc3_vm *vm, uint16_t pc) {
+  struct jit_state *j = vm->jit;
+
+  /* count instructions up to and including the terminator */
+  int len = 0;
+  int terminated = 0;
+  while (len < JIT_MAX_BLOCK && !terminated) {
+    uint16_t a = pc + len;
+    if (a >= MR_DEVICE_BASE) {
+      break;
+    }
+    uint16_t op = vm->memory[a] >> 12;
+    if (op == OP_RTI || op == OP_RES) {
+      break;
+    }
+    terminated = op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP;
+    len++;
+  }
+  if (len == 0) {
+    return NULL;
+  }
+
+  uint8_t *head = j->ptr;
+  j->blocks[pc] = head;
+
+  /* blocks reached at a basic block boundary come in here and leave for
+   * vm_jit_run() to look at a pending interrupt. everything else enters
+   * JIT_IRQ_CHECK_SIZE bytes further on */
+  emit8(j, 0x83); emit_modrm(j, 2, 7, H_RBP);            /* cmp dword [rbp + irq_check], 0 */
+  emit32(j, offsetof(struct lc3_vm, irq_check));
+  emit8(j, 0x00);
+  uint8_t *interrupt = emit_jcc32(j, CC_NE);
+
+  /* charge the whole block up front, bail out if the budget can't cover it */
+  emit8(j, 0x48); emit8(j, 0x81); emit8(j, 0xFF); emit32(j, len); /* cmp rdi, len */
+  uint8_t *enough = emit_jcc32(j, 0xD);                /* jge */
+  emit_exit_early(j, pc, 0);
+  jit_patch_rel32(interrupt, j->ptr);
+  emit_exit_boundary(j, pc);
+  jit_patch_rel32(enough, j->ptr);
+  emit8(j, 0x48); emit8(j, 0x81); emit8(j, 0xEF); emit32(j, len); /* sub rdi, len */
+
+  int flag_reg = -1; /* guest register the condition codes are pending on */
+  int i;
+  for (i = 0; i < len; i++) {
+    uint16_t a = pc + i;
+    uint16_t next = a + 1;
+    int refund = len - i - 1;
+    struct decoded_instr d;
+    decode_instr(vm->memory[a], &d);
+    vm->code_map[a] |= CODE_COMPILED;
+    mark_dirty(vm, a);
+
+    int dr = HREG(d.dr);
+    int sr1 = HREG(d.sr1);
+    int sr2 = HREG(d.sr2);
+
+    switch (d.op) {
+      case OP_ADD:
+        if (!d.imm_flag && d.dr == d.sr2) {
+          emit_alu_rr(j, 0x01, dr, sr1);
+        }
+        else {
+          if (d.dr != d.sr1) {
+            emit_alu_rr(j, 0x89, dr, sr1);
+          }
+          if (d.imm_flag) {
+            emit_alu_ri(j, 0, dr, d.imm);
+          }
+          else {
+            emit_alu_rr(j, 0x01, dr, sr2);
+          }
+        }
+        emit_zext16(j, dr, dr);
+        flag_reg = d.dr;
+        break;
+      case OP_AND:
+        if (!d.imm_flag && d.dr == d.sr2) {
+          emit_alu_rr(j, 0x21, dr, sr1);
+        }
+        else {
+          if (d.dr != d.sr1) {
+            emit_alu_rr(j, 0x89, dr, sr1);
+          }
+          if (d.imm_flag) {
+            emit_alu_ri(j, 4, dr, d.imm);
+          }
+          else {
+            emit_alu_rr(j, 0x21, dr, sr2);
+          }
+        }
+        flag_reg = d.dr;
+        break;
+      case OP_NOT:
+        if (d.dr != d.sr1) {
+          emit_alu_rr(j, 0x89, dr, sr1);
+        }
+        emit_alu_ri(j, 6, dr, 0xFFFF);
+        flag_reg = d.dr;
+        break;
+      case OP_LEA:
+        emit_mov_ri(j, dr, (uint16_t)(next + d.imm));
+        flag_reg = d.dr;
+        break;
+      case OP_LD:
+        emit_load_const(j, dr, next + d.imm, flag_reg);
+        flag_reg = d.dr;
+        break;
+      case OP_LDI:
+        emit_load_const(j, H_RCX, next + d.imm, flag_reg);
+        /* BRzp #-2 right behind makes it a KBSR spin loop if it points there */
+        emit_load_device(j, dr, flag_reg, vm->memory[next] == 0x07FE ? jit_load_idle : jit_load);
+        flag_reg = d.dr;
+        break;
+      case OP_LDR:
+        emit_alu_rr(j, 0x89, H_RCX, sr1);
+        emit_alu_ri(j, 0, H_RCX, d.imm);
+        emit_zext16(j, H_RCX, H_RCX);
+        emit_load_dynamic(j, dr, flag_reg);
+        flag_reg = d.dr;
+        break;
+      case OP_ST:
+        emit_mov_ri(j, H_RCX, (uint16_t)(next + d.imm));
+        emit_alu_rr(j, 0x89, H_RDX, dr);
+        emit_store(j, next, refund, flag_reg);
+        break;
+      case OP_STI:
+        emit_load_const(j, H_RCX, next + d.imm, flag_reg);
+        emit_alu_rr(j, 0x89, H_RDX, dr);
+        emit_store(j, next, refund, flag_reg);
+        break;
+      case OP_STR:
+        emit_alu_rr(j, 0x89, H_RCX, sr1);
+        emit_alu_ri(j, 0, H_RCX, d.imm);
+        emit_zext16(j, H_RCX, H_RCX);
+        emit_alu_rr(j, 0x89, H_RDX, dr);
+        emit_store(j, next, refund, flag_reg);
+        break;
+      case OP_BR:
+        {
+          uint16_t target = next + d.imm;
+          int cc = -1;
+          if (flag_reg >= 0) {
+            emit_flags_writeback(j, flag_reg);
+            if (d.dr == (FL_NEG | FL_ZRO | FL_POS)) {
+              emit_exit_to(j, target, 1);
+              break;
+            }
+            cc = jit_branch_cc(d.dr);
+          }
+          else if (d.dr) {
+            /* test byte [rbp + 2 * R_COND], nzp */
+            emit8(j, 0xF6);
+            emit_modrm(j, 1, 0, H_RBP);
+            emit8(j, 2 * R_COND);
+            emit8(j, d.dr);
+            cc = CC_NE;
+          }
+
+          if (cc < 0) {
+            emit_exit_to(j, next, 1);
+            break;
+          }
+          uint8_t *taken = emit_jcc32(j, cc);
+          emit_exit_to(j, next, 1);
+          jit_patch_rel32(taken, j->ptr);
+          emit_exit_to(j, target, 1);
+        }
+        break;
+      case OP_JMP:
+        if (flag_reg >= 0) {
+          emit_flags_writeback(j, flag_reg);
+        }
+        emit_alu_rr(j, 0x89, H_RCX, sr1);
+        emit_exit_dynamic(j);
+        break;
+      case OP_JSR:
+        if (flag_reg >= 0) {
+          emit_flags_writeback(j, flag_reg);
+        }
+        emit_mov_ri(j, HREG(R_R7), next);
+        if (d.imm_flag) {
+          emit_exit_to(j, next + d.imm, 1);
+        }
+        else {
+          emit_alu_rr(j, 0x89, H_RCX, sr1);
+          emit_exit_dynamic(j);
+        }
+        break;
+      case OP_TRAP:
+        if (flag_reg >= 0) {
+          emit_flags_writeback(j, flag_reg);
+        }
+        emit_store_reg_file_imm(j, R_PC, next);
+        if (vm_trap_needs_input(d.instr)) {
+          emit_mov_ri(j, H_RAX, d.instr);
+          jit_patch_rel32(emit_jmp32(j), j->exit);
+          break;
+        }
+        emit_trap_call(j, d.instr);
+        emit_exit_to(j, next, 1);
+        break;
+    }
+  }
+
+  /* the block ran into its size limit or something we don't compile */
+  if (!terminated) {
+    if (flag_reg >= 0) {
+      emit_flags_writeback(j, flag_reg);
+    }
+    emit_exit_to(j, pc + len, 0);
+  }
+  return head;
+}
+
+/* switch the pages holding [p, p + len) of the arena between writable and
+ * executable, returns 0 on failure */
+static int jit_protect(uint8_t *p, size_t len, int writable) {
+  uintptr_t start = (uintptr_t)p & ~(uintptr_t)(VM_PAGE_ALIGN - 1);
+  uintptr_t end = ((uintptr_t)p + len + VM_PAGE_ALIGN - 1) & ~(uintptr_t)(VM_PAGE_ALIGN - 1);
+  return mprotect((void *)start, end - start,
+                  writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+/* compile the block starting at pc, returns NULL when the first instruction
+ * has to be left to the interpreter. the arena is never writable and
+ * executable at once: only the pages the block goes on and those of the
+ * exits patched to it are made writable, and only while they are written */
+static void *jit_compile(struct lc3_vm *vm, uint16_t pc) {
+  struct jit_state *j = vm->jit;
+  if (j->ptr + JIT_MAX_BLOCK_BYTES > j->code + JIT_CODE_SIZE) {
+    jit_flush(vm);
+  }
+
+  uint8_t *start = j->ptr;
+  if (!jit_protect(start, JIT_MAX_BLOCK_BYTES, 1)) {
+    return NULL;
+  }
+  uint8_t *head = jit_emit_block(vm, pc);
+  if (!jit_protect(start, JIT_MAX_BLOCK_BYTES, 0)) {
+    /* nothing compiled can be run safely any more */
+    jit_flush(vm);
+    return NULL;
+  }
+  if (!head) {
+    return NULL;
+  }
+
+  /* point exits that were waiting for this block at it */
+  for (int i = 0; i < j->patch_count; i++) {
+    struct jit_patch *patch = &j->patches[i];
+    if (patch->target != pc) {
+      continue;
+    }
+    if (!jit_protect(patch->site, 4, 1)) {
+      /* the exit keeps going through vm_jit_run() */
+      continue;
+    }
+    jit_patch_rel32(patch->site, patch->boundary ? head : head + JIT_IRQ_CHECK_SIZE);
+    if (!jit_protect(patch->site, 4, 0)) {
+      jit_flush(vm);
+      return NULL;
+    }
+    j->patches[i--] = j->patches[--j->patch_count];
+  }
+  return head;
+}
+
+/* handle a TRAP vm_jit_run() got back from compiled code, returns 0 when the
+ * run has to stop with result->exit set */
+static int run_trap(struct lc3_vm *vm, uint16_t instr, FILE *out, struct run_result *result) {
+  if (vm_trap_needs_input(instr)) {
+    result->exit = RUN_TRAP;
+    result->trap = instr;
+    return 0;
+  }
+
+  /* the remaining traps never touch the input stream */
+  if (!vm_execute_trap(vm, instr, NULL, out)) {
+    result->exit = RUN_HALTED;
+    return 0;
+  }
+  return 1;
+}
+
+/* batched run on compiled code, see vm_run(). the tail of a budget that is too
+ * short for the next block is single-stepped on the interpreter */
+struct run_result vm_jit_run(struct lc3_vm *vm, uint64_t budget, FILE *out) {
+  struct run_result result = {0, RUN_BUDGET, 0};
+  if (!jit_init(vm)) {
+    return vm_run(vm, budget, out);
+  }
+
+  struct jit_state *j = vm->jit;
+  j->out = out;
+  while (result.retired < budget) {
+    uint64_t left = budget - result.retired;
+    void *code = j->blocks[vm->reg[R_PC]];
+    if (!code) {
+      code = jit_compile(vm, vm->reg[R_PC]);
+    }
+
+    int trap = 0;
+    uint64_t retired = 0;
+    if (code) {
+      int64_t slice = left > JIT_SLICE ? JIT_SLICE : (int64_t)left;
+
+      /* compiled code reads and writes reg[R_COND] directly */
+      vm_sync_flags(vm);
+      trap = j->enter(slice, (uint8_t *)code + JIT_IRQ_CHECK_SIZE);
+      retired = slice - j->budget_left;
+      result.retired += retired;
+      if (j->stopped) {
+        j->stopped = 0;
+        result.exit = RUN_HALTED;
+        return result;
+      }
+    }
+
+    if (trap == JIT_EXIT_BOUNDARY) {
+      if (interrupt_pending(vm)) {
+        vm_check_interrupts(vm);
+      }
+    }
+    else if (trap) {
+      if (!run_trap(vm, trap, out, &result)) {
+        return result;
+      }
+      if (interrupt_pending(vm)) {
+        vm_check_interrupts(vm);
+      }
+    }
+    else if (retired == 0) {
+      struct run_result step = vm_run(vm, 1, out);
+      result.retired += step.retired;
+      if (step.exit != RUN_BUDGET) {
+        step.retired = result.retired;
+        return step;
+      }
+    }
+  }
+  return result;
+}
+
+/* runs until the program halts, falling back to the threaded core when no
+ * executable memory can be had */
+int vm_run_jit(struct lc3_vm *vm, FILE *in, FILE *out) {
+  return run_to_halt(vm, vm_jit_run, in, out);
+}
+#else
+static void jit_flush(struct lc3_vm *vm) {
+  (void)vm;
+}
+
+static void jit_destroy(struct lc3_vm *vm) {
+  (void)vm;
+}
+
+/* no code generator for this host */
+struct run_result vm_jit_run(struct lc3_vm *vm, uint64_t budget, FILE *out) {
+  return vm_run(vm, budget, out);
+}
+
+int vm_run_jit(struct lc3_vm *vm, FILE *in, FILE *out) {
+  return vm_run_threaded(vm, in, out);
+}
+#endif
+
+void vm_run_engine(struct lc3_vm *vm, int engine) {
+  if (engine == ENGINE_THREADED) {
+    vm_run_threaded(vm, stdin, stdout);
+    return;
+  }
+
+  if (engine == ENGINE_JIT) {
+    vm_run_jit(vm, stdin, stdout);
+    return;
+  }
+
+  /* input events are stamped with the instruction they happened at */
+  if (vm->input_log) {
+    vm->input_log->counted = 1;
+  }
+  vm_core_loops[vm_core_features(vm)](vm, UINT64_MAX);
+}
+
+/* guest scheduler
+ *
+ * runs many independent guests on a pool of worker threads. every worker owns
+ * a run queue it pushes to and pops from at the back, and a worker that runs
+ * dry steals from the front of the others. guests run in slices of SCHED_SLICE
+ * instructions. a guest that waits for input, either on an input trap or by
+ * spinning on an empty KBSR, is parked until poll() reports its input
+ * readable, so the worker can move on to the next one. */
+
+static int run_queue_push(struct run_queue *q, struct guest *g) {
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->cap) {
+    int cap = q->cap ? q->cap * 2 : 16;
+    struct guest **items = malloc(cap * sizeof(*items));
+    if (!items) {
+      pthread_mutex_unlock(&q->lock);
+      return 0;
+    }
+    for (int i = 0; i < q->count; i++) {
+      items[i] = q->items[(q->head + i) % q->cap];
+    }
+    free(q->items);
+    q->items = items;
+    q->head = 0;
+    q->cap = cap;
+  }
+  q->items[(q->head + q->count) % q->cap] = g;
+  q->count++;
+  pthread_mutex_unlock(&q->lock);
+  return 1;
+}
+
+/* the owner takes the most recently queued guest, thieves the oldest */
+static struct guest *run_queue_pop(struct run_queue *q, int steal) {
+  struct guest *g = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0) {
+    if (steal) {
+      g = q->items[q->head];
+      q->head = (q->head + 1) % q->cap;
+    }
+    else {
+      g = q->items[(q->head + q->count - 1) % q->cap];
+    }
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return g;
+}
+
+struct scheduler *vm_sched_create(int workers, int engine) {
+  if (workers < 1) {
+    workers = 1;
+  }
+  if (workers > SCHED_MAX_WORKERS) {
+    workers = SCHED_MAX_WORKERS;
+  }
+
+  struct scheduler *s = calloc(1, sizeof(*s));
+  if (!s) {
+    return NULL;
+  }
+  s->workers = workers;
+  s->run = engine == ENGINE_JIT ? vm_jit_run : vm_run;
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&s->queues[i].lock, NULL);
+  }
+  pthread_mutex_init(&s->park_lock, NULL);
+  return s;
+}
+
+/* queue vm to run with its own input and output streams. input is switched to
+ * unbuffered so that poll() on it tells the whole story */
+struct guest *vm_sched_add(struct scheduler *s, struct lc3_vm *vm, FILE *in, FILE *out) {
+  struct guest *g = calloc(1, sizeof(*g));
+  if (!g) {
+    return NULL;
+  }
+  g->vm = vm;
+  g->in = in;
+  g->out = out;
+  setvbuf(in, NULL, _IONBF, 0);
+  vm->kbd = in;
+  vm->display = out;
+  vm->spin_yield = 1;
+
+  if (!run_queue_push(&s->queues[s->guest_count % s->workers], g)) {
+    free(g);
+    return NULL;
+  }
+  g->next = s->guests;
+  s->guests = g;
+  s->guest_count++;
+  atomic_fetch_add(&s->active, 1);
+  return g;
+}
+
+static void sched_park(struct scheduler *s, struct guest *g) {
+  vm_flush_output(g->vm);
+  pthread_mutex_lock(&s->park_lock);
+  g->next_parked = s->parked;
+  s->parked = g;
+  pthread_mutex_unlock(&s->park_lock);
+}
+
+/* wait up to SCHED_POLL_MS for parked guests to become runnable and queue
+ * them on q. only one worker polls at a time */
+static void sched_poll_parked(struct scheduler *s, struct run_queue *q) {
+  pthread_mutex_lock(&s->park_lock);
+  if (s->polling || !s->parked) {
+    pthread_mutex_unlock(&s->park_lock);
+    /* nothing to do but wait for guests running elsewhere */
+    usleep(1000);
+    return;
+  }
+  s->polling = 1;
+  struct guest *parked = s->parked;
+  s->parked = NULL;
+  pthread_mutex_unlock(&s->park_lock);
+
+  int n = 0;
+  struct guest *g;
+  for (g = parked; g; g = g->next_parked) {
+    n++;
+  }
+
+  struct pollfd *fds = calloc(n, sizeof(*fds));
+  int i = 0;
+  int always_ready = 0;
+  for (g = parked; g && fds; g = g->next_parked, i++) {
+    fds[i].fd = fileno(g->in);
+    fds[i].events = POLLIN;
+    /* streams without a descriptor (fmemopen) never block */
+    always_ready |= fds[i].fd < 0;
+  }
+  if (fds) {
+    poll(fds, n, always_ready ? 0 : SCHED_POLL_MS);
+  }
+
+  i = 0;
+  struct guest *still_parked = NULL;
+  struct guest *next;
+  for (g = parked; g; g = next, i++) {
+    next = g->next_parked;
+    /* KBSR spinners come back on a timeout too in case they weren't waiting
+     * on the keyboard after all */
+    int ready = !fds || fds[i].fd < 0 || fds[i].revents || !g->pending_trap;
+    if (ready) {
+      if (g->pending_trap) {
+        vm_execute_trap(g->vm, g->pending_trap, g->in, g->out);
+        g->pending_trap = 0;
+      }
+      run_queue_push(q, g);
+    }
+    else {
+      g->next_parked = still_parked;
+      still_parked = g;
+    }
+  }
+  free(fds);
+
+  pthread_mutex_lock(&s->park_lock);
+  while (still_parked) {
+    next = still_parked->next_parked;
+    still_parked->next_parked = s->parked;
+    s->parked = still_parked;
+    still_parked = next;
+  }
+  s->polling = 0;
+  pthread_mutex_unlock(&s->park_lock);
+}
+
+/* run one slice of g, returns 1 if it should be queued again */
+static int sched_run_slice(struct scheduler *s, struct guest *g) {
+  struct lc3_vm *vm = g->vm;
+  vm->kbd_empty_polls = 0;
+  vm->spun = 0;
+
+  struct run_result result = s->run(vm, SCHED_SLICE, g->out);
+  g->retired += result.retired;
+
+  switch (result.exit) {
+    case RUN_BUDGET:
+      if (vm->spun || vm->kbd_empty_polls >= SCHED_SPIN_POLLS) {
+        sched_park(s, g);
+        return 0;
+      }
+      return 1;
+    case RUN_TRAP:
+      {
+        struct pollfd fd = {fileno(g->in), POLLIN, 0};
+        if (fd.fd < 0 || poll(&fd, 1, 0) != 0) {
+          vm_execute_trap(vm, result.trap, g->in, g->out);
+          return 1;
+        }
+        g->pending_trap = result.trap;
+        sched_park(s, g);
+      }
+      return 0;
+    default:
+      g->exit = result.exit;
+      fflush(g->out);
+      atomic_fetch_sub(&s->active, 1);
+      return 0;
+  }
+}
+
+static void *sched_worker_main(void *arg) {
+  struct sched_worker *w = arg;
+  struct scheduler *s = w->s;
+  struct run_queue *own = &s->queues[w->id];
+
+  while (atomic_load(&s->active) > 0) {
+    struct guest *g = run_queue_pop(own, 0);
+    for (int i = 1; !g && i < s->workers; i++) {
+      g = run_queue_pop(&s->queues[(w->id + i) % s->workers], 1);
+    }
+
+    if (!g) {
+      sched_poll_parked(s, own);
+      continue;
+    }
+
+    if (sched_run_slice(s, g)) {
+      run_queue_push(own, g);
+    }
+  }
+  return NULL;
+}
+
+/* run every guest until it halts or faults */
+void vm_sched_run(struct scheduler *s) {
+  pthread_t threads[SCHED_MAX_WORKERS];
+  struct sched_worker workers[SCHED_MAX_WORKERS];
+  int started = 0;
+
+  for (int i = 1; i < s->workers; i++) {
+    workers[i].s = s;
+    workers[i].id = i;
+    if (pthread_create(&threads[i], NULL, sched_worker_main, &workers[i]) == 0) {
+      started = i;
+    }
+    else {
+      break;
+    }
+  }
+
+  /* the calling thread is worker 0 */
+  workers[0].s = s;
+  workers[0].id = 0;
+  sched_worker_main(&workers[0]);
+
+  for (int i = 1; i <= started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+void vm_sched_destroy(struct scheduler *s) {
+  struct guest *g = s->guests;
+  while (g) {
+    struct guest *next = g->next;
+    free(g);
+    g = next;
+  }
+  for (int i = 0; i < s->workers; i++) {
+    pthread_mutex_destroy(&s->queues[i].lock);
+    free(s->queues[i].items);
+  }
+  pthread_mutex_destroy(&s->park_lock);
+  free(s);
+}
+
+/* control-flow analysis
+ *
+ * after loading, the image is walked from PC_START along every fallthrough,
+ * branch and call that can be seen statically. that gives its basic blocks
+ * and the edges between them, the JSR call graph and the backward branches
+ * that close loops. JMP, RET, JSRR and RTI targets aren't known until run
+ * time, so code only reached through them or an interrupt vector is left
+ * out. what the walk finds is decoded up front, so the interpreters start
+ * on a warm decode cache with the superinstructions already fused. the
+ * index describes the image as loaded, code the guest writes later isn't
+ * in it. */
+enum {
+  CFG_REACHED = 1 << 0,
+  CFG_LEADER = 1 << 1,
+  CFG_QUEUED = 1 << 2
+};
+
+/* CFG_* for an instruction that ends a block, -1 for one that doesn't */
+static int cfg_kind(const struct decoded_instr *d) {
+  switch (d->op) {
+    case OP_BR:
+      return d->dr ? CFG_BRANCH : -1;
+    case OP_JSR:
+      return CFG_CALL;
+    case OP_JMP:
+    case OP_RTI:
+      return CFG_INDIRECT;
+    case OP_TRAP:
+      return (d->instr & 0xFF) == TRAP_HALT ? CFG_STOP : CFG_TRAP;
+    case OP_RES:
+      return CFG_STOP;
+  }
+  return -1;
+}
+
+/* start a block at address, walking it later if nothing has yet */
+static void cfg_leader(uint8_t *marks, uint16_t *work, int *n, uint16_t address) {
+  marks[address] |= CFG_LEADER;
+  if (!(marks[address] & (CFG_REACHED | CFG_QUEUED)) && address < MR_DEVICE_BASE) {
+    marks[address] |= CFG_QUEUED;
+    work[(*n)++] = address;
+  }
+}
+
+static void cfg_destroy(struct cfg *cfg) {
+  if (cfg) {
+    free(cfg->blocks);
+    free(cfg->calls);
+    free(cfg->loops);
+    free(cfg);
+  }
+}
+
+static struct cfg *cfg_build(struct lc3_vm *vm, uint16_t entry) {
+  uint8_t *marks = calloc(UINT16_MAX + 1, 1);
+  uint16_t *work = malloc((UINT16_MAX + 1) * sizeof(*work));
+  struct cfg *cfg = calloc(1, sizeof(*cfg));
+  if (!marks || !work || !cfg) {
+    goto fail;
+  }
+  cfg->entry = entry;
+
+  /* mark everything reachable and where blocks start */
+  int n = 0;
+  size_t reached = 0;
+  cfg_leader(marks, work, &n, entry);
+  while (n > 0) {
+    uint16_t a = work[--n];
+    while (a < MR_DEVICE_BASE && !(marks[a] & CFG_REACHED)) {
+      marks[a] |= CFG_REACHED;
+      reached++;
+      struct decoded_instr d;
+      decode_instr(vm->memory[a], &d);
+      uint16_t next = a + 1;
+      int kind = cfg_kind(&d);
+      if (kind == CFG_BRANCH) {
+        cfg_leader(marks, work, &n, next + d.imm);
+      }
+      if (kind == CFG_CALL && d.imm_flag) {
+        cfg_leader(marks, work, &n, next + d.imm);
+      }
+      if ((kind == CFG_BRANCH && d.dr != 0x7) || kind == CFG_CALL || kind == CFG_TRAP) {
+        cfg_leader(marks, work, &n, next);
+      }
+      if (kind >= 0) {
+        break;
+      }
+      /* running into code already walked joins it */
+      if (marks[next] & CFG_REACHED) {
+        marks[next] |= CFG_LEADER;
+      }
+      a = next;
+    }
+  }
+
+  cfg->blocks = malloc((reached + 1) * sizeof(*cfg->blocks));
+  cfg->calls = malloc((reached + 1) * sizeof(*cfg->calls));
+  cfg->loops = malloc((2 * reached + 1) * sizeof(*cfg->loops));
+  if (!cfg->blocks || !cfg->calls || !cfg->loops) {
+    goto fail;
+  }
+
+  /* cut the reached words into blocks */
+  for (uint32_t a = 0; a < MR_DEVICE_BASE;) {
+    if (!(marks[a] & CFG_REACHED)) {
+      a++;
+      continue;
+    }
+    struct cfg_block *b = &cfg->blocks[cfg->block_count++];
+    struct decoded_instr d;
+    int kind;
+    b->start = a;
+    for (;;) {
+      decode_instr(vm->memory[a], &d);
+      kind = cfg_kind(&d);
+      a++;
+      if (kind >= 0 || a >= MR_DEVICE_BASE || !(marks[a] & CFG_REACHED) || (marks[a] & CFG_LEADER)) {
+        break;
+      }
+    }
+    b->end = a;
+    b->kind = kind < 0 ? CFG_FALLTHROUGH : kind;
+    b->succ_count = 0;
+
+    uint16_t target = a + d.imm;
+    if (kind == CFG_BRANCH && target < MR_DEVICE_BASE) {
+      b->succ[b->succ_count++] = target;
+    }
+    if (kind == CFG_CALL && d.imm_flag) {
+      cfg->calls[cfg->call_count++] = (struct cfg_edge){a - 1, target};
+    }
+    if ((kind < 0 || (kind == CFG_BRANCH && d.dr != 0x7) || kind == CFG_CALL || kind == CFG_TRAP) &&
+        a < MR_DEVICE_BASE && (marks[a] & CFG_REACHED)) {
+      b->succ[b->succ_count++] = a;
+    }
+    for (int i = 0; i < b->succ_count; i++) {
+      if (b->succ[i] < a) {
+        cfg->loops[cfg->loop_count++] = (struct cfg_edge){a - 1, b->succ[i]};
+      }
+    }
+  }
+
+  free(marks);
+  free(work);
+  return cfg;
+
+fail:
+  free(marks);
+  free(work);
+  cfg_destroy(cfg);
+  return NULL;
+}
+
+/* index the image at PC_START and decode the code it reaches */
+int vm_analyze(struct lc3_vm *vm) {
+  cfg_destroy(vm->cfg);
+  vm->cfg = cfg_build(vm, PC_START);
+  if (!vm->cfg) {
+    return 0;
+  }
+  for (int i = 0; i < vm->cfg->block_count; i++) {
+    const struct cfg_block *b = &vm->cfg->blocks[i];
+    for (uint32_t a = b->start; a < b->end; a++) {
+      fetch_decoded(vm, a);
+    }
+  }
+  return 1;
+}
+
+void vm_write_cfg(const struct cfg *cfg, FILE *f) {
+  const char *kind_names[] = {"next", "branch", "call", "indirect", "trap", "stop"};
+  fprintf(f, "entry 0x%04X: %d blocks, %d calls, %d loops\n",
+          cfg->entry, cfg->block_count, cfg->call_count, cfg->loop_count);
+  for (int i = 0; i < cfg->block_count; i++) {
+    const struct cfg_block *b = &cfg->blocks[i];
+    fprintf(f, "block 0x%04X-0x%04X %s", b->start, b->end - 1, kind_names[b->kind]);
+    for (int s = 0; s < b->succ_count; s++) {
+      fprintf(f, " 0x%04X", b->succ[s]);
+    }
+    fprintf(f, "\n");
+  }
+  for (int i = 0; i < cfg->call_count; i++) {
+    fprintf(f, "call 0x%04X -> 0x%04X\n", cfg->calls[i].from, cfg->calls[i].to);
+  }
+  for (int i = 0; i < cfg->loop_count; i++) {
+    fprintf(f, "loop 0x%04X -> 0x%04X\n", cfg->loops[i].from, cfg->loops[i].to);
+  }
+}
+
+/* remote debugging
+ *
+ * a debugger client talks to the vm over a socket in the GDB remote serial
+ * protocol: $packet#checksum, acknowledged with + and answered with a packet
+ * of its own. registers go in the order R0-R7, PC, PSR (condition codes
+ * included) and every register or memory word as four hex digits, most
+ * significant first. memory addresses and lengths count words. the stub
+ * knows ?, g, G, p, P, m, M, c, s, Z0/z0 breakpoints, Z2/z2 write
+ * watchpoints, D and k, and a ^C stops a running guest.
+ *
+ * nothing a guest runs through looks for the debugger. a breakpoint is a
+ * CODE_BREAK mark in code_map whose decode dispatches to EXEC_BREAK, which
+ * stops vm_run() in front of the word, and fused sequences never cover one.
+ * a watchpoint is a CODE_WATCH mark, which mem_write() already hands to the
+ * slow path, where the write stops the machine right after the store. the
+ * guest runs on the threaded interpreter and steps on the reference core,
+ * which doesn't see breakpoints, so stepping off one runs the instruction. */
+
+/* wait on port of the loopback interface for a debugger to connect, returns
+ * the connection or -1 */
+int vm_debug_accept(int port) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = -1;
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(s, 1) == 0) {
+    fd = accept(s, NULL, NULL);
+  }
+  close(s);
+  if (fd >= 0) {
+    /* the packets are tiny and every one waits for an answer */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+/* serve a debugger client on the connected socket fd from now on, see
+ * vm_debug_serve() */
+int vm_attach_debugger(struct lc3_vm *vm, int fd) {
+  if (fd < 0) {
+    return 0;
+  }
+  struct debugger *dbg = calloc(1, sizeof(*dbg));
+  if (!dbg) {
+    close(fd);
+    return 0;
+  }
+  dbg->fd = fd;
+  vm_debug_destroy(vm->debug);
+  vm->debug = dbg;
+  return 1;
+}
+
+void vm_debug_destroy(struct debugger *dbg) {
+  if (dbg) {
+    close(dbg->fd);
+    free(dbg);
+  }
+}
+
+/* next byte from the client, -1 once it has gone */
+static int debug_getc(struct debugger *dbg) {
+  unsigned char c;
+  return recv(dbg->fd, &c, 1, 0) == 1 ? c : -1;
+}
+
+/* read the next intact packet into dbg->packet, returns its length or -1
+ * once the client has gone. acknowledgements from the client are skipped */
+int vm_debug_receive(struct debugger *dbg) {
+  for (;;) {
+    int c;
+    while ((c = debug_getc(dbg)) != '$') {
+      if (c < 0) {
+        return -1;
+      }
+    }
+
+    int len = 0;
+    unsigned sum = 0;
+    while ((c = debug_getc(dbg)) != '#') {
+      if (c < 0) {
+        return -1;
+      }
+      if (len < DEBUG_PACKET_SIZE - 1) {
+        dbg->packet[len++] = c;
+        sum += c;
+      }
+    }
+    dbg->packet[len] = '\0';
+
+    char check[3] = {0};
+    for (int i = 0; i < 2; i++) {
+      if ((c = debug_getc(dbg)) < 0) {
+        return -1;
+      }
+      check[i] = c;
+    }
+    int intact = strtoul(check, NULL, 16) == (sum & 0xFF);
+    if (!dbg->no_ack) {
+      send(dbg->fd, intact ? "+" : "-", 1, MSG_NOSIGNAL);
+    }
+    if (intact) {
+      return len;
+    }
+  }
+}
+
+void vm_debug_send(struct debugger *dbg, const char *data) {
+  char frame[DEBUG_PACKET_SIZE + 4];
+  unsigned sum = 0;
+  for (const char *c = data; *c; c++) {
+    sum += (unsigned char)*c;
+  }
+  int n = snprintf(frame, sizeof(frame), "$%s#%02x", data, sum & 0xFF);
+  send(dbg->fd, frame, n, MSG_NOSIGNAL);
+}
+
+/* whether the client sent a ^C or went away, waiting up to ms for it */
+static int debug_interrupted(struct debugger *dbg, int ms) {
+  struct pollfd fd = {dbg->fd, POLLIN, 0};
+  while (poll(&fd, 1, ms) > 0) {
+    ms = 0;
+    int c = debug_getc(dbg);
+    if (c < 0 || c == 0x03) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint16_t debug_reg(struct lc3_vm *vm, int n) {
+  return n <= R_PC ? vm->reg[n] : (vm->psr | cond_flags(vm));
+}
+
+static void debug_set_reg(struct lc3_vm *vm, int n, uint16_t val) {
+  if (n <= R_PC) {
+    vm->reg[n] = val;
+  }
+  else {
+    set_psr(vm, val);
+  }
+}
+
+/* put a breakpoint on address or take it away, returns 0 for the I/O page */
+int vm_debug_set_break(struct lc3_vm *vm, uint16_t address, int on) {
+  if (address >= MR_DEVICE_BASE) {
+    return 0;
+  }
+  /* a clean page has no marks, a reset clears it with its breakpoints */
+  if (on) {
+    vm->code_map[address] |= CODE_BREAK;
+    mark_dirty(vm, address);
+  }
+  else {
+    vm->code_map[address] &= ~CODE_BREAK;
+  }
+  /* the next fetch decodes it again, fusing around it or not */
+  invalidate_decode(vm, address);
+  return 1;
+}
+
+/* watch len words from address for writes or stop watching them */
+int vm_debug_set_watch(struct lc3_vm *vm, uint16_t address, unsigned len, int on) {
+  if (len == 0 || address + len > MR_DEVICE_BASE) {
+    return 0;
+  }
+  for (unsigned i = 0; i < len; i++) {
+    if (on) {
+      vm->code_map[address + i] |= CODE_WATCH;
+      mark_dirty(vm, address + i);
+    }
+    else {
+      vm->code_map[address + i] &= ~CODE_WATCH;
+    }
+  }
+  return 1;
+}
+
+/* a store hit a watched word, stops the machine for the debugger */
+static int debug_watch_hit(struct lc3_vm *vm, uint16_t address) {
+  if (!vm->debug) {
+    return 0;
+  }
+  vm->debug->watch_hit = 1;
+  vm->debug->watch_address = address;
+  return 1;
+}
+
+/* run the guest until it stops for the debugger and put the stop reply in
+ * reply, returns 0 once the guest has halted */
+static int debug_resume(struct lc3_vm *vm, int step, char *reply, size_t size) {
+  struct debugger *dbg = vm->debug;
+  dbg->watch_hit = 0;
+  int running = 1;
+  if (step || (vm->code_map[vm->reg[R_PC]] & CODE_BREAK)) {
+    running = vm_read_and_execute_instruction(vm);
+  }
+  /* a KBSR spin comes back early, to wait for a key and the client at once */
+  int spin_yield = vm->spin_yield;
+  vm->spin_yield = 1;
+  while (running && !step && !dbg->watch_hit) {
+    struct run_result result = vm_run(vm, DEBUG_SLICE, vm->display);
+    if (result.exit == RUN_BREAK) {
+      break;
+    }
+    if (result.exit == RUN_TRAP) {
+      running = vm_execute_trap(vm, result.trap, vm->kbd, vm->display);
+    }
+    else if (result.exit == RUN_HALTED) {
+      running = 0;
+    }
+    else if (debug_interrupted(dbg, result.retired < DEBUG_SLICE ? KBD_IDLE_MS : 0)) {
+      vm->spin_yield = spin_yield;
+      snprintf(reply, size, "S02");
+      return 1;
+    }
+  }
+  vm->spin_yield = spin_yield;
+
+  vm_flush_output(vm);
+  if (dbg->watch_hit) {
+    snprintf(reply, size, "T05watch:%04x;", dbg->watch_address);
+    return 1;
+  }
+  snprintf(reply, size, running ? "S05" : "W00");
+  return running;
+}
+
+/* answer the client until it detaches or the guest is done. returns 1 if
+ * the guest should go on running without the debugger */
+int vm_debug_serve(struct lc3_vm *vm) {
+  struct debugger *dbg = vm->debug;
+  char reply[DEBUG_PACKET_SIZE];
+  int len;
+  while ((len = vm_debug_receive(dbg)) >= 0) {
+    const char *p = dbg->packet;
+    unsigned a, b, type;
+    int n;
+    reply[0] = '\0';
+    switch (p[0]) {
+      case '?':
+        strcpy(reply, "S05");
+        break;
+      case 'g':
+        for (int i = 0; i < DEBUG_REGS; i++) {
+          sprintf(reply + 4 * i, "%04x", debug_reg(vm, i));
+        }
+        break;
+      case 'G':
+        strcpy(reply, len == 1 + 4 * DEBUG_REGS ? "OK" : "E01");
+        for (int i = 0; len == 1 + 4 * DEBUG_REGS && i < DEBUG_REGS; i++) {
+          char word[5] = {0};
+          memcpy(word, p + 1 + 4 * i, 4);
+          debug_set_reg(vm, i, strtoul(word, NULL, 16));
+        }
+        break;
+      case 'p':
+        if (sscanf(p + 1, "%x", &a) == 1 && a < DEBUG_REGS) {
+          sprintf(reply, "%04x", debug_reg(vm, a));
+        }
+        else {
+          strcpy(reply, "E01");
+        }
+        break;
+      case 'P':
+        if (sscanf(p + 1, "%x=%x", &a, &b) == 2 && a < DEBUG_REGS) {
+          debug_set_reg(vm, a, b);
+          strcpy(reply, "OK");
+        }
+        else {
+          strcpy(reply, "E01");
+        }
+        break;
+      case 'm':
+        /* memory reads don't trigger devices, like lc3_read() */
+        if (sscanf(p + 1, "%x,%x", &a, &b) == 2 && a <= UINT16_MAX) {
+          b = b < (DEBUG_PACKET_SIZE - 1) / 4 ? b : (DEBUG_PACKET_SIZE - 1) / 4;
+          for (unsigned i = 0; i < b; i++) {
+            sprintf(reply + 4 * i, "%04x", vm->memory[(uint16_t)(a + i)]);
+          }
+        }
+        else {
+          strcpy(reply, "E01");
+        }
+        break;
+      case 'M':
+        /* n stays -1 without the ':' */
+        n = -1;
+        if (sscanf(p + 1, "%x,%x:%n", &a, &b, &n) == 2 && n >= 0 && a <= UINT16_MAX &&
+            b <= UINT16_MAX + 1 - a && (unsigned)(len - 1 - n) == 4 * b) {
+          for (unsigned i = 0; i < b; i++) {
+            char word[5] = {0};
+            memcpy(word, p + 1 + n + 4 * i, 4);
+            mem_write(vm, a + i, strtoul(word, NULL, 16));
+          }
+          dbg->watch_hit = 0;
+          strcpy(reply, "OK");
+        }
+        else {
+          strcpy(reply, "E01");
+        }
+        break;
+      case 'c':
+      case 's':
+        if (sscanf(p + 1, "%x", &a) == 1) {
+          vm->reg[R_PC] = a;
+        }
+        if (!debug_resume(vm, p[0] == 's', reply, sizeof(reply))) {
+          vm_debug_send(dbg, reply);
+          return 0;
+        }
+        break;
+      case 'Z':
+      case 'z':
+        if (sscanf(p + 1, "%u,%x,%x", &type, &a, &b) != 3 || (type != 0 && type != 2)) {
+          break;
+        }
+        if (a <= UINT16_MAX && (type == 0 ? vm_debug_set_break(vm, a, p[0] == 'Z') :
+                                vm_debug_set_watch(vm, a, b, p[0] == 'Z'))) {
+          strcpy(reply, "OK");
+        }
+        else {
+          strcpy(reply, "E01");
+        }
+        break;
+      case 'D':
+        /* the guest goes on without any breakpoints or watchpoints */
+        for (int i = 0; i < MR_DEVICE_BASE; i++) {
+          if (vm->code_map[i] & (CODE_BREAK | CODE_WATCH)) {
+            vm_debug_set_break(vm, i, 0);
+            vm_debug_set_watch(vm, i, 1, 0);
+          }
+        }
+        vm_debug_send(dbg, "OK");
+        return 1;
+      case 'k':
+        return 0;
+      case 'q':
+        if (strncmp(p, "qSupported", 10) == 0) {
+          sprintf(reply, "PacketSize=%x;QStartNoAckMode+", DEBUG_PACKET_SIZE);
+        }
+        else if (strcmp(p, "qAttached") == 0) {
+          strcpy(reply, "1");
+        }
+        break;
+      case 'Q':
+        if (strcmp(p, "QStartNoAckMode") == 0) {
+          vm_debug_send(dbg, "OK");
+          dbg->no_ack = 1;
+          continue;
+        }
+        break;
+    }
+    vm_debug_send(dbg, reply);
+  }
+  /* the client went away */
+  return 0;
+}
+
+/* the library interface, see lc3vm.h */
+struct lc3_vm *lc3_create(void) {
+  struct lc3_vm *vm = vm_create();
+  if (vm) {
+    vm->quiet_halt = 1;
+  }
+  return vm;
+}
+
+void lc3_destroy(struct lc3_vm *vm) {
+  vm_destroy(vm);
+}
+
+void lc3_reset(struct lc3_vm *vm) {
+  vm_reset(vm);
+}
+
+void lc3_set_io(struct lc3_vm *vm, FILE *in, FILE *out) {
+  vm->kbd = in;
+  vm->display = out;
+  /* files, pipes and memory streams never make the guest wait */
+  vm->kbd_blocking = in && (fileno(in) < 0 || !isatty(fileno(in)));
+}
+
+int lc3_load(struct lc3_vm *vm, const void *image, size_t size) {
+  if (size < sizeof(uint16_t)) {
+    return 0;
+  }
+  if ((uintptr_t)image % sizeof(uint16_t) == 0) {
+    load_image(vm, image, size);
+    return 1;
+  }
+  uint16_t *copy = malloc(size);
+  if (!copy) {
+    return 0;
+  }
+  memcpy(copy, image, size);
+  load_image(vm, copy, size);
+  free(copy);
+  return 1;
+}
+
+int lc3_load_file(struct lc3_vm *vm, const char *path) {
+  return vm_read_image(vm, path);
+}
+
+struct lc3_result lc3_run(struct lc3_vm *vm, int engine, uint64_t budget) {
+  struct run_result (*run)(struct lc3_vm *, uint64_t, FILE *) =
+      engine == LC3_ENGINE_JIT ? vm_jit_run : vm_run;
+  struct lc3_result result = {0, LC3_BUDGET, 0};
+  while (result.retired < budget) {
+    struct run_result r = run(vm, budget - result.retired, vm->display);
+    result.retired += r.retired;
+    if (r.exit == RUN_TRAP && vm->kbd) {
+      if (!vm_execute_trap(vm, r.trap, vm->kbd, vm->display)) {
+        result.exit = LC3_HALTED;
+        break;
+      }
+    }
+    else if (r.exit == RUN_BREAK) {
+      /* a breakpoint without a debugger, step over it */
+      result.retired++;
+      if (!vm_read_and_execute_instruction(vm)) {
+        result.exit = LC3_HALTED;
+        break;
+      }
+    }
+    else if (r.exit != RUN_BUDGET) {
+      result.exit = r.exit == RUN_HALTED ? LC3_HALTED : LC3_TRAP;
+      result.trap = r.trap;
+      break;
+    }
+  }
+  if (vm->display) {
+    fflush(vm->display);
+  }
+  return result;
+}
+
+uint16_t lc3_reg(struct lc3_vm *vm, int reg) {
+  if (reg < LC3_R0 || reg > LC3_COND) {
+    return 0;
+  }
+  if (reg == LC3_COND) {
+    vm_sync_flags(vm);
+  }
+  return vm->reg[reg];
+}
+
+void lc3_set_reg(struct lc3_vm *vm, int reg, uint16_t val) {
+  if (reg < LC3_R0 || reg > LC3_COND) {
+    return;
+  }
+  if (reg == LC3_COND) {
+    vm->flag_result = FLAGS_SYNCED;
+  }
+  vm->reg[reg] = val;
+}
+
+uint16_t lc3_read(struct lc3_vm *vm, uint16_t address) {
+  return vm->memory[address];
+}
+
+int lc3_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  return mem_write(vm, address, val);
+}
+
+struct lc3_view lc3_view(struct lc3_vm *vm, uint16_t address, size_t count) {
+  return vm_view(vm, address, count);
+}
+
+int lc3_set_trap(struct lc3_vm *vm, uint8_t vector, lc3_trap_fn fn, void *ctx) {
+  if ((vector >= TRAP_GETC && vector <= TRAP_HALT) || trap_exts[vector].run) {
+    return 0;
+  }
+  vm->trap_hooks[vector] = (struct trap_hook){fn, ctx};
+  return 1;
+}
+
+struct lc3_snapshot *lc3_snapshot(struct lc3_vm *vm) {
+  return vm_snapshot(vm);
+}
+
+int lc3_restore(struct lc3_vm *vm, const struct lc3_snapshot *snap) {
+  return vm_restore(vm, snap);
+}
+
+void lc3_snapshot_destroy(struct lc3_snapshot *snap) {
+  vm_snapshot_destroy(snap);
+}
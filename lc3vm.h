@@ -0,0 +1,120 @@
+/* liblc3vm, the LC-3 virtual machine as a library
+ *
+ * a vm is created powered on, loaded with an assembled image and run for a
+ * budget of instructions at a time, so a host can interleave guests with
+ * its own work. guest console I/O goes through the streams given to
+ * lc3_set_io(), and TRAP vectors without a built-in routine can be handed
+ * to a host function. a vm may be used by one thread at a time, separate
+ * vms are independent. */
+#ifndef LC3VM_H
+#define LC3VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LC3VM_API __attribute__((visibility("default")))
+#else
+#define LC3VM_API
+#endif
+
+enum { LC3VM_API_VERSION = 1 };
+
+struct lc3_vm;
+struct lc3_snapshot;
+
+/* registers for lc3_reg() and lc3_set_reg(), which ignore any other number */
+enum {
+  LC3_R0 = 0, LC3_R1, LC3_R2, LC3_R3, LC3_R4, LC3_R5, LC3_R6, LC3_R7,
+  LC3_PC,
+  LC3_COND
+};
+
+/* code generators lc3_run() can use. the JIT falls back to the threaded
+ * interpreter on hosts it doesn't support */
+enum {
+  LC3_ENGINE_THREADED = 1,
+  LC3_ENGINE_JIT
+};
+
+/* why lc3_run() returned */
+enum {
+  LC3_HALTED = 0, /* the guest ran TRAP HALT or cleared MCR */
+  LC3_TRAP,       /* an input trap with no input stream, see lc3_result.trap */
+  LC3_BUDGET      /* retired the whole budget */
+};
+
+struct lc3_result {
+  uint64_t retired; /* instructions executed */
+  int exit;         /* LC3_* */
+  uint16_t trap;    /* the TRAP instruction word for LC3_TRAP */
+};
+
+/* words of guest memory in host byte order, read and written in place.
+ * data is NULL and len 0 for a range that wraps past the top of memory or
+ * reaches the I/O page. a view stays valid until the guest runs again, and
+ * code stored through it runs as written. stores through the view of a trap
+ * hook are also checked when it returns, elsewhere lc3_write() is the way
+ * to have a store seen like one of the guest's */
+struct lc3_view {
+  uint16_t *data;
+  size_t len;
+};
+
+/* a host routine for a TRAP vector. view covers the R1 words at R0, the
+ * rest of the guest is reached through the functions below. returns 0 to
+ * halt the guest */
+typedef int (*lc3_trap_fn)(struct lc3_vm *vm, uint8_t vector, struct lc3_view view, void *ctx);
+
+/* a powered on vm with no program, NULL when out of memory */
+LC3VM_API struct lc3_vm *lc3_create(void);
+LC3VM_API void lc3_destroy(struct lc3_vm *vm);
+LC3VM_API void lc3_reset(struct lc3_vm *vm);
+
+/* keyboard input and display output of the guest, stdin and stdout to start
+ * with. input is read as it is needed, a NULL in makes GETC, IN and the
+ * other input traps return LC3_TRAP from lc3_run() instead */
+LC3VM_API void lc3_set_io(struct lc3_vm *vm, FILE *in, FILE *out);
+
+/* load an assembled image: a big endian origin followed by its words.
+ * returns 0 if there isn't even an origin */
+LC3VM_API int lc3_load(struct lc3_vm *vm, const void *image, size_t size);
+LC3VM_API int lc3_load_file(struct lc3_vm *vm, const char *path);
+
+/* run at most budget instructions on engine. after LC3_TRAP the host sets
+ * R0 as the trap would have and calls lc3_run() again */
+LC3VM_API struct lc3_result lc3_run(struct lc3_vm *vm, int engine, uint64_t budget);
+
+LC3VM_API uint16_t lc3_reg(struct lc3_vm *vm, int reg);
+LC3VM_API void lc3_set_reg(struct lc3_vm *vm, int reg, uint16_t val);
+
+/* guest memory as the host sees it: reads don't trigger devices, writes do
+ * and keep cached code in step. lc3_write() returns nonzero if a device
+ * stopped the machine */
+LC3VM_API uint16_t lc3_read(struct lc3_vm *vm, uint16_t address);
+LC3VM_API int lc3_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+
+/* count words from address without copying them, see struct lc3_view */
+LC3VM_API struct lc3_view lc3_view(struct lc3_vm *vm, uint16_t address, size_t count);
+
+/* route vector to fn, or back to the default with a NULL fn. the console
+ * traps and the block traps up to 0x2A can't be taken over, returns 0 for
+ * those */
+LC3VM_API int lc3_set_trap(struct lc3_vm *vm, uint8_t vector, lc3_trap_fn fn, void *ctx);
+
+/* the registers and memory of vm, NULL on failure. any number of vms can be
+ * restored from one snapshot */
+LC3VM_API struct lc3_snapshot *lc3_snapshot(struct lc3_vm *vm);
+LC3VM_API int lc3_restore(struct lc3_vm *vm, const struct lc3_snapshot *snap);
+LC3VM_API void lc3_snapshot_destroy(struct lc3_snapshot *snap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,675 @@
+/* internals of liblc3vm shared by lc3vm.c and the CLI and tests in main.c.
+ * programs embedding the vm use lc3vm.h instead */
+#ifndef LC3VM_INTERNAL_H
+#define LC3VM_INTERNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "lc3vm.h"
+
+enum {
+  R_R0 = 0,
+  R_R1,
+  R_R2,
+  R_R3,
+  R_R4,
+  R_R5,
+  R_R6,
+  R_R7,
+  R_PC, /* program counter */
+  R_COND,
+  R_COUNT
+};
+
+/* op codes */
+enum {
+  OP_BR = 0, /* branch */
+  OP_ADD,    /* add  */
+  OP_LD,     /* load */
+  OP_ST,     /* store */
+  OP_JSR,    /* jump register */
+  OP_AND,    /* bitwise and */
+  OP_LDR,    /* load register */
+  OP_STR,    /* store register */
+  OP_RTI,    /* unused */
+  OP_NOT,    /* bitwise not */
+  OP_LDI,    /* load indirect */
+  OP_STI,    /* store indirect */
+  OP_JMP,    /* jump */
+  OP_RES,    /* reserved (unused) */
+  OP_LEA,    /* load effective address */
+  OP_TRAP    /* execute trap */
+};
+
+/* condition flags */
+enum {
+  FL_POS = 1 << 0, /* P */
+  FL_ZRO = 1 << 1, /* Z */
+  FL_NEG = 1 << 2, /* N */
+};
+
+/* trap codes */
+enum
+{
+  TRAP_GETC = 0x20,  /* get character from keyboard */
+  TRAP_OUT = 0x21,   /* output a character */
+  TRAP_PUTS = 0x22,  /* output a word string */
+  TRAP_IN = 0x23,    /* input a string */
+  TRAP_PUTSP = 0x24, /* output a byte string */
+  TRAP_HALT = 0x25,  /* halt the program */
+
+  /* extensions, see trap_exts[] */
+  TRAP_READLINE = 0x26, /* read a line into a buffer */
+  TRAP_READ = 0x27,     /* read a block of characters */
+  TRAP_WRITE = 0x28,    /* write a block of characters */
+  TRAP_MEMCPY = 0x29,   /* copy a block of memory */
+  TRAP_MEMSET = 0x2A    /* fill a block of memory */
+};
+
+/* memory mapped registers */
+enum {
+  MR_KBSR = 0xFE00, /* keyboard status */
+  MR_KBDR = 0xFE02, /* keyboard data */
+  MR_DSR = 0xFE04,  /* display status */
+  MR_DDR = 0xFE06,  /* display data */
+  MR_TMR = 0xFE08,  /* timer status, bit 15 reads set once per interval */
+  MR_TMI = 0xFE0A,  /* timer interval in milliseconds, 0 stops the timer */
+  MR_PSR = 0xFFFC,  /* processor status, writable in supervisor mode */
+  MR_MCR = 0xFFFE   /* machine control, clearing bit 15 stops the clock */
+};
+
+/* keyboard status bits */
+enum {
+  KBSR_READY = 1 << 15, /* KBDR holds a key, cleared by reading it */
+  KBSR_IE = 1 << 14     /* interrupt when a key is ready */
+};
+
+/* processor status register. the condition codes in its low bits are kept
+ * in reg[R_COND] */
+enum {
+  PSR_USER = 1 << 15,   /* user mode, clear in supervisor mode */
+  PSR_PRIORITY_SHIFT = 8,
+  PSR_PRIORITY = 7 << PSR_PRIORITY_SHIFT
+};
+
+/* interrupts and exceptions. the handler for vector n is at IVT_BASE + n */
+enum {
+  IVT_BASE = 0x0100,
+  VEC_PRIVILEGE = 0x00, /* RTI in user mode */
+  VEC_ILLEGAL = 0x01,   /* reserved opcode */
+  VEC_KEYBOARD = 0x80,
+  KBD_PRIORITY = 4,
+  SSP_START = 0x3000    /* supervisor stack, grows down from here */
+};
+
+/* devices live in the I/O page at the top of memory, everything below it is
+ * plain memory */
+enum {
+  MR_DEVICE_BASE = 0xFE00,
+  DEVICE_PAGE_SIZE = 0x200
+};
+
+/* 0x3000 is the default starting position of the PC */
+enum { PC_START = 0x3000 };
+
+/* decoded instruction cache
+ *
+ * every word is decoded the first time it is executed and the fields are kept
+ * in a side table indexed by address, so tight loops skip re-extracting the
+ * registers and sign extending the immediates. mem_write() drops the entry for
+ * the address it touches, which keeps self-modifying code correct. */
+struct decoded_instr {
+  uint16_t instr;   /* raw instruction word */
+  uint16_t imm;     /* sign extended imm5, offset6, PCoffset9 or PCoffset11 */
+  uint8_t op;       /* opcode */
+  uint8_t dr;       /* DR, SR for stores or the nzp mask for BR */
+  uint8_t sr1;      /* SR1 or BaseR */
+  uint8_t sr2;      /* SR2 */
+  uint8_t imm_flag; /* immediate mode for ADD/AND, PCoffset11 mode for JSR */
+  uint8_t valid;
+  uint8_t exec;     /* handler vm_run() dispatches to, op or an EXEC_* */
+};
+
+/* words that have a cached decode, are covered by a compiled JIT block or
+ * are a device register that reacts to writes. mem_write() only has to look
+ * further when the entry is nonzero */
+enum {
+  CODE_DECODED = 1 << 0,
+  CODE_COMPILED = 1 << 1,
+  CODE_DEVICE = 1 << 2,
+  CODE_BREAK = 1 << 3, /* debugger breakpoint, see vm_debug_set_break() */
+  CODE_WATCH = 1 << 4  /* debugger watchpoint, see vm_debug_set_watch() */
+};
+
+/* condition flags are evaluated lazily: flag-setting instructions only
+ * record their result and the N/Z/P bits are worked out when a BR tests them.
+ * anything that looks at reg[R_COND] directly has to call vm_sync_flags() first */
+enum { FLAGS_SYNCED = 0x10000 }; /* reg[R_COND] is up to date */
+
+struct cfg;
+struct debugger;
+struct input_log;
+struct jit_state;
+struct keyboard;
+struct lc3_vm;
+struct profile;
+struct trace;
+
+/* handlers for one word of the I/O page. a write handler returns nonzero to
+ * stop the machine after the store */
+struct device {
+  uint16_t (*read)(struct lc3_vm *vm, uint16_t address);
+  int (*write)(struct lc3_vm *vm, uint16_t address, uint16_t val);
+};
+
+/* memory[] through decode_cache[] start and end on a page boundary of this
+ * size so a snapshot can be mapped straight over them */
+enum { VM_PAGE_ALIGN = 4096 };
+
+/* memory[] is tracked in pages of this many words. a page that hasn't been
+ * written to, decoded or compiled since the last reset still has all its
+ * memory[], code_map[] and decode_cache[] entries zero, so reset, snapshots
+ * and state hashes only have to look at the dirty ones. a byte per page
+ * rather than a bit keeps the mark a single store on the mem_write() path */
+enum {
+  DIRTY_PAGE_SHIFT = 8,
+  DIRTY_PAGE_WORDS = 1 << DIRTY_PAGE_SHIFT,
+  DIRTY_PAGES = (UINT16_MAX + 1) >> DIRTY_PAGE_SHIFT
+};
+
+/* a host routine for a TRAP vector, see lc3_set_trap() */
+struct trap_hook {
+  lc3_trap_fn fn;
+  void *ctx;
+};
+
+/* one LC-3 machine. every function that touches guest state takes a pointer
+ * to one, so any number of them can live in a process */
+struct lc3_vm {
+  uint16_t reg[R_COUNT];         /* first, compiled code addresses it off the vm */
+  uint32_t flag_result;          /* last flag-setting result or FLAGS_SYNCED */
+  uint16_t psr;                  /* privilege and priority bits of the PSR */
+  uint16_t saved_ssp;            /* R6 of the mode that isn't running */
+  uint16_t saved_usp;
+  atomic_int irq_check;          /* an interrupt may be due, see vm_check_interrupts() */
+  uint8_t dirty[DIRTY_PAGES];    /* pages touched since the last reset */
+  _Alignas(VM_PAGE_ALIGN) uint16_t memory[UINT16_MAX + 1]; /* 65536 locations */
+  uint8_t code_map[UINT16_MAX + 1];
+  struct decoded_instr decode_cache[UINT16_MAX + 1];
+  _Alignas(VM_PAGE_ALIGN) struct jit_state *jit; /* compiled code, set up by the first vm_jit_run() */
+  FILE *kbd;                     /* keyboard behind KBSR/KBDR */
+  int kbd_blocking;              /* kbd is a file or pipe: KBSR always has a key */
+  struct keyboard *keyboard;     /* buffers kbd when set, see vm_attach_keyboard() */
+  uint32_t kbd_empty_polls;      /* KBSR reads that found no key */
+  int spin_yield;                /* vm_run() returns at a KBSR spin loop instead of waiting */
+  int spun;                      /* vm_run() last returned at a KBSR spin, see spin_yield */
+  FILE *unflushed;               /* written to by a trap since the last flush */
+  FILE *display;                 /* output behind DSR/DDR */
+  int quiet_halt;                /* HALT stops without printing HALT */
+  int eof_stops;                 /* GETC and IN stop the guest at end of input, see --batch */
+  int stop;                      /* STOP_* once the guest has stopped */
+  int plain_memory;              /* the reference core reads the I/O page as memory, see --no-mmio */
+  int check_overflow;            /* the reference core stops at a PC that wraps, see --check-overflow */
+  uint64_t timer_deadline;       /* CLOCK_MONOTONIC ns of the next tick, 0 when off */
+  /* registers in the I/O page, indexed by the offset into it. words without
+   * a handler behave like memory */
+  struct device devices[DEVICE_PAGE_SIZE];
+  struct trap_hook trap_hooks[0x100];
+  struct profile *profile;       /* counters for the reference core, see --profile */
+  struct input_log *input_log;   /* records or replays keyboard input, see --record */
+  struct trace *trace;           /* execution trace of the reference core, see --trace */
+  struct cfg *cfg;               /* control flow of the loaded image, see vm_analyze() */
+  struct debugger *debug;        /* remote debugger client, see vm_attach_debugger() */
+};
+
+struct lc3_snapshot {
+  uint16_t reg[R_COUNT];
+  uint32_t flag_result;
+  uint16_t psr, saved_ssp, saved_usp;
+  uint8_t dirty[DIRTY_PAGES];
+  FILE *file;
+};
+
+/* the part of the vm a snapshot maps */
+#define VM_SNAPSHOT_START(vm) ((char *)(vm) + offsetof(struct lc3_vm, memory))
+
+#define VM_SNAPSHOT_SIZE(vm) (offsetof(struct lc3_vm, jit) - offsetof(struct lc3_vm, memory))
+
+#define VM_SNAPSHOT_OFFSET(vm, p) ((char *)(p) - VM_SNAPSHOT_START(vm))
+
+enum {
+  KBD_RING_SIZE = 256,  /* power of two */
+  KBD_SPIN_POLLS = 1024, /* empty KBSR reads in a row before idle sleep */
+  KBD_IDLE_MS = 10       /* longest idle sleep, the guest may be counting */
+};
+
+struct keyboard {
+  int fd;
+  atomic_int *notify;     /* set when a key comes in, under lock */
+  int idle_sleep;         /* sleep on KBSR spins */
+  uint32_t spins;         /* empty KBSR reads in a row */
+  atomic_uint head;       /* advanced by the reader thread */
+  atomic_uint tail;       /* advanced by the guest */
+  atomic_int eof;
+  int closing;            /* the reader should stop, under lock */
+  int wake[2];            /* self-pipe that interrupts the reader's poll() */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed; /* head, tail or eof moved */
+  uint8_t ring[KBD_RING_SIZE];
+};
+
+enum {
+  INPUT_RECORD = 0,
+  INPUT_REPLAY,
+  INPUT_REPLAY_SKIP  /* replay without the recorded KBSR spins */
+};
+
+enum {
+  INPUT_LOG_VERSION = 1,
+  EVENT_NONE = 0,    /* the log ran out */
+  EVENT_TRAP,        /* character read by an input trap, 0xFFFF for EOF */
+  EVENT_KBSR         /* key found by a KBSR read */
+};
+
+struct input_event {
+  int kind;
+  uint64_t retired;  /* instructions retired when it happened */
+  uint64_t polls;    /* empty KBSR reads since the previous event */
+  uint16_t value;
+};
+
+struct input_log {
+  FILE *file;
+  int mode;              /* INPUT_* */
+  int counted;           /* retired is being kept up */
+  uint64_t retired;
+  uint64_t last;         /* retired at the previous event */
+  uint64_t polls;        /* record: empty KBSR reads since the previous event */
+  uint64_t events;
+  uint64_t diverged;     /* replay: 1 + the first event that came out differently */
+  struct input_event next; /* replay: the event the guest is waiting for */
+};
+
+enum {
+  OUTPUT_INTERACTIVE = 0,
+  OUTPUT_BATCH,
+  OUTPUT_BUFFER_SIZE = 1 << 16,
+  INPUT_BUFFER_SIZE = 1 << 16  /* stdin buffer for --batch */
+};
+
+/* opcodes that end a basic block */
+enum {
+  BLOCK_END_OPS = 1 << OP_BR | 1 << OP_JMP | 1 << OP_JSR | 1 << OP_TRAP | 1 << OP_RTI
+};
+
+enum {
+  EXEC_CONST = 16,  /* AND Rx, Ry, #0; ADD Rx, Rx, #imm */
+  EXEC_ADD_BR,      /* ADD; BR */
+  EXEC_AND_BR,      /* AND; BR */
+  EXEC_LDR_ADD_STR, /* LDR; ADD; STR */
+  EXEC_KBSR_SPIN,   /* LDI Rx, KBSR; BRzp back to the LDI */
+  EXEC_COUNTDOWN,   /* ADD Rx, Rx, #-k; BRp back to the ADD */
+  EXEC_BREAK,       /* a debugger breakpoint */
+  EXEC_COUNT
+};
+
+enum { STRING_CHUNK = 4096 }; /* words gathered per fwrite() */
+
+struct trap_ext {
+  int (*run)(struct lc3_vm *vm, FILE *in, FILE *out); /* 0 stops the machine */
+  int needs_input;
+};
+
+#ifndef PROFILING
+#define PROFILING 1
+#endif
+
+struct profile {
+  uint64_t retired;
+  uint64_t ops[16];
+  uint64_t traps[256];
+  uint64_t pcs[UINT16_MAX + 1];
+  uint64_t taken[UINT16_MAX + 1];       /* BR at this PC branched */
+  uint64_t not_taken[UINT16_MAX + 1];
+  uint64_t block_entries[UINT16_MAX + 1];
+  uint64_t block_retired[UINT16_MAX + 1];
+  uint16_t block;                       /* start of the current block */
+  uint16_t block_len;
+  int in_block;
+  /* scratch for vm_write_profile(), so vms can report at the same time */
+  uint64_t branches[UINT16_MAX + 1];
+  int picks[UINT16_MAX + 1];
+};
+
+enum { PROFILE_TOP = 20 };
+
+#ifndef TRACING
+#define TRACING 1
+#endif
+
+enum {
+  TRACE_CHUNK_SIZE = 1 << 16, /* bytes of records compressed at a time */
+  TRACE_CHUNKS = 64,          /* chunks in the ring before the guest waits */
+  TRACE_RECORD_MAX = 40,      /* longest encoded record */
+  LZ4_HASH_BITS = 12
+};
+
+/* worst case size of n bytes after lz4_compress() */
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* the flags byte that starts a record */
+enum {
+  TRACE_JUMP = 1 << 0,  /* the PC isn't the one after the last record's */
+  TRACE_COND = 1 << 1,  /* the condition codes changed */
+  TRACE_PSR = 1 << 2,   /* the PSR changed */
+  TRACE_WRITE = 1 << 3  /* a memory write of the next instruction record */
+};
+
+struct trace {
+  FILE *file;
+  /* state the next record is encoded against */
+  uint16_t reg[8];
+  uint16_t cond, psr;
+  uint16_t next_pc;
+  uint16_t last_write;
+  size_t fill;               /* bytes in the chunk being filled */
+  /* handed over to the writer thread under lock */
+  unsigned head;             /* chunks filled */
+  unsigned tail;             /* chunks written out */
+  int closing;
+  size_t chunk_len[TRACE_CHUNKS];
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;    /* head, tail or closing moved */
+  uint8_t ring[TRACE_CHUNKS][TRACE_CHUNK_SIZE];
+};
+
+struct trace_reader {
+  FILE *file;
+  size_t len, pos;           /* of the current chunk */
+  uint16_t reg[8];
+  uint16_t cond, psr;
+  uint16_t next_pc;
+  uint16_t last_write;
+  uint64_t index;
+  uint32_t write_cap;
+  uint16_t (*writes)[2];
+  uint8_t chunk[TRACE_CHUNK_SIZE];
+  uint8_t stored[LZ4_BOUND(TRACE_CHUNK_SIZE)];
+};
+
+/* one retired instruction read back from a trace */
+struct trace_record {
+  uint64_t index;            /* instructions retired before it */
+  uint16_t pc;
+  uint16_t instr;
+  uint8_t flags;             /* TRACE_COND and TRACE_PSR */
+  uint8_t changed;           /* R0-R7 it wrote, bit n for Rn */
+  uint16_t reg[8];           /* the registers after it */
+  uint16_t cond, psr;
+  uint32_t write_count;
+  uint16_t (*writes)[2];     /* address and value, in order */
+};
+
+enum {
+  RUN_HALTED = 0, /* TRAP_HALT */
+  RUN_TRAP,       /* TRAP_GETC or TRAP_IN, see run_result.trap */
+  RUN_BUDGET,     /* retired the whole budget */
+  RUN_BREAK       /* in front of a debugger breakpoint */
+};
+
+/* why a guest stopped for good, see lc3_vm.stop */
+enum {
+  STOP_NONE = 0,
+  STOP_HALT,     /* TRAP_HALT */
+  STOP_MCR,      /* the MCR clock was switched off */
+  STOP_OVERFLOW, /* the PC ran off the top of memory, see --check-overflow */
+  STOP_EOF       /* an input trap found the input exhausted, see eof_stops */
+};
+
+struct run_result {
+  uint64_t retired; /* instructions executed */
+  int exit;         /* RUN_* */
+  uint16_t trap;    /* TRAP instruction to service for RUN_TRAP */
+};
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define JIT_AVAILABLE 1
+#else
+#define JIT_AVAILABLE 0
+#endif
+
+enum {
+  JIT_CODE_SIZE = 8 << 20,   /* bytes of executable memory */
+  JIT_MAX_BLOCK = 64,        /* instructions per block */
+  JIT_MAX_BLOCK_BYTES = JIT_MAX_BLOCK * 160 + 512,
+  JIT_MAX_PATCHES = 16384,   /* pending exits waiting for their target */
+  JIT_SLICE = 1 << 30,       /* instructions per jit->enter call */
+  JIT_EXIT_BOUNDARY = 1,     /* jit->enter left at a basic block boundary */
+  JIT_IRQ_CHECK_SIZE = 13    /* bytes of interrupt check in front of a block */
+};
+
+/* interpreter cores */
+enum {
+  ENGINE_SWITCH = 0, /* the vm_core_loops[] of vm_read_and_execute_instruction() */
+  ENGINE_THREADED,   /* vm_run_threaded() */
+  ENGINE_JIT         /* vm_run_jit() */
+};
+
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE ENGINE_SWITCH
+#endif
+
+/* what the reference core has to handle, see execute_instruction() */
+enum {
+  CORE_MMIO = 1,     /* loads from the I/O page reach the devices */
+  CORE_OVERFLOW = 2, /* stop when the PC wraps past 0xFFFF */
+  CORE_PROFILE = 4,  /* count into vm->profile */
+  CORE_TRACE = 8,    /* record into vm->trace */
+  CORE_COUNT = 16,   /* count instructions for vm->input_log */
+  CORE_MASK = 31
+};
+
+/* X(features) for every mask, the loops are named after theirs */
+#define CORE_VARIANTS(X) \
+  X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+  X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+  X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) \
+  X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+
+enum {
+  SCHED_MAX_WORKERS = 64,
+  SCHED_SLICE = 100000,           /* instructions per turn */
+  SCHED_SPIN_POLLS = SCHED_SLICE / 8, /* empty KBSR reads that count as spinning */
+  SCHED_POLL_MS = 10              /* also how long a KBSR spinner stays parked */
+};
+
+struct guest {
+  struct lc3_vm *vm;
+  FILE *in;
+  FILE *out;
+  uint64_t retired;
+  int exit;              /* RUN_HALTED once done */
+  uint16_t pending_trap; /* input trap to service once unparked */
+  struct guest *next;    /* all guests / parked guests */
+  struct guest *next_parked;
+};
+
+struct run_queue {
+  pthread_mutex_t lock;
+  struct guest **items; /* ring buffer of cap entries */
+  int head;
+  int count;
+  int cap;
+};
+
+struct scheduler {
+  int workers;
+  struct run_result (*run)(struct lc3_vm *, uint64_t, FILE *);
+  struct run_queue queues[SCHED_MAX_WORKERS];
+  struct guest *guests;
+  int guest_count;
+  atomic_int active;    /* guests that haven't finished */
+  pthread_mutex_t park_lock;
+  struct guest *parked;
+  int polling;           /* a worker is polling the parked guests */
+};
+
+struct sched_worker {
+  struct scheduler *s;
+  int id;
+};
+
+/* a basic block of the control flow index, [start, end) */
+struct cfg_block {
+  uint16_t start;
+  uint16_t end;
+  uint16_t succ[2]; /* blocks control can go to next */
+  uint8_t succ_count;
+  uint8_t kind;     /* CFG_* of the last instruction */
+};
+
+enum {
+  CFG_FALLTHROUGH = 0, /* runs into the next leader */
+  CFG_BRANCH,          /* BR */
+  CFG_CALL,            /* JSR or JSRR, returns to end */
+  CFG_INDIRECT,        /* JMP, RET or RTI */
+  CFG_TRAP,            /* anything but HALT, returns to end */
+  CFG_STOP             /* HALT or an illegal opcode */
+};
+
+/* from -> to pairs, a call site and its target or the last block of a loop
+ * and its head */
+struct cfg_edge {
+  uint16_t from;
+  uint16_t to;
+};
+
+struct cfg {
+  uint16_t entry;
+  int block_count;
+  int call_count;
+  int loop_count;
+  struct cfg_block *blocks; /* by start address */
+  struct cfg_edge *calls;
+  struct cfg_edge *loops;
+};
+
+enum {
+  DEBUG_PACKET_SIZE = 4096,
+  DEBUG_REGS = R_PC + 2,  /* R0-R7, PC and the PSR */
+  DEBUG_SLICE = 1 << 20   /* instructions between looks for a ^C */
+};
+
+struct debugger {
+  int fd;                 /* connection to the client */
+  int no_ack;             /* the client turned off acknowledgements */
+  int watch_hit;          /* a watched word was just written */
+  uint16_t watch_address;
+  char packet[DEBUG_PACKET_SIZE];
+};
+
+/* lc3vm.c, as far as the CLI, the tests and lc3-trace use it. everything
+ * else in there is static, and all of this carries the vm_ prefix so the
+ * library only adds vm_* next to the lc3_* API of lc3vm.h */
+extern const char *vm_op_names[16];
+void vm_mark_dirty(struct lc3_vm *vm, uint16_t address, size_t n);
+void vm_sync_flags(struct lc3_vm *vm);
+void vm_reset(struct lc3_vm *vm);
+struct lc3_vm *vm_create();
+void vm_destroy(struct lc3_vm *vm);
+struct lc3_snapshot *vm_snapshot(struct lc3_vm *vm);
+int vm_restore(struct lc3_vm *vm, const struct lc3_snapshot *snap);
+void vm_snapshot_destroy(struct lc3_snapshot *snap);
+uint16_t vm_swap16(uint16_t x);
+void vm_read_image_file(struct lc3_vm *vm, FILE *file);
+int vm_read_image(struct lc3_vm *vm, const char* image_path);
+struct keyboard *vm_keyboard_create(int fd, int idle_sleep);
+void vm_keyboard_destroy(struct keyboard *kb);
+int vm_attach_keyboard(struct lc3_vm *vm, int idle_sleep);
+void vm_input_log_destroy(struct input_log *log);
+int vm_attach_input_log(struct lc3_vm *vm, FILE *file, int mode);
+void vm_set_output_mode(FILE *out, char *buffer, size_t size, int mode);
+void vm_flush_output(struct lc3_vm *vm);
+int vm_mem_write_slow(struct lc3_vm *vm, uint16_t address, uint16_t val);
+uint64_t vm_monotonic_ns();
+void vm_map_device(struct lc3_vm *vm, uint16_t address, uint16_t (*read)(struct lc3_vm *, uint16_t), int (*write)(struct lc3_vm *, uint16_t, uint16_t));
+uint16_t vm_device_page_read(struct lc3_vm *vm, uint16_t address);
+void vm_check_interrupts(struct lc3_vm *vm);
+int vm_execute_trap(struct lc3_vm *vm, uint16_t instr, FILE *in, FILE *out);
+int vm_attach_profile(struct lc3_vm *vm);
+void vm_write_profile(struct lc3_vm *vm, FILE *f, int csv);
+int vm_attach_trace(struct lc3_vm *vm, FILE *file);
+void vm_detach_trace(struct lc3_vm *vm);
+struct trace_reader *vm_trace_open(FILE *file);
+int vm_trace_next(struct trace_reader *r, struct trace_record *rec);
+void vm_trace_reader_destroy(struct trace_reader *r);
+int vm_read_and_execute_instruction(struct lc3_vm *vm);
+unsigned vm_core_features(struct lc3_vm *vm);
+extern struct run_result (*const vm_core_loops[CORE_MASK + 1])(struct lc3_vm *vm, uint64_t budget);
+int vm_trap_needs_input(uint16_t instr);
+struct run_result vm_run(struct lc3_vm *vm, uint64_t budget, FILE *out);
+int vm_run_threaded(struct lc3_vm *vm, FILE *in, FILE *out);
+void vm_run_engine(struct lc3_vm *vm, int engine);
+struct scheduler *vm_sched_create(int workers, int engine);
+struct guest *vm_sched_add(struct scheduler *s, struct lc3_vm *vm, FILE *in, FILE *out);
+void vm_sched_run(struct scheduler *s);
+void vm_sched_destroy(struct scheduler *s);
+int vm_analyze(struct lc3_vm *vm);
+void vm_write_cfg(const struct cfg *cfg, FILE *f);
+int vm_debug_accept(int port);
+int vm_attach_debugger(struct lc3_vm *vm, int fd);
+void vm_debug_destroy(struct debugger *dbg);
+int vm_debug_receive(struct debugger *dbg);
+void vm_debug_send(struct debugger *dbg, const char *data);
+int vm_debug_set_break(struct lc3_vm *vm, uint16_t address, int on);
+int vm_debug_set_watch(struct lc3_vm *vm, uint16_t address, unsigned len, int on);
+int vm_debug_serve(struct lc3_vm *vm);
+struct run_result vm_jit_run(struct lc3_vm *vm, uint64_t budget, FILE *out);
+int vm_run_jit(struct lc3_vm *vm, FILE *in, FILE *out);
+
+static inline void mark_dirty(struct lc3_vm *vm, uint16_t address) {
+  vm->dirty[address >> DIRTY_PAGE_SHIFT] = 1;
+}
+
+/* memory access. a nonzero return means a device asked for the machine to
+ * stop, the store itself has still happened */
+static inline int mem_write(struct lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[address] = val;
+  mark_dirty(vm, address);
+  if (vm->code_map[address] || (TRACING && vm->trace)) {
+    return vm_mem_write_slow(vm, address, val);
+  }
+  return 0;
+}
+
+static inline uint16_t mem_read(struct lc3_vm *vm, uint16_t address) {
+  if (address >= MR_DEVICE_BASE) {
+    return vm_device_page_read(vm, address);
+  }
+  return vm->memory[address];
+}
+
+#endif
\ No newline at end of file
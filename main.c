@@ -1,471 +1,409 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <signal.h>
-#include <unistd.h>
-#include <fcntl.h>
-
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/termios.h>
-#include <sys/mman.h>
-
-/* 65536 locations */
-uint16_t memory[UINT16_MAX];
+#include "lc3vm_internal.h"
 
+/* benchmarks
+ *
+ * synthetic kernels that loop forever, each run for a fixed number of
+ * instructions on every engine with guest output going to /dev/null */
 enum {
-  R_R0 = 0,
-  R_R1,
-  R_R2,
-  R_R3,
-  R_R4,
-  R_R5,
-  R_R6,
-  R_R7,
-  R_PC, /* program counter */
-  R_COND,
-  R_COUNT
+  BENCH_INSTRUCTIONS = 20000000,
+  BENCH_REPEAT = 5 /* measured runs, after one warm-up run */
 };
 
-uint16_t reg[R_COUNT];
-
-/* op codes */
-enum {
-  OP_BR = 0, /* branch */
-  OP_ADD,    /* add  */
-  OP_LD,     /* load */
-  OP_ST,     /* store */
-  OP_JSR,    /* jump register */
-  OP_AND,    /* bitwise and */
-  OP_LDR,    /* load register */
-  OP_STR,    /* store register */
-  OP_RTI,    /* unused */
-  OP_NOT,    /* bitwise not */
-  OP_LDI,    /* load indirect */
-  OP_STI,    /* store indirect */
-  OP_JMP,    /* jump */
-  OP_RES,    /* reserved (unused) */
-  OP_LEA,    /* load effective address */
-  OP_TRAP    /* execute trap */
+uint16_t bench_add_kernel[] = {
+  0x1261, /* 3000 ADD R1, R1, #1 */
+  0x1482, /* 3001 ADD R2, R2, R2 */
+  0x16FF, /* 3002 ADD R3, R3, #-1 */
+  0x0FFC  /* 3003 BRnzp #-4 (0x3000) */
 };
 
-/* condition flags */
-enum {
-  FL_POS = 1 << 0, /* P */
-  FL_ZRO = 1 << 1, /* Z */
-  FL_NEG = 1 << 2, /* N */
+/* a taken and a not taken branch every other pass */
+uint16_t bench_branch_kernel[] = {
+  0x1021, /* 3000 ADD R0, R0, #1 */
+  0x5221, /* 3001 AND R1, R0, #1 */
+  0x0401, /* 3002 BRz #1 (0x3004) */
+  0x14A1, /* 3003 ADD R2, R2, #1 */
+  0x5222, /* 3004 AND R1, R0, #2 */
+  0x0201, /* 3005 BRp #1 (0x3007) */
+  0x16E1, /* 3006 ADD R3, R3, #1 */
+  0x0FF8  /* 3007 BRnzp #-8 (0x3000) */
 };
 
-/* trap codes */
-enum
-{
-  TRAP_GETC = 0x20,  /* get character from keyboard */
-  TRAP_OUT = 0x21,   /* output a character */
-  TRAP_PUTS = 0x22,  /* output a word string */
-  TRAP_IN = 0x23,    /* input a string */
-  TRAP_PUTSP = 0x24, /* output a byte string */
-  TRAP_HALT = 0x25   /* halt the program */
+/* increments every word of a 256 word buffer */
+uint16_t bench_memory_kernel[] = {
+  0x2208, /* 3000 LD R1, #8 (0x3009) */
+  0x2608, /* 3001 LD R3, #8 (0x300A) */
+  0x6440, /* 3002 LDR R2, R1, #0 */
+  0x14A1, /* 3003 ADD R2, R2, #1 */
+  0x7440, /* 3004 STR R2, R1, #0 */
+  0x1261, /* 3005 ADD R1, R1, #1 */
+  0x16E1, /* 3006 ADD R3, R3, #1 */
+  0x09FA, /* 3007 BRn #-6 (0x3002) */
+  0x0FF7, /* 3008 BRnzp #-9 (0x3000) */
+  0x4000, /* 3009 buffer */
+  0xFF00  /* 300A -256 */
 };
 
-/* memory mapped registers */
-enum {
-  MR_KBSR = 0xFE00, /* keyboard status */
-  MR_KBDR = 0xFE02  /* keyboard data */
+/* f calls g, both return */
+uint16_t bench_call_kernel[] = {
+  0x4803, /* 3000 JSR #3 (0x3004) */
+  0x4806, /* 3001 JSR #6 (0x3008) */
+  0x0FFD, /* 3002 BRnzp #-3 (0x3000) */
+  0x0000, /* 3003 */
+  0x1021, /* 3004 ADD R0, R0, #1 */
+  0x1DE0, /* 3005 ADD R6, R7, #0 */
+  0x4801, /* 3006 JSR #1 (0x3008) */
+  0xC180, /* 3007 JMP R6 */
+  0x1261, /* 3008 ADD R1, R1, #1 */
+  0xC1C0  /* 3009 RET */
 };
 
-/* convert small bit number to 16-bit, keeping sign bit intact */
-uint16_t sign_extend(uint16_t x, int bit_count) {
-  if ((x >> (bit_count - 1)) & 1) {
-    x |= (0xFFFF << bit_count);
-  }
-  return x;
-}
+uint16_t bench_trap_kernel[] = {
+  0xE003, /* 3000 LEA R0, #3 (0x3004) */
+  0xF022, /* 3001 PUTS */
+  0xF021, /* 3002 OUT */
+  0x0FFC, /* 3003 BRnzp #-4 (0x3000) */
+  'h', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l', 'd', '\n', 0
+};
 
-/* update condition flags based on outcome of result (negative, zero, or
- * positive */
-void update_flags(uint16_t r) {
-  if (reg[r] == 0) {
-    reg[R_COND] = FL_ZRO;
-  }
-  else if (reg[r] >> 15) { /* a 1 in the left-most bit indicates negative */
-    reg[R_COND] = FL_NEG;
-  }
-  else {
-    reg[R_COND] = FL_POS;
-  }
-}
+struct bench_kernel {
+  const char *name;
+  const uint16_t *program;
+  size_t size;
+};
 
-/* change endianness */
-uint16_t swap16(uint16_t x) {
-    return (x << 8) | (x >> 8);
+/* the reference core with an instruction budget */
+struct run_result bench_switch_run(struct lc3_vm *vm, uint64_t budget, FILE *out) {
+  return vm_core_loops[vm_core_features(vm)](vm, budget);
 }
 
-/* load program into memory from a file */
-void read_image_file(FILE *file) {
-  /* the origin tells us where in memory to place the image */
-  uint16_t origin;
-  fread(&origin, sizeof(origin), 1, file);
-  origin = swap16(origin);
-
-  /* we know the maximum file size so we only need one fread */
-  uint16_t max_read = UINT16_MAX - origin;
-  uint16_t *p = memory + origin;
-  size_t read = fread(p, sizeof(uint16_t), max_read, file);
+int run_bench(int only_engine) {
+  const struct bench_kernel kernels[] = {
+    {"add", bench_add_kernel, sizeof(bench_add_kernel)},
+    {"branch", bench_branch_kernel, sizeof(bench_branch_kernel)},
+    {"memory", bench_memory_kernel, sizeof(bench_memory_kernel)},
+    {"call", bench_call_kernel, sizeof(bench_call_kernel)},
+    {"trap", bench_trap_kernel, sizeof(bench_trap_kernel)}
+  };
+  const char *engine_names[] = {"switch", "threaded", "jit"};
+  struct run_result (*engines[])(struct lc3_vm *, uint64_t, FILE *) = {
+    bench_switch_run, vm_run, vm_jit_run
+  };
 
-  /* swap to little endian */
-  while (read-- > 0) {
-    *p = swap16(*p);
-    ++p;
+  struct lc3_vm *vm = vm_create();
+  int null_fd = open("/dev/null", O_WRONLY);
+  int stdout_fd = dup(STDOUT_FILENO);
+  if (!vm || null_fd < 0 || stdout_fd < 0) {
+    printf("failed to set up the benchmark\n");
+    return 1;
   }
-}
-
-int read_image(const char* image_path) {
-  FILE *file = fopen(image_path, "rb");
-  if (!file) { return 0; };
-  read_image_file(file);
-  fclose(file);
-  return 1;
-}
 
-/* get keyboard status */
-uint16_t check_key() {
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(STDIN_FILENO, &readfds);
-
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  return select(1, &readfds, NULL, NULL, &timeout) != 0;
-}
+  printf("%-8s %-9s %10s %10s %8s\n", "kernel", "engine", "MIPS", "ns/instr", "stddev");
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    for (int e = 0; e < 3; e++) {
+      if (only_engine >= 0 && e != only_engine) {
+        continue;
+      }
 
-/* memory access */
-void mem_write(uint16_t address, uint16_t val) {
-  memory[address] = val;
-}
+      double mips[BENCH_REPEAT];
+      double mean = 0;
+      fflush(stdout);
+      dup2(null_fd, STDOUT_FILENO);
+      for (int r = -1; r < BENCH_REPEAT; r++) {
+        vm_reset(vm);
+        memcpy(vm->memory + PC_START, kernels[k].program, kernels[k].size);
+        vm_mark_dirty(vm, PC_START, kernels[k].size / sizeof(uint16_t));
+        uint64_t start = vm_monotonic_ns();
+        struct run_result result = engines[e](vm, BENCH_INSTRUCTIONS, stdout);
+        fflush(stdout);
+        uint64_t elapsed = vm_monotonic_ns() - start;
+        if (r >= 0) {
+          mips[r] = result.retired * 1000.0 / (elapsed ? elapsed : 1);
+          mean += mips[r] / BENCH_REPEAT;
+        }
+      }
+      dup2(stdout_fd, STDOUT_FILENO);
 
-uint16_t mem_read(uint16_t address) {
-  /* reading the memory mapped keyboard register triggers a key check */
-  if (address == MR_KBSR) {
-    if (check_key()) {
-      memory[MR_KBSR] = (1 << 15);
-      memory[MR_KBDR] = getchar();
-    }
-    else {
-      memory[MR_KBSR] = 0;
+      double variance = 0;
+      for (int r = 0; r < BENCH_REPEAT; r++) {
+        variance += (mips[r] - mean) * (mips[r] - mean) / BENCH_REPEAT;
+      }
+      printf("%-8s %-9s %10.1f %10.2f %7.1f%%\n", kernels[k].name, engine_names[e],
+             mean, 1000.0 / mean, 100.0 * sqrt(variance) / mean);
     }
   }
-  return memory[address];
-}
-
-/* terminal input setup */
-struct termios original_tio;
 
-void disable_input_buffering() {
-  tcgetattr(STDIN_FILENO, &original_tio);
-  struct termios new_tio = original_tio;
-  new_tio.c_lflag &= ~ICANON & ~ECHO;
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+  close(null_fd);
+  close(stdout_fd);
+  vm_destroy(vm);
+  return 0;
 }
 
-void restore_input_buffering() {
-  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
-}
+/* differential testing
+ *
+ * generates random instruction streams and runs each one on every engine,
+ * with the engines and several cases at a time on threads of their own, each
+ * with its own vm. all engines run a case in the same sequence of budget
+ * slices and record the machine state after every slice, which then has to
+ * agree slice for slice. input is always at end of file and the timer is
+ * unmapped, so nothing depends on the host. */
+enum {
+  DIFF_PROGRAM_SIZE = 96, /* words of code and data per case */
+  DIFF_STEPS = 48,        /* budget slices per case */
+  DIFF_MAX_SLICE = 40,    /* instructions per slice at most */
+  DIFF_ENGINES = 3
+};
 
-void handle_interrupt(int signal) {
-  restore_input_buffering();
-  printf("\n");
-  exit(-2);
-}
+struct diff_state {
+  uint16_t reg[R_COUNT];
+  uint16_t psr;
+  int exit;
+  uint64_t retired;
+  uint64_t memory_hash;
+  uint64_t output_hash;  /* of everything written to the display so far */
+};
 
-/* execute trap routine */
-int execute_trap(uint16_t instr, FILE *in, FILE *out) {
-  int running = 1;
-  switch (instr & 0xFF) {
-    case TRAP_GETC:
-      {
-        uint16_t c = getc(in);
-        reg[R_R0] = c;
-      }
-      break;
-    case TRAP_OUT:
-      {
-        char c = (char)reg[R_R0 & 0xff];
-        putc(c, out);
-      }
-      break;
-    case TRAP_PUTS:
-      {
-        /* one char per word */
-        uint16_t *word = memory + reg[R_R0];
-        while (*word) {
-          putc((char)(*word & 0xff), out);
-          word++;
-        }
-        fflush(out);
-      }
-      break;
-    case TRAP_IN:
-      {
-        fprintf(out, "Enter a character: ");
-        fflush(out);
+struct diff_run {
+  uint32_t seed;            /* case i is generated from seed + i */
+  int cases;
+  int shards;               /* threads per engine */
+  struct diff_state *states; /* [case][engine][step] */
+};
 
-        uint16_t c = getc(in);
-        putc((char)c, out);
-        fflush(out);
+struct diff_worker {
+  struct diff_run *run;
+  int engine;
+  int shard;
+  int started;  /* on a thread of its own */
+};
 
-        reg[R_R0] = c;
-      }
-      break;
-    case TRAP_PUTSP:
-      {
-        /* two chars per word */
-        uint16_t *word = memory + reg[R_R0];
-        while (*word) {
-          putc((char)(*word & 0xff), out);
-
-          char c = *word >> 8;
-          if (c) {
-            putc(c, out);
-          }
-          word++;
-        }
-        fflush(out);
-      }
-      break;
-    case TRAP_HALT:
-      {
-        fputs("HALT", out);
-        fflush(out);
-        running = 0;
-      }
-      break;
-  }
-  return running;
+uint32_t diff_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
 }
 
-/* read and execute instruction */
-int read_and_execute_instruction() {
-  int running = 1;
-  int is_max = R_PC == UINT16_MAX;
+uint64_t diff_hash(const void *data, size_t size, uint64_t h) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ p[i]) * 0x100000001B3ULL;
+  }
+  return h;
+}
 
-  /* FETCH */
-  uint16_t instr = mem_read(reg[R_PC]++);
-  uint16_t op = instr >> 12;
+/* engines dirty different pages by decoding them, so pages that are still
+ * all zero are left out */
+uint64_t diff_memory_hash(const struct lc3_vm *vm) {
+  static const uint16_t zero_page[DIRTY_PAGE_WORDS];
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (int p = 0; p < DIRTY_PAGES; p++) {
+    const uint16_t *page = vm->memory + (p << DIRTY_PAGE_SHIFT);
+    if (vm->dirty[p] && memcmp(page, zero_page, sizeof(zero_page)) != 0) {
+      h = diff_hash(&p, sizeof(p), h);
+      h = diff_hash(page, sizeof(zero_page), h);
+    }
+  }
+  return h;
+}
 
+/* mostly short PC-relative offsets and registers pointing into the program,
+ * so code gets stored to and jumped into, with the odd address anywhere */
+uint16_t diff_instr(uint32_t *rnd) {
+  static const uint8_t vectors[] = {TRAP_HALT, TRAP_MEMCPY, TRAP_MEMSET};
+  uint16_t op = diff_random(rnd) % 16;
+  uint16_t w = op << 12 | (diff_random(rnd) & 0xFFF);
   switch (op) {
-    case OP_ADD:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
-        /* first operand (SR1) */
-        uint16_t sr1 = (instr >> 6) & 0x7;
-        /* whether we are in immediate mode */
-        uint16_t imm_flag = (instr >> 5) & 0x1;
-
-        if (imm_flag) {
-          uint16_t imm5 = sign_extend(instr & 0x1f, 5);
-          reg[dr] = reg[sr1] + imm5;
-        }
-        else {
-          uint16_t sr2 = instr & 0x7;
-          reg[dr] = reg[sr1] + reg[sr2];
-        }
-
-        update_flags(dr);
-      }
-      break;
-    case OP_AND:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
-        /* first operand (SR1) */
-        uint16_t sr1 = (instr >> 6) & 0x7;
-        /* whether we are in immediate mode */
-        uint16_t imm_flag = (instr >> 5) & 0x1;
-
-        if (imm_flag) {
-          uint16_t imm5 = sign_extend(instr & 0x1f, 5);
-          reg[dr] = reg[sr1] & imm5;
-        }
-        else {
-          uint16_t sr2 = instr & 0x7;
-          reg[dr] = reg[sr1] & reg[sr2];
-        }
-        update_flags(dr);
-      }
-      break;
-    case OP_NOT:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
-
-        /* source register (SR) */
-        uint16_t sr = (instr >> 6) & 0x7;
-
-        reg[dr] = ~reg[sr];
-        update_flags(dr);
-      }
-      break;
     case OP_BR:
-      {
-        uint16_t n_flag = (instr >> 11) & 0x1;
-        uint16_t z_flag = (instr >> 10) & 0x1;
-        uint16_t p_flag = (instr >> 9) & 0x1;
-
-        /* PCoffset 9 */
-        uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-        /* advance program counter if one of the following is true:
-         * - n_flag is set and negative condition flag is set
-         * - z_flag is set and zero condition flag is set
-         * - p_flag is set and positive condition flag is set */
-        if ((n_flag && (reg[R_COND] & FL_NEG)) ||
-            (z_flag && (reg[R_COND] & FL_ZRO)) ||
-            (p_flag && (reg[R_COND] & FL_POS))) {
-
-          reg[R_PC] += pc_offset;
-        }
-      }
-      break;
-    case OP_JMP:
-      {
-        uint16_t base_r = (instr >> 6) & 0x7;
-        reg[R_PC] = reg[base_r];
-      }
-      break;
-    case OP_JSR:
-      {
-        /* save PC in R7 to jump back to later */
-        reg[R_R7] = reg[R_PC];
-
-        /* whether we are in immediate mode */
-        uint16_t imm_flag = (instr >> 11) & 0x1;
-
-        if (imm_flag) {
-          /* PCoffset 11 */
-          uint16_t pc_offset = sign_extend(instr & 0x7ff, 11);
-
-          /* add offset to program counter */
-          reg[R_PC] += pc_offset;
-        }
-        else {
-          /* assign contents of base register directly to program counter */
-          uint16_t base_r = (instr >> 6) & 0x7;
-          reg[R_PC] = reg[base_r];
-        }
-      }
-      break;
     case OP_LD:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
-
-        /* PCoffset 9 */
-        uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-        /* add pc_offset to the current PC and load that memory location */
-        reg[dr] = mem_read(reg[R_PC] + pc_offset);
-        update_flags(dr);
-      }
-      break;
+    case OP_ST:
     case OP_LDI:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
-
-        /* PCoffset 9 */
-        uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-        /* add pc_offset to the current PC, look at that memory location to
-         * get the final address */
-        reg[dr] = mem_read(mem_read(reg[R_PC] + pc_offset));
-        update_flags(dr);
-      }
-      break;
-    case OP_LDR:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
-
-        /* base register (BaseR) */
-        uint16_t base_r = (instr >> 6) & 0x7;
-
-        /* offset 6 */
-        uint16_t offset = sign_extend(instr & 0x3f, 6);
-
-        reg[dr] = mem_read(reg[base_r] + offset);
-        update_flags(dr);
-      }
-      break;
+    case OP_STI:
     case OP_LEA:
-      {
-        /* destination register (DR) */
-        uint16_t dr = (instr >> 9) & 0x7;
+      return (w & 0xFE00) | ((diff_random(rnd) % 32 - 16) & 0x1FF);
+    case OP_JSR:
+      return w & 0x800 ? (w & 0xF800) | ((diff_random(rnd) % 32 - 16) & 0x7FF) : w;
+    case OP_TRAP:
+      /* mostly keep going */
+      return 0xF000 | vectors[diff_random(rnd) % 8 == 0 ? 0 : 1 + diff_random(rnd) % 2];
+  }
+  return w;
+}
 
-        /* PCoffset 9 */
-        uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+/* power on the vm with case seed loaded */
+void diff_setup(struct lc3_vm *vm, uint32_t seed, uint32_t *rnd) {
+  vm_reset(vm);
+  *rnd = seed * 2654435761u | 1;
+  for (int i = 0; i < DIFF_PROGRAM_SIZE; i++) {
+    vm->memory[PC_START + i] = diff_random(rnd) % 4 ? diff_instr(rnd) : diff_random(rnd);
+  }
+  vm_mark_dirty(vm, PC_START, DIFF_PROGRAM_SIZE);
+  for (int r = R_R0; r <= R_R7; r++) {
+    vm->reg[r] = diff_random(rnd) % 8 ? PC_START + diff_random(rnd) % DIFF_PROGRAM_SIZE
+                                     : diff_random(rnd);
+  }
+  /* exceptions and the keyboard interrupt land in the program */
+  vm->memory[IVT_BASE + VEC_PRIVILEGE] = PC_START + diff_random(rnd) % DIFF_PROGRAM_SIZE;
+  vm->memory[IVT_BASE + VEC_ILLEGAL] = PC_START + diff_random(rnd) % DIFF_PROGRAM_SIZE;
+  vm->memory[IVT_BASE + VEC_KEYBOARD] = PC_START + diff_random(rnd) % DIFF_PROGRAM_SIZE;
+  mark_dirty(vm, IVT_BASE);
+}
 
-        reg[dr] = reg[R_PC] + pc_offset;
-        update_flags(dr);
+/* runs case seed on engine, filling in one state per step */
+void diff_case(struct lc3_vm *vm, int engine, uint32_t seed, struct diff_state *states) {
+  struct run_result (*engines[])(struct lc3_vm *, uint64_t, FILE *) = {
+    bench_switch_run, vm_run, vm_jit_run
+  };
+  static char no_input[1];
+  char *output = NULL;
+  size_t output_size = 0;
+  FILE *in = fmemopen(no_input, sizeof(no_input), "r");
+  FILE *out = open_memstream(&output, &output_size);
+  getc(in); /* every key after this one is EOF */
+
+  uint32_t rnd;
+  diff_setup(vm, seed, &rnd);
+  vm->kbd = in;
+  vm->display = out;
+
+  struct diff_state state = {{0}, 0, RUN_BUDGET, 0, 0, 0};
+  for (int step = 0; step < DIFF_STEPS; step++) {
+    if (state.exit == RUN_BUDGET) {
+      /* the reference core services traps inline, so the others do too */
+      uint64_t slice = 1 + diff_random(&rnd) % DIFF_MAX_SLICE;
+      struct run_result result = {0, RUN_BUDGET, 0};
+      while (result.exit == RUN_BUDGET && slice) {
+        struct run_result r = engines[engine](vm, slice, out);
+        slice -= r.retired;
+        result.retired += r.retired;
+        result.exit = r.exit;
+        if (r.exit == RUN_TRAP) {
+          result.exit = vm_execute_trap(vm, r.trap, in, out) ? RUN_BUDGET : RUN_HALTED;
+        }
       }
-      break;
-    case OP_ST:
-      {
-        /* source register (SR) */
-        uint16_t sr = (instr >> 9) & 0x7;
-
-        /* PCoffset 9 */
-        uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+      vm_sync_flags(vm);
+      fflush(out);
+      memcpy(state.reg, vm->reg, sizeof(state.reg));
+      state.psr = vm->psr;
+      state.exit = result.exit;
+      state.retired += result.retired;
+      state.memory_hash = diff_memory_hash(vm);
+      state.output_hash = diff_hash(output, output_size, 0xCBF29CE484222325ULL);
+    }
+    states[step] = state;
+  }
 
-        mem_write(reg[R_PC] + pc_offset, reg[sr]);
-      }
-      break;
-    case OP_STI:
-      {
-        /* source register (SR) */
-        uint16_t sr = (instr >> 9) & 0x7;
+  vm->kbd = stdin;
+  vm->display = stdout;
+  fclose(in);
+  fclose(out);
+  free(output);
+}
 
-        /* PCoffset 9 */
-        uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+void *diff_worker_main(void *arg) {
+  struct diff_worker *w = arg;
+  struct diff_run *run = w->run;
+  struct lc3_vm *vm = vm_create();
+  if (!vm) {
+    return NULL;
+  }
+  vm->quiet_halt = 1;
+  vm_map_device(vm, MR_TMR, NULL, NULL);
+  vm_map_device(vm, MR_TMI, NULL, NULL);
 
-        mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
-      }
-      break;
-    case OP_STR:
-      {
-        /* source register (DR) */
-        uint16_t sr = (instr >> 9) & 0x7;
+  for (int c = w->shard; c < run->cases; c += run->shards) {
+    struct diff_state *states = run->states + ((size_t)c * DIFF_ENGINES + w->engine) * DIFF_STEPS;
+    diff_case(vm, w->engine, run->seed + c, states);
+  }
+  vm_destroy(vm);
+  return NULL;
+}
 
-        /* base register (BaseR) */
-        uint16_t base_r = (instr >> 6) & 0x7;
+/* compare engine against the reference core on one case, 0 if they agree */
+int diff_check(const struct diff_run *run, int c, int engine, int verbose) {
+  const char *engine_names[] = {"switch", "threaded", "jit"};
+  const struct diff_state *expected = run->states + (size_t)c * DIFF_ENGINES * DIFF_STEPS;
+  const struct diff_state *got = expected + engine * DIFF_STEPS;
+  for (int step = 0; step < DIFF_STEPS; step++) {
+    const struct diff_state *e = &expected[step], *g = &got[step];
+    const char *what = NULL;
+    if (memcmp(e->reg, g->reg, sizeof(e->reg)) != 0 || e->psr != g->psr) {
+      what = "registers";
+    }
+    else if (e->memory_hash != g->memory_hash) {
+      what = "memory";
+    }
+    else if (e->output_hash != g->output_hash) {
+      what = "output";
+    }
+    else if (e->exit != g->exit || e->retired != g->retired) {
+      what = "exit";
+    }
+    if (!what) {
+      continue;
+    }
 
-        /* offset 6 */
-        uint16_t offset = sign_extend(instr & 0x3f, 6);
+    if (verbose) {
+      printf("seed %u: %s differs from switch in %s after step %d (%llu instructions)\n",
+             run->seed + c, engine_names[engine], what, step,
+             (unsigned long long)e->retired);
+      for (int r = 0; r < R_COUNT; r++) {
+        if (e->reg[r] != g->reg[r]) {
+          printf("  reg %d: expected 0x%04x, got 0x%04x\n", r, e->reg[r], g->reg[r]);
+        }
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
 
-        mem_write(reg[base_r] + offset, reg[sr]);
+/* runs cases random programs starting at seed, returns how many disagreed */
+int run_differential(uint32_t seed, int cases, int threads, int verbose) {
+  struct diff_run run = {seed, cases, threads / DIFF_ENGINES > 0 ? threads / DIFF_ENGINES : 1, NULL};
+  run.states = calloc((size_t)cases * DIFF_ENGINES * DIFF_STEPS, sizeof(*run.states));
+  struct diff_worker *workers = calloc((size_t)run.shards * DIFF_ENGINES, sizeof(*workers));
+  pthread_t *tids = calloc((size_t)run.shards * DIFF_ENGINES, sizeof(*tids));
+  if (!run.states || !workers || !tids) {
+    free(run.states);
+    free(workers);
+    free(tids);
+    return cases;
+  }
+
+  int n = 0;
+  for (int e = 0; e < DIFF_ENGINES; e++) {
+    for (int k = 0; k < run.shards; k++, n++) {
+      workers[n] = (struct diff_worker){&run, e, k, 0};
+      workers[n].started = pthread_create(&tids[n], NULL, diff_worker_main, &workers[n]) == 0;
+      if (!workers[n].started) {
+        diff_worker_main(&workers[n]);
       }
-      break;
-    case OP_TRAP:
-      running = execute_trap(instr, stdin, stdout);
-      break;
-    case OP_RES:
-    case OP_RTI:
-    default:
-      abort();
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (workers[i].started) {
+      pthread_join(tids[i], NULL);
+    }
   }
 
-  if (running && is_max) {
-    printf("Program counter overflow!");
-    return 0;
+  int failed = 0;
+  for (int c = 0; c < cases; c++) {
+    int bad = 0;
+    for (int e = 1; e < DIFF_ENGINES; e++) {
+      bad |= diff_check(&run, c, e, verbose && failed < 10);
+    }
+    failed += bad;
   }
 
-  return running;
+  free(run.states);
+  free(workers);
+  free(tids);
+  return failed;
 }
 
 /* tests */
-int test_add_instr_1() {
+int test_add_instr_1(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t add_instr =
@@ -474,30 +412,31 @@ int test_add_instr_1() {
     ((R_R1 & 0x7) << 6)    |
     (R_R2 & 0x7);
 
-  memory[0x3000] = add_instr;
-  reg[R_R1] = 1;
-  reg[R_R2] = 2;
+  vm->memory[0x3000] = add_instr;
+  vm->reg[R_R1] = 1;
+  vm->reg[R_R2] = 2;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 3) {
-    printf("Expected register 0 to contain 3, got %d\n", reg[R_R0]);
+  if (vm->reg[R_R0] != 3) {
+    printf("Expected register 0 to contain 3, got %d\n", vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_add_instr_2() {
+int test_add_instr_2(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t add_instr =
@@ -507,29 +446,30 @@ int test_add_instr_2() {
     (1 << 5) |
     0x2;
 
-  memory[0x3000] = add_instr;
-  reg[R_R1] = 1;
+  vm->memory[0x3000] = add_instr;
+  vm->reg[R_R1] = 1;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 3) {
-    printf("Expected register 0 to contain 3, got %d\n", reg[R_R0]);
+  if (vm->reg[R_R0] != 3) {
+    printf("Expected register 0 to contain 3, got %d\n", vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_and_instr_1() {
+int test_and_instr_1(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t and_instr =
@@ -538,30 +478,31 @@ int test_and_instr_1() {
     ((R_R1 & 0x7) << 6)    |
     (R_R2 & 0x7);
 
-  memory[0x3000] = and_instr;
-  reg[R_R1] = 0xff;
-  reg[R_R2] = 0xf0;
+  vm->memory[0x3000] = and_instr;
+  vm->reg[R_R1] = 0xff;
+  vm->reg[R_R2] = 0xf0;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0xf0) {
-    printf("Expected register 0 to contain %d, got %d\n", 0xf0, reg[R_R0]);
+  if (vm->reg[R_R0] != 0xf0) {
+    printf("Expected register 0 to contain %d, got %d\n", 0xf0, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_and_instr_2() {
+int test_and_instr_2(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t and_instr =
@@ -571,29 +512,30 @@ int test_and_instr_2() {
     (1 << 5) |
     0x0f;
 
-  memory[0x3000] = and_instr;
-  reg[R_R1] = 0xff;
+  vm->memory[0x3000] = and_instr;
+  vm->reg[R_R1] = 0xff;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0x0f) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x0f, reg[R_R0]);
+  if (vm->reg[R_R0] != 0x0f) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x0f, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_not_instr() {
+int test_not_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t not_instr =
@@ -602,29 +544,30 @@ int test_not_instr() {
     ((R_R1 & 0x7) << 6)    |
     0x3f;
 
-  memory[0x3000] = not_instr;
-  reg[R_R1] = 0xf;
+  vm->memory[0x3000] = not_instr;
+  vm->reg[R_R1] = 0xf;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0xfff0) {
-    printf("Expected register 0 to contain %d, got %d\n", 0xfff0, reg[R_R0]);
+  if (vm->reg[R_R0] != 0xfff0) {
+    printf("Expected register 0 to contain %d, got %d\n", 0xfff0, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_NEG) {
-    printf("Expected condition flags to be %d, got %d\n", FL_NEG, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_NEG) {
+    printf("Expected condition flags to be %d, got %d\n", FL_NEG, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_br_instr_1() {
+int test_br_instr_1(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t br_instr =
@@ -632,25 +575,25 @@ int test_br_instr_1() {
     (1 << 11) |
     0x123;
 
-  memory[0x3000] = br_instr;
+  vm->memory[0x3000] = br_instr;
 
   /* nothing should happen */
-  reg[R_COND] = 0;
-  int result = read_and_execute_instruction();
+  vm->reg[R_COND] = 0;
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x3001) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3001, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x3001) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3001, vm->reg[R_PC]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_br_instr_2() {
+int test_br_instr_2(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t br_instr =
@@ -658,24 +601,24 @@ int test_br_instr_2() {
     (1 << 11) |
     0x0ff;
 
-  memory[0x3000] = br_instr;
+  vm->memory[0x3000] = br_instr;
 
-  reg[R_COND] = FL_NEG;
-  int result = read_and_execute_instruction();
+  vm->reg[R_COND] = FL_NEG;
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_br_instr_3() {
+int test_br_instr_3(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t br_instr =
@@ -683,24 +626,24 @@ int test_br_instr_3() {
     (1 << 10) |
     0x0ff;
 
-  memory[0x3000] = br_instr;
+  vm->memory[0x3000] = br_instr;
 
-  reg[R_COND] = FL_ZRO;
-  int result = read_and_execute_instruction();
+  vm->reg[R_COND] = FL_ZRO;
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_br_instr_4() {
+int test_br_instr_4(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t br_instr =
@@ -708,48 +651,89 @@ int test_br_instr_4() {
     (1 << 9) |
     0x0ff;
 
-  memory[0x3000] = br_instr;
+  vm->memory[0x3000] = br_instr;
+
+  vm->reg[R_COND] = FL_POS;
+  int result = vm_read_and_execute_instruction(vm);
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_br_lazy_flags(struct lc3_vm *vm) {
+  int pass = 1;
+
+  uint16_t add_instr =
+    ((OP_ADD & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R0 & 0x7) << 6)    |
+    (1 << 5) |
+    0x1f;
+
+  uint16_t br_instr =
+    ((OP_BR & 0xf) << 12) |
+    (1 << 11) |
+    0x0ff;
+
+  /* the BR has to see the pending flags of the ADD */
+  vm->memory[0x3000] = add_instr;
+  vm->memory[0x3001] = br_instr;
+  vm->reg[R_COND] = FL_POS;
 
-  reg[R_COND] = FL_POS;
-  int result = read_and_execute_instruction();
+  vm_read_and_execute_instruction(vm);
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x3101) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3101, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_NEG) {
+    printf("Expected condition flags to be %d, got %d\n", FL_NEG, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_jmp_instr() {
+int test_jmp_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t jmp_instr =
     ((OP_JMP & 0xf) << 12) |
     ((R_R0 & 0x7) << 6);
 
-  memory[0x3000] = jmp_instr;
-  reg[R_R0] = 0x1234;
+  vm->memory[0x3000] = jmp_instr;
+  vm->reg[R_R0] = 0x1234;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x1234) {
-    printf("Expected program counter to contain %d, got %d\n", 0x1234, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x1234) {
+    printf("Expected program counter to contain %d, got %d\n", 0x1234, vm->reg[R_PC]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_jsr_instr_1() {
+int test_jsr_instr_1(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t jsr_instr =
@@ -757,57 +741,57 @@ int test_jsr_instr_1() {
     (1 << 11) |
     0xff;
 
-  memory[0x3000] = jsr_instr;
+  vm->memory[0x3000] = jsr_instr;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
     pass = 0;
   }
 
-  if (reg[R_R7] != 0x3001) {
-    printf("Expected register 7 to contain %d, got %d\n", 0x3001, reg[R_R7]);
+  if (vm->reg[R_R7] != 0x3001) {
+    printf("Expected register 7 to contain %d, got %d\n", 0x3001, vm->reg[R_R7]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_jsr_instr_2() {
+int test_jsr_instr_2(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t jsr_instr =
     ((OP_JSR & 0xf) << 12) |
     ((R_R0 & 0x7) << 6);
 
-  memory[0x3000] = jsr_instr;
-  reg[R_R0] = 0x1234;
+  vm->memory[0x3000] = jsr_instr;
+  vm->reg[R_R0] = 0x1234;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x1234) {
-    printf("Expected program counter to contain %d, got %d\n", 0x1234, reg[R_PC]);
+  if (vm->reg[R_PC] != 0x1234) {
+    printf("Expected program counter to contain %d, got %d\n", 0x1234, vm->reg[R_PC]);
     pass = 0;
   }
 
-  if (reg[R_R7] != 0x3001) {
-    printf("Expected register 7 to contain %d, got %d\n", 0x3001, reg[R_R7]);
+  if (vm->reg[R_R7] != 0x3001) {
+    printf("Expected register 7 to contain %d, got %d\n", 0x3001, vm->reg[R_R7]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_ld_instr() {
+int test_ld_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t ld_instr =
@@ -815,29 +799,30 @@ int test_ld_instr() {
     ((R_R0 & 0x7) << 9)   |
     0xff;
 
-  memory[0x3000] = ld_instr;
-  memory[0x3100] = 0x123;
+  vm->memory[0x3000] = ld_instr;
+  vm->memory[0x3100] = 0x123;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0x123) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x123, reg[R_R0]);
+  if (vm->reg[R_R0] != 0x123) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_ldi_instr() {
+int test_ldi_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t ldi_instr =
@@ -845,30 +830,31 @@ int test_ldi_instr() {
     ((R_R0 & 0x7) << 9)   |
     0xff;
 
-  memory[0x3000] = ldi_instr;
-  memory[0x3100] = 0x3200;
-  memory[0x3200] = 0x123;
+  vm->memory[0x3000] = ldi_instr;
+  vm->memory[0x3100] = 0x3200;
+  vm->memory[0x3200] = 0x123;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0x123) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x123, reg[R_R0]);
+  if (vm->reg[R_R0] != 0x123) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_ldr_instr() {
+int test_ldr_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t ldr_instr =
@@ -877,30 +863,31 @@ int test_ldr_instr() {
     ((R_R1 & 0x7) << 6)    |
     0xf;
 
-  memory[0x3000] = ldr_instr;
-  reg[R_R1] = 0x31f1;
-  memory[0x3200] = 0x123;
+  vm->memory[0x3000] = ldr_instr;
+  vm->reg[R_R1] = 0x31f1;
+  vm->memory[0x3200] = 0x123;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0x123) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x123, reg[R_R0]);
+  if (vm->reg[R_R0] != 0x123) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_lea_instr() {
+int test_lea_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t lea_instr =
@@ -908,28 +895,29 @@ int test_lea_instr() {
     ((R_R0 & 0x7) << 9)    |
     0xff;
 
-  memory[0x3000] = lea_instr;
+  vm->memory[0x3000] = lea_instr;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0x3100) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x3100, reg[R_R0]);
+  if (vm->reg[R_R0] != 0x3100) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x3100, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, vm->reg[R_COND]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_st_instr() {
+int test_st_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t st_instr =
@@ -937,24 +925,24 @@ int test_st_instr() {
     ((R_R0 & 0x7) << 9)    |
     0xff;
 
-  memory[0x3000] = st_instr;
-  reg[R_R0] = 0x123;
+  vm->memory[0x3000] = st_instr;
+  vm->reg[R_R0] = 0x123;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (memory[0x3100] != 0x123) {
-    printf("Expected memory location %d to contain %d, got %d\n", 0x3100, 0x123, reg[R_R0]);
+  if (vm->memory[0x3100] != 0x123) {
+    printf("Expected memory location %d to contain %d, got %d\n", 0x3100, 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_sti_instr() {
+int test_sti_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t sti_instr =
@@ -962,25 +950,25 @@ int test_sti_instr() {
     ((R_R0 & 0x7) << 9)    |
     0xff;
 
-  memory[0x3000] = sti_instr;
-  memory[0x3100] = 0x3200;
-  reg[R_R0] = 0x123;
+  vm->memory[0x3000] = sti_instr;
+  vm->memory[0x3100] = 0x3200;
+  vm->reg[R_R0] = 0x123;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (memory[0x3200] != 0x123) {
-    printf("Expected memory location %d to contain %d, got %d\n", 0x3200, 0x123, reg[R_R0]);
+  if (vm->memory[0x3200] != 0x123) {
+    printf("Expected memory location %d to contain %d, got %d\n", 0x3200, 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_str_instr() {
+int test_str_instr(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t str_instr =
@@ -989,25 +977,25 @@ int test_str_instr() {
     ((R_R1 & 0x7) << 6)    |
     0xf;
 
-  memory[0x3000] = str_instr;
-  reg[R_R0] = 0x123;
-  reg[R_R1] = 0x31f1;
+  vm->memory[0x3000] = str_instr;
+  vm->reg[R_R0] = 0x123;
+  vm->reg[R_R1] = 0x31f1;
 
-  int result = read_and_execute_instruction();
+  int result = vm_read_and_execute_instruction(vm);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (memory[0x3200] != 0x123) {
-    printf("Expected memory location %d to contain %d, got %d\n", 0x3200, 0x123, reg[R_R0]);
+  if (vm->memory[0x3200] != 0x123) {
+    printf("Expected memory location %d to contain %d, got %d\n", 0x3200, 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_trap_getc() {
+int test_trap_getc(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t trap_getc_instr =
@@ -1015,11 +1003,11 @@ int test_trap_getc() {
     (TRAP_GETC & 0xff);
 
   char in_buf[] = {'x'};
-  char out_buf[256];
+  char out_buf[256] = {0};
   FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
   FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  int result = execute_trap(trap_getc_instr, in, out);
+  int result = vm_execute_trap(vm, trap_getc_instr, in, out);
   fclose(in);
   fclose(out);
 
@@ -1028,8 +1016,8 @@ int test_trap_getc() {
     pass = 0;
   }
 
-  if (reg[R_R0] != 'x') {
-    printf("Expected register 0 to contain %d, got %d\n", 'x', reg[R_R0]);
+  if (vm->reg[R_R0] != 'x') {
+    printf("Expected register 0 to contain %d, got %d\n", 'x', vm->reg[R_R0]);
     pass = 0;
   }
 
@@ -1041,7 +1029,7 @@ int test_trap_getc() {
   return pass;
 }
 
-int test_trap_out() {
+int test_trap_out(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t trap_out_instr =
@@ -1053,9 +1041,9 @@ int test_trap_out() {
   FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
   FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  reg[R_R0] = 'x';
+  vm->reg[R_R0] = 'x';
 
-  int result = execute_trap(trap_out_instr, in, out);
+  int result = vm_execute_trap(vm, trap_out_instr, in, out);
   fclose(in);
   fclose(out);
 
@@ -1072,7 +1060,7 @@ int test_trap_out() {
   return pass;
 }
 
-int test_trap_puts() {
+int test_trap_puts(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t trap_puts_instr =
@@ -1084,13 +1072,13 @@ int test_trap_puts() {
   FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
   FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  reg[R_R0] = 0x3100;
-  memory[0x3100] = 'h';
-  memory[0x3101] = 'e';
-  memory[0x3102] = 'y';
-  memory[0x3103] = 0;
+  vm->reg[R_R0] = 0x3100;
+  vm->memory[0x3100] = 'h';
+  vm->memory[0x3101] = 'e';
+  vm->memory[0x3102] = 'y';
+  vm->memory[0x3103] = 0;
 
-  int result = execute_trap(trap_puts_instr, in, out);
+  int result = vm_execute_trap(vm, trap_puts_instr, in, out);
   fclose(in);
   fclose(out);
 
@@ -1107,7 +1095,7 @@ int test_trap_puts() {
   return pass;
 }
 
-int test_trap_in() {
+int test_trap_in(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t trap_in_instr =
@@ -1119,7 +1107,7 @@ int test_trap_in() {
   FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
   FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  int result = execute_trap(trap_in_instr, in, out);
+  int result = vm_execute_trap(vm, trap_in_instr, in, out);
   fclose(in);
   fclose(out);
 
@@ -1128,8 +1116,8 @@ int test_trap_in() {
     pass = 0;
   }
 
-  if (reg[R_R0] != 'x') {
-    printf("Expected register 0 to contain %d, got %d\n", 'x', reg[R_R0]);
+  if (vm->reg[R_R0] != 'x') {
+    printf("Expected register 0 to contain %d, got %d\n", 'x', vm->reg[R_R0]);
   }
 
   if (strncmp(out_buf, "Enter a character: x", 27) != 0) {
@@ -1140,7 +1128,7 @@ int test_trap_in() {
   return pass;
 }
 
-int test_trap_putsp() {
+int test_trap_putsp(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t trap_putsp_instr =
@@ -1152,14 +1140,14 @@ int test_trap_putsp() {
   FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
   FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  reg[R_R0] = 0x3100;
-  memory[0x3100] = 'h' | ('e' << 8);
-  memory[0x3101] = 'y' | (' ' << 8);
-  memory[0x3102] = 'd' | ('u' << 8);
-  memory[0x3103] = 'd' | ('e' << 8);
-  memory[0x3104] = 0;
+  vm->reg[R_R0] = 0x3100;
+  vm->memory[0x3100] = 'h' | ('e' << 8);
+  vm->memory[0x3101] = 'y' | (' ' << 8);
+  vm->memory[0x3102] = 'd' | ('u' << 8);
+  vm->memory[0x3103] = 'd' | ('e' << 8);
+  vm->memory[0x3104] = 0;
 
-  int result = execute_trap(trap_putsp_instr, in, out);
+  int result = vm_execute_trap(vm, trap_putsp_instr, in, out);
   fclose(in);
   fclose(out);
 
@@ -1176,7 +1164,7 @@ int test_trap_putsp() {
   return pass;
 }
 
-int test_trap_halt() {
+int test_trap_halt(struct lc3_vm *vm) {
   int pass = 1;
 
   uint16_t trap_halt_instr =
@@ -1188,7 +1176,7 @@ int test_trap_halt() {
   FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
   FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  int result = execute_trap(trap_halt_instr, in, out);
+  int result = vm_execute_trap(vm, trap_halt_instr, in, out);
   fclose(in);
   fclose(out);
 
@@ -1205,92 +1193,2259 @@ int test_trap_halt() {
   return pass;
 }
 
-int run_tests() {
-  int (*tests[])(void) = {
-    test_add_instr_1,
-    test_add_instr_2,
-    test_and_instr_1,
-    test_and_instr_2,
-    test_not_instr,
-    test_br_instr_1,
-    test_br_instr_2,
-    test_br_instr_3,
-    test_br_instr_4,
-    test_jmp_instr,
-    test_jsr_instr_1,
-    test_jsr_instr_2,
-    test_ld_instr,
-    test_ldi_instr,
-    test_ldr_instr,
-    test_lea_instr,
-    test_st_instr,
-    test_sti_instr,
-    test_str_instr,
-    test_trap_getc,
-    test_trap_out,
-    test_trap_puts,
-    test_trap_in,
-    test_trap_putsp,
-    NULL
-  };
+int test_decode_cache_invalidation(struct lc3_vm *vm) {
+  int pass = 1;
 
-  int i, result, ok = 1;
-  for (i = 0; tests[i] != NULL; i++) {
-    /* clear memory */
-    memset(reg, 0, sizeof(reg));
-    memset(memory, 0, sizeof(memory));
+  uint16_t add_instr =
+    ((OP_ADD & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R0 & 0x7) << 6)    |
+    (1 << 5) |
+    0x1;
 
-    /* set the PC to starting position */
-    /* 0x3000 is the default */
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
+  uint16_t and_instr =
+    ((OP_AND & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R0 & 0x7) << 6)    |
+    (1 << 5) |
+    0x0;
 
+  mem_write(vm, 0x3000, add_instr);
+  vm_read_and_execute_instruction(vm);
 
-    result = tests[i]();
-    if (!result) {
-      printf("Test %d failed!\n", i);
-      ok = 0;
-    }
+  /* overwrite the cached instruction and run it again */
+  mem_write(vm, 0x3000, and_instr);
+  vm->reg[R_PC] = 0x3000;
+  int result = vm_read_and_execute_instruction(vm);
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
   }
 
-  if (ok) {
-    printf("All tests passed!\n");
-    return 0;
+  if (vm->reg[R_R0] != 0) {
+    printf("Expected register 0 to contain %d, got %d\n", 0, vm->reg[R_R0]);
+    pass = 0;
   }
-  return 1;
-}
 
-/* main program */
-int main(int argc, const char* argv[]) {
-  if (argc < 2) {
-    /* show usage string */
-    printf("lc3 --test | [image-file1] ...\n");
-    exit(2);
+  vm_sync_flags(vm);
+  if (vm->reg[R_COND] != FL_ZRO) {
+    printf("Expected condition flags to be %d, got %d\n", FL_ZRO, vm->reg[R_COND]);
+    pass = 0;
   }
 
-  if (strcmp(argv[1], "--test") == 0) {
-    exit(run_tests());
-  }
+  return pass;
+}
 
-  for (int j = 1; j < argc; ++j) {
-    if (!read_image(argv[j])) {
-      printf("failed to load image: %s\n", argv[j]);
-      exit(1);
-    }
-  }
+/* counts down from 5, storing a running sum through a pointer and calling a
+ * subroutine each iteration, then halts */
+uint16_t engine_test_program[] = {
+  0x5020, /* 3000 AND R0, R0, #0 */
+  0x1225, /* 3001 ADD R1, R0, #5 */
+  0xE40A, /* 3002 LEA R2, #10 (0x300D) */
+  0x1001, /* 3003 ADD R0, R0, R1 */
+  0x7080, /* 3004 STR R0, R2, #0 */
+  0x6680, /* 3005 LDR R3, R2, #0 */
+  0x4804, /* 3006 JSR #4 (0x300B) */
+  0x127F, /* 3007 ADD R1, R1, #-1 */
+  0x03FA, /* 3008 BRp #-6 (0x3003) */
+  0x9A3F, /* 3009 NOT R5, R0 */
+  0xF025, /* 300A HALT */
+  0x18C3, /* 300B ADD R4, R3, R3 */
+  0xC1C0, /* 300C RET */
+  0x0000  /* 300D data */
+};
+
+/* patches the first ADD of its own loop body on the first iteration */
+uint16_t self_modifying_test_program[] = {
+  0x2206, /* 3000 LD R1, #6 (0x3007) */
+  0x1021, /* 3001 ADD R0, R0, #1 */
+  0x14A1, /* 3002 ADD R2, R2, #1 */
+  0x33FD, /* 3003 ST R1, #-3 (0x3001) */
+  0x16BE, /* 3004 ADD R3, R2, #-2 */
+  0x09FB, /* 3005 BRn #-5 (0x3001) */
+  0xF025, /* 3006 HALT */
+  0x1022  /* 3007 ADD R0, R0, #2 */
+};
 
-  signal(SIGINT, handle_interrupt);
-  disable_input_buffering();
+void load_test_program(struct lc3_vm *vm, const uint16_t *program, size_t size) {
+  vm_reset(vm);
+  memcpy(vm->memory + PC_START, program, size);
+  vm_mark_dirty(vm, PC_START, size / sizeof(program[0]));
+}
 
-  /* set the PC to starting position */
-  /* 0x3000 is the default */
-  enum { PC_START = 0x3000 };
-  reg[R_PC] = PC_START;
+/* runs a program on the reference core and on engine and compares the
+ * machine state once it halts */
+int check_engine(struct lc3_vm *vm, int (*engine)(struct lc3_vm *, FILE *, FILE *),
+                 const uint16_t *program, size_t size, uint16_t halt_addr) {
+  int pass = 1;
 
-  int running = 1;
-  while (running) {
-    running = read_and_execute_instruction();
+  /* reference run, stopping in front of the HALT */
+  load_test_program(vm, program, size);
+  while (vm->reg[R_PC] != halt_addr) {
+    vm_read_and_execute_instruction(vm);
   }
+  vm->reg[R_PC]++;
+  vm_sync_flags(vm);
 
-  restore_input_buffering();
+  static uint16_t expected_memory[UINT16_MAX + 1];
+  uint16_t expected_reg[R_COUNT];
+  memcpy(expected_memory, vm->memory, sizeof(vm->memory));
+  memcpy(expected_reg, vm->reg, sizeof(vm->reg));
+
+  load_test_program(vm, program, size);
+  char in_buf[] = {0};
+  char out_buf[256];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  int result = engine(vm, in, out);
+  fclose(in);
+  fclose(out);
+
+  if (result != 0) {
+    printf("Expected return value to be 0, got %d\n", result);
+    pass = 0;
+  }
+
+  for (int r = 0; r < R_COUNT; r++) {
+    if (vm->reg[r] != expected_reg[r]) {
+      printf("Expected register %d to contain %d, got %d\n", r, expected_reg[r], vm->reg[r]);
+      pass = 0;
+    }
+  }
+
+  if (memcmp(vm->memory, expected_memory, sizeof(vm->memory)) != 0) {
+    printf("Expected memory to match the reference run\n");
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_threaded_engine(struct lc3_vm *vm) {
+  return check_engine(vm, vm_run_threaded, engine_test_program,
+                      sizeof(engine_test_program), 0x300A) &&
+         check_engine(vm, vm_run_threaded, self_modifying_test_program,
+                      sizeof(self_modifying_test_program), 0x3006);
+}
+
+int test_jit_engine(struct lc3_vm *vm) {
+  return check_engine(vm, vm_run_jit, engine_test_program,
+                      sizeof(engine_test_program), 0x300A) &&
+         check_engine(vm, vm_run_jit, self_modifying_test_program,
+                      sizeof(self_modifying_test_program), 0x3006);
+}
+
+int test_vm_run_budget(struct lc3_vm *vm) {
+  int pass = 1;
+
+  load_test_program(vm, engine_test_program, sizeof(engine_test_program));
+  struct run_result result = vm_run(vm, 3, stdout);
+
+  if (result.exit != RUN_BUDGET) {
+    printf("Expected exit to be %d, got %d\n", RUN_BUDGET, result.exit);
+    pass = 0;
+  }
+
+  if (result.retired != 3) {
+    printf("Expected %d instructions to retire, got %d\n", 3, (int)result.retired);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x3003) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3003, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_vm_run_exits(struct lc3_vm *vm) {
+  int pass = 1;
+
+  uint16_t program[] = {
+    ((OP_TRAP & 0xf) << 12) | (TRAP_GETC & 0xff),
+    ((OP_RTI & 0xf) << 12),
+    ((OP_TRAP & 0xf) << 12) | (TRAP_HALT & 0xff)
+  };
+  load_test_program(vm, program, sizeof(program));
+  vm->memory[IVT_BASE + VEC_PRIVILEGE] = 0x3002;
+
+  /* input traps go back to the host */
+  struct run_result result = vm_run(vm, 10, stdout);
+  if (result.exit != RUN_TRAP || result.trap != program[0]) {
+    printf("Expected exit to be %d, got %d\n", RUN_TRAP, result.exit);
+    pass = 0;
+  }
+
+  if (result.retired != 1 || vm->reg[R_PC] != 0x3001) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3001, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  /* RTI in user mode raises a privilege exception */
+  char out_buf[16];
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  result = vm_run(vm, 10, out);
+  fclose(out);
+  if (result.exit != RUN_HALTED || result.retired != 2) {
+    printf("Expected exit to be %d after 2, got %d after %llu\n", RUN_HALTED, result.exit,
+           (unsigned long long)result.retired);
+    pass = 0;
+  }
+
+  if (vm->psr & PSR_USER || vm->reg[R_R6] != SSP_START - 2 || vm->memory[SSP_START - 2] != 0x3002) {
+    printf("Expected supervisor mode with 0x3002 pushed, got PSR 0x%x and R6 0x%x\n",
+           vm->psr, vm->reg[R_R6]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+/* compiled code has to stop on exactly the same instruction as the
+ * interpreter for every budget */
+int test_jit_run_budget(struct lc3_vm *vm) {
+  int pass = 1;
+
+  char out_buf[256];
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  for (uint64_t budget = 1; budget < 48 && pass; budget++) {
+    load_test_program(vm, engine_test_program, sizeof(engine_test_program));
+    struct run_result expected = vm_run(vm, budget, out);
+    uint16_t expected_reg[R_COUNT];
+    memcpy(expected_reg, vm->reg, sizeof(vm->reg));
+
+    load_test_program(vm, engine_test_program, sizeof(engine_test_program));
+    struct run_result result = vm_jit_run(vm, budget, out);
+
+    if (result.retired != expected.retired || result.exit != expected.exit) {
+      printf("Expected %d instructions to retire, got %d\n", (int)expected.retired, (int)result.retired);
+      pass = 0;
+    }
+
+    if (memcmp(vm->reg, expected_reg, sizeof(vm->reg)) != 0) {
+      printf("Expected registers to match the interpreter after %d instructions\n", (int)budget);
+      pass = 0;
+    }
+  }
+  fclose(out);
+
+  /* no page of the code arena is left writable and executable */
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps) {
+    char line[256];
+    while (fgets(line, sizeof(line), maps)) {
+      char perms[5];
+      if (sscanf(line, "%*s %4s", perms) == 1 && perms[1] == 'w' && perms[2] == 'x') {
+        printf("Expected no writable and executable mapping, got %s", line);
+        pass = 0;
+      }
+    }
+    fclose(maps);
+  }
+
+  return pass;
+}
+
+/* echoes one character read with GETC */
+uint16_t getc_test_program[] = {
+  0xF020, /* 3000 GETC */
+  0xF021, /* 3001 OUT */
+  0xF025  /* 3002 HALT */
+};
+
+int test_scheduler(struct lc3_vm *vm) {
+  enum { GUESTS = 16 };
+  int pass = 1;
+
+  /* reference state for engine_test_program */
+  load_test_program(vm, engine_test_program, sizeof(engine_test_program));
+  while (vm->reg[R_PC] != 0x300A) {
+    vm_read_and_execute_instruction(vm);
+  }
+  vm->reg[R_PC]++;
+  vm_sync_flags(vm);
+
+  struct scheduler *s = vm_sched_create(4, ENGINE_THREADED);
+  struct lc3_vm *guests[GUESTS + 1];
+  FILE *files[2 * (GUESTS + 1)];
+  char in_buf[] = "x";
+  char out_buf[GUESTS + 1][64] = {{0}};
+
+  for (int i = 0; i <= GUESTS; i++) {
+    guests[i] = vm_create();
+    if (i < GUESTS) {
+      load_test_program(guests[i], engine_test_program, sizeof(engine_test_program));
+    }
+    else {
+      load_test_program(guests[i], getc_test_program, sizeof(getc_test_program));
+    }
+    files[2 * i] = fmemopen(in_buf, sizeof(in_buf), "r");
+    files[2 * i + 1] = fmemopen(out_buf[i], sizeof(out_buf[i]), "w");
+    vm_sched_add(s, guests[i], files[2 * i], files[2 * i + 1]);
+  }
+
+  vm_sched_run(s);
+
+  for (struct guest *g = s->guests; g; g = g->next) {
+    if (g->exit != RUN_HALTED) {
+      printf("Expected guest to halt, got exit %d\n", g->exit);
+      pass = 0;
+    }
+  }
+
+  for (int i = 0; i < GUESTS; i++) {
+    if (memcmp(guests[i]->reg, vm->reg, sizeof(vm->reg)) != 0) {
+      printf("Expected guest %d registers to match the reference run\n", i);
+      pass = 0;
+    }
+  }
+
+  if (guests[GUESTS]->reg[R_R0] != 'x') {
+    printf("Expected R0 to contain %d, got %d\n", 'x', guests[GUESTS]->reg[R_R0]);
+    pass = 0;
+  }
+
+  vm_sched_destroy(s);
+  for (int i = 0; i <= GUESTS; i++) {
+    fclose(files[2 * i]);
+    fclose(files[2 * i + 1]);
+    vm_destroy(guests[i]);
+  }
+
+  if (strcmp(out_buf[GUESTS], "xHALT") != 0) {
+    printf("Expected output to be \"xHALT\", got \"%s\"\n", out_buf[GUESTS]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_keyboard(struct lc3_vm *vm) {
+  int pass = 1;
+  int fds[2];
+  if (pipe(fds) != 0) {
+    printf("failed to create pipe\n");
+    return 0;
+  }
+
+  FILE *in = fdopen(fds[0], "r");
+  vm->kbd = in;
+  if (!vm_attach_keyboard(vm, 1)) {
+    printf("failed to attach keyboard\n");
+    fclose(in);
+    close(fds[1]);
+    return 0;
+  }
+
+  /* nothing typed yet */
+  mem_read(vm, MR_KBSR);
+  if (vm->memory[MR_KBSR] != 0) {
+    printf("Expected KBSR to be 0, got %d\n", vm->memory[MR_KBSR]);
+    pass = 0;
+  }
+
+  write(fds[1], "ab", 2);
+  vm->reg[R_PC] = 0x3000;
+  vm_execute_trap(vm, 0xF020, NULL, NULL);
+  if (vm->reg[R_R0] != 'a') {
+    printf("Expected R0 to contain %d, got %d\n", 'a', vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  /* the reader thread may not have queued the second key yet */
+  int polls;
+  for (polls = 0; polls < 1000000 && !(mem_read(vm, MR_KBSR) & (1 << 15)); polls++) {
+  }
+  if (vm->memory[MR_KBDR] != 'b') {
+    printf("Expected KBDR to contain %d, got %d\n", 'b', vm->memory[MR_KBDR]);
+    pass = 0;
+  }
+
+  close(fds[1]);
+  vm_execute_trap(vm, 0xF020, NULL, NULL);
+  if (vm->reg[R_R0] != (uint16_t)EOF) {
+    printf("Expected R0 to contain %d, got %d\n", (uint16_t)EOF, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  vm_keyboard_destroy(vm->keyboard);
+  vm->keyboard = NULL;
+  fclose(in);
+
+  /* a reader waiting for a key, then one waiting for room, both stop */
+  char keys[KBD_RING_SIZE + 16] = {0};
+  for (int full = 0; full < 2; full++) {
+    if (pipe(fds) != 0) {
+      printf("failed to create pipe\n");
+      return 0;
+    }
+    struct keyboard *kb = vm_keyboard_create(fds[0], 0);
+    if (full) {
+      write(fds[1], keys, sizeof(keys));
+      for (polls = 0; polls < 1000000 && atomic_load(&kb->head) != KBD_RING_SIZE; polls++) {
+        usleep(10);
+      }
+    }
+    vm_keyboard_destroy(kb);
+    close(fds[0]);
+    close(fds[1]);
+  }
+  return pass;
+}
+
+int test_output_buffering(struct lc3_vm *vm) {
+  int pass = 1;
+
+  char in_buf[] = "k";
+  char out_buf[256] = {0};
+  char buffer[64];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  vm_set_output_mode(out, buffer, sizeof(buffer), OUTPUT_BATCH);
+
+  vm->memory[0x3100] = 'h';
+  vm->memory[0x3101] = 'i';
+  vm->memory[0x3102] = 0;
+  vm->reg[R_R0] = 'o';
+  vm_execute_trap(vm, 0xF021, in, out);
+  vm->reg[R_R0] = 0x3100;
+  vm_execute_trap(vm, 0xF022, in, out);
+
+  /* OUT and PUTS leave their output in the buffer */
+  if (out_buf[0] != 0) {
+    printf("Expected output buffer to be empty, got \"%s\"\n", out_buf);
+    pass = 0;
+  }
+
+  /* and GETC pushes it out before waiting */
+  vm_execute_trap(vm, 0xF020, in, out);
+  if (strcmp(out_buf, "ohi") != 0) {
+    printf("Expected output buffer to contain \"ohi\", got \"%s\"\n", out_buf);
+    pass = 0;
+  }
+
+  vm_execute_trap(vm, 0xF021, in, out);
+  vm_execute_trap(vm, 0xF025, in, out);
+  if (strcmp(out_buf, "ohikHALT") != 0) {
+    printf("Expected output buffer to contain \"ohikHALT\", got \"%s\"\n", out_buf);
+    pass = 0;
+  }
+
+  fclose(in);
+  fclose(out);
+  return pass;
+}
+
+/* PUTS and PUTSP against a word at a time reference, for every string length
+ * up to a few SIMD chunks and for an unterminated string at the end of memory */
+int test_string_traps(struct lc3_vm *vm) {
+  int pass = 1;
+  uint32_t seed = 1;
+  size_t words = sizeof(vm->memory) / sizeof(vm->memory[0]);
+
+  for (int len = 0; len <= 40 && pass; len++) {
+    for (int packed = 0; packed <= 1; packed++) {
+      uint16_t start = len == 40 ? words - len : 0x3001 + len;
+      for (int i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint16_t w = (seed >> 8) & 0x7F7F;
+        /* mostly full pairs, sometimes an empty high byte */
+        w |= (seed & 0x10000) ? 0x0101 : 0x0001;
+        if ((seed & 0x60000) == 0) {
+          w &= 0x00FF;
+        }
+        vm->memory[start + i] = w;
+      }
+      if (start + len < words) {
+        vm->memory[start + len] = 0;
+      }
+
+      char expected[128];
+      size_t n = 0;
+      for (int i = 0; i < len; i++) {
+        expected[n++] = vm->memory[start + i] & 0xff;
+        if (packed && (vm->memory[start + i] >> 8)) {
+          expected[n++] = vm->memory[start + i] >> 8;
+        }
+      }
+
+      char out_buf[128];
+      FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+      vm->reg[R_R0] = start;
+      vm_execute_trap(vm, packed ? 0xF024 : 0xF022, NULL, out);
+      long written = ftell(out);
+      fclose(out);
+
+      if (written != (long)n || memcmp(out_buf, expected, n) != 0) {
+        printf("Expected %s of %d words to match the reference\n",
+               packed ? "PUTSP" : "PUTS", len);
+        pass = 0;
+      }
+    }
+  }
+
+  return pass;
+}
+
+int test_read_image(struct lc3_vm *vm) {
+  int pass = 1;
+  char path[] = "/tmp/lc3-image-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    printf("failed to create image file\n");
+    return 0;
+  }
+
+  /* 40 words from 0xFFF0 run off the end of memory */
+  uint16_t image[41];
+  image[0] = vm_swap16(0xFFF0);
+  for (int i = 1; i < 41; i++) {
+    image[i] = vm_swap16(0x1000 + i);
+  }
+  write(fd, image, sizeof(image));
+  close(fd);
+
+  /* mapped and read through stdio */
+  for (int mapped = 0; mapped <= 1; mapped++) {
+    vm_reset(vm);
+    if (mapped) {
+      vm_read_image(vm, path);
+    }
+    else {
+      FILE *file = fopen(path, "rb");
+      vm_read_image_file(vm, file);
+      fclose(file);
+    }
+
+    for (size_t a = 0xFFF0; a < sizeof(vm->memory) / sizeof(vm->memory[0]); a++) {
+      if (vm->memory[a] != 0x1001 + (a - 0xFFF0)) {
+        printf("Expected memory %zx to contain %zx, got %x\n", a, 0x1001 + (a - 0xFFF0), vm->memory[a]);
+        pass = 0;
+      }
+    }
+  }
+
+  unlink(path);
+  return pass;
+}
+
+/* runs vm to its HALT on engine, which has to be one of the vm_run() kind */
+void run_test_guest(struct lc3_vm *vm, struct run_result (*engine)(struct lc3_vm *, uint64_t, FILE *)) {
+  char out_buf[64];
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  while (engine(vm, UINT64_MAX, out).exit == RUN_TRAP) {
+  }
+  fclose(out);
+  vm_sync_flags(vm);
+}
+
+int test_snapshot(struct lc3_vm *vm) {
+  int pass = 1;
+
+  /* snapshot partway through, after the first pass of the self modifying loop
+   * has already patched the code */
+  load_test_program(vm, self_modifying_test_program, sizeof(self_modifying_test_program));
+  vm_run(vm, 5, NULL);
+  struct lc3_snapshot *snap = vm_snapshot(vm);
+  if (!snap) {
+    printf("failed to take snapshot\n");
+    return 0;
+  }
+
+  static uint16_t snap_memory[UINT16_MAX + 1];
+  memcpy(snap_memory, vm->memory, sizeof(vm->memory));
+
+  run_test_guest(vm, vm_jit_run);
+  static uint16_t expected_memory[UINT16_MAX + 1];
+  uint16_t expected_reg[R_COUNT];
+  memcpy(expected_memory, vm->memory, sizeof(vm->memory));
+  memcpy(expected_reg, vm->reg, sizeof(vm->reg));
+
+  /* a fresh vm on each engine and the original vm with the JIT already warm */
+  struct lc3_vm *fork = vm_create();
+  struct lc3_vm *targets[] = {fork, fork, vm};
+  struct run_result (*engines[])(struct lc3_vm *, uint64_t, FILE *) = {vm_run, vm_jit_run, vm_jit_run};
+  for (int i = 0; i < 3; i++) {
+    if (!vm_restore(targets[i], snap)) {
+      printf("failed to restore snapshot\n");
+      pass = 0;
+      continue;
+    }
+    if (memcmp(targets[i]->memory, snap_memory, sizeof(snap_memory)) != 0) {
+      printf("Expected restored memory to match the snapshot\n");
+      pass = 0;
+    }
+
+    run_test_guest(targets[i], engines[i]);
+    if (memcmp(targets[i]->reg, expected_reg, sizeof(expected_reg)) != 0 ||
+        memcmp(targets[i]->memory, expected_memory, sizeof(expected_memory)) != 0) {
+      printf("Expected run %d from the snapshot to match the original run\n", i);
+      pass = 0;
+    }
+  }
+
+  vm_destroy(fork);
+  vm_snapshot_destroy(snap);
+  return pass;
+}
+
+const uint16_t dirty_test_program[] = {
+  0x2202, /* 3000 LD R1, #2 */
+  0xB202, /* 3001 STI R1, #2 */
+  0xF025, /* 3002 HALT */
+  0x1234, /* 3003 value */
+  0x8000  /* 3004 address */
+};
+
+int test_dirty_pages(struct lc3_vm *vm) {
+  int pass = 1;
+  int program_page = PC_START >> DIRTY_PAGE_SHIFT;
+  int store_page = 0x8000 >> DIRTY_PAGE_SHIFT;
+  vm->quiet_halt = 1;
+
+  struct run_result (*engines[])(struct lc3_vm *, uint64_t, FILE *) = {
+    bench_switch_run, vm_run, vm_jit_run
+  };
+  for (int e = 0; e < 3; e++) {
+    load_test_program(vm, dirty_test_program, sizeof(dirty_test_program));
+    engines[e](vm, 100, NULL);
+    if (vm->memory[0x8000] != 0x1234 || !vm->dirty[program_page] || !vm->dirty[store_page] ||
+        vm->dirty[store_page + 1]) {
+      printf("Expected engine %d to dirty the program and the page it stored to\n", e);
+      pass = 0;
+    }
+
+    /* reset only clears dirty pages and leaves just the I/O page marked */
+    vm_reset(vm);
+    int marked = 0;
+    for (int p = 0; p < DIRTY_PAGES; p++) {
+      marked += vm->dirty[p];
+    }
+    if (vm->memory[0x8000] != 0 || vm->memory[PC_START] != 0 || vm->code_map[PC_START] != 0 ||
+        vm->decode_cache[PC_START].valid || marked != DEVICE_PAGE_SIZE / DIRTY_PAGE_WORDS) {
+      printf("Expected reset to clear the pages engine %d touched\n", e);
+      pass = 0;
+    }
+  }
+
+  /* a snapshot brings its dirty pages with it */
+  load_test_program(vm, dirty_test_program, sizeof(dirty_test_program));
+  vm_run(vm, 100, NULL);
+  struct lc3_snapshot *snap = vm_snapshot(vm);
+  struct lc3_vm *fork = vm_create();
+  if (!snap || !fork || !vm_restore(fork, snap)) {
+    printf("failed to restore snapshot\n");
+    pass = 0;
+  }
+  else if (fork->memory[0x8000] != 0x1234 || !fork->dirty[store_page] ||
+           memcmp(fork->memory, vm->memory, sizeof(vm->memory)) != 0) {
+    printf("Expected the restored vm to have the dirty pages of the snapshot\n");
+    pass = 0;
+  }
+  vm_destroy(fork);
+  vm_snapshot_destroy(snap);
+  return pass;
+}
+
+/* host pages of decode_cache[] that have been faulted in */
+int resident_decode_pages(struct lc3_vm *vm) {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)vm->decode_cache / page * page;
+  size_t len = (uintptr_t)(vm->decode_cache + UINT16_MAX + 1) - start;
+  size_t pages = (len + page - 1) / page;
+  unsigned char *resident = malloc(pages);
+  int count = 0;
+  if (resident && mincore((void *)start, len, resident) == 0) {
+    for (size_t i = 0; i < pages; i++) {
+      count += resident[i] & 1;
+    }
+  }
+  free(resident);
+  return count;
+}
+
+int test_load_pages(struct lc3_vm *vm) {
+  int pass = 1;
+  /* 0x3000: ADD R1, R1, #n then HALT, as an image */
+  uint8_t image[] = {0x30, 0x00, 0x12, 0x61, 0xF0, 0x25};
+  struct lc3_vm *fresh = lc3_create();
+  if (!fresh) {
+    printf("failed to create vm\n");
+    return 0;
+  }
+  fresh->quiet_halt = 1;
+
+  /* loading, running and resetting a fresh vm only faults in the decode
+   * pages of the program, not the whole cache */
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  lc3_load(fresh, image, sizeof(image));
+  struct lc3_result result = lc3_run(fresh, LC3_ENGINE_THREADED, 10);
+  lc3_reset(fresh);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int resident = resident_decode_pages(fresh);
+  if (result.exit != LC3_HALTED || result.retired != 2 || resident > 4) {
+    printf("Expected load, run and reset to touch a few decode pages, got %d in %ld ns\n", resident,
+           (long)((end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec));
+    pass = 0;
+  }
+
+  /* loading over decoded code without a reset runs the new code */
+  lc3_load(fresh, image, sizeof(image));
+  lc3_run(fresh, LC3_ENGINE_THREADED, 10);
+  image[3] = 0x62; /* ADD R1, R1, #2 */
+  lc3_load(fresh, image, sizeof(image));
+  lc3_set_reg(fresh, LC3_PC, 0x3000);
+  lc3_run(fresh, LC3_ENGINE_THREADED, 10);
+  if (lc3_reg(fresh, LC3_R1) != 3) {
+    printf("Expected the reloaded program to add 2, got R1 %d\n", lc3_reg(fresh, LC3_R1));
+    pass = 0;
+  }
+
+  lc3_destroy(fresh);
+  return pass;
+}
+
+/* the last word of memory is a word like any other */
+int test_memory_top(struct lc3_vm *vm) {
+  int pass = 1;
+
+  mem_write(vm, 0xFFFF, 0x1234);
+  if (mem_read(vm, 0xFFFF) != 0x1234) {
+    printf("Expected memory 0xFFFF to contain %d, got %d\n", 0x1234, mem_read(vm, 0xFFFF));
+    pass = 0;
+  }
+
+  if (vm->code_map[0] != 0) {
+    printf("Expected code_map to be untouched, got %d\n", vm->code_map[0]);
+    pass = 0;
+  }
+
+  /* and guest loads reach it */
+  vm->reg[R_R1] = 0xFFFE;
+  uint16_t ldr_instr = (OP_LDR << 12) | (R_R0 << 9) | (R_R1 << 6) | 0x1;
+  vm->memory[PC_START] = ldr_instr;
+  vm_read_and_execute_instruction(vm);
+  if (vm->reg[R_R0] != 0x1234) {
+    printf("Expected R0 to contain %d, got %d\n", 0x1234, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+/* prints through DDR, then stops the clock through MCR */
+uint16_t device_test_program[] = {
+  0x2006, /* 3000 LD R0, #6 (0x3007) */
+  0xB006, /* 3001 STI R0, #6 (0x3008) */
+  0x2006, /* 3002 LD R0, #6 (0x3009) */
+  0xB004, /* 3003 STI R0, #4 (0x3008) */
+  0x5020, /* 3004 AND R0, R0, #0 */
+  0xB004, /* 3005 STI R0, #4 (0x300A) */
+  0xF025, /* 3006 HALT */
+  0x0068, /* 3007 'h' */
+  0xFE06, /* 3008 DDR */
+  0x0069, /* 3009 'i' */
+  0xFFFE  /* 300A MCR */
+};
+
+int test_devices(struct lc3_vm *vm) {
+  int pass = 1;
+
+  /* the reference core, the threaded core and the JIT */
+  for (int engine = 0; engine < 3; engine++) {
+    load_test_program(vm, device_test_program, sizeof(device_test_program));
+    char out_buf[64] = {0};
+    FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+    vm->display = out;
+
+    int halted;
+    if (engine == 0) {
+      while (vm_read_and_execute_instruction(vm)) {
+      }
+      halted = 1;
+    }
+    else {
+      struct run_result result = (engine == 1 ? vm_run : vm_jit_run)(vm, 1000, out);
+      halted = result.exit == RUN_HALTED && result.retired == 6;
+    }
+    vm_flush_output(vm);
+    fclose(out);
+    vm->display = stdout;
+
+    if (!halted || vm->reg[R_PC] != 0x3006 || vm->memory[MR_MCR] != 0 || vm->stop != STOP_MCR) {
+      printf("Expected engine %d to stop at 0x3006, got 0x%x\n", engine, vm->reg[R_PC]);
+      pass = 0;
+    }
+    if (strcmp(out_buf, "hi") != 0) {
+      printf("Expected output buffer to contain \"hi\", got \"%s\"\n", out_buf);
+      pass = 0;
+    }
+  }
+
+  if (mem_read(vm, MR_DSR) != (1 << 15)) {
+    printf("Expected DSR to be ready, got %d\n", mem_read(vm, MR_DSR));
+    pass = 0;
+  }
+
+  /* a 50ms timer has not gone off right away, but has after 60ms */
+  mem_write(vm, MR_TMI, 50);
+  uint16_t before = mem_read(vm, MR_TMR);
+  usleep(60000);
+  uint16_t after = mem_read(vm, MR_TMR);
+  uint16_t again = mem_read(vm, MR_TMR);
+  if (before != 0 || after != (1 << 15) || again != 0) {
+    printf("Expected timer to read 0, %d, 0, got %d, %d, %d\n", 1 << 15, before, after, again);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_bulk_traps(struct lc3_vm *vm) {
+  int pass = 1;
+
+  char in_buf[] = "hello\nworld";
+  char out_buf[64] = {0};
+  FILE *in = fmemopen(in_buf, strlen(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  if (!vm_trap_needs_input(0xF000 | TRAP_READLINE) || !vm_trap_needs_input(0xF000 | TRAP_READ) ||
+      vm_trap_needs_input(0xF000 | TRAP_WRITE)) {
+    printf("Expected only the reading traps to need input\n");
+    pass = 0;
+  }
+
+  /* a line with its newline, then the rest of the input in one block */
+  vm->reg[R_R0] = 0x4000;
+  vm->reg[R_R1] = 16;
+  vm_execute_trap(vm, 0xF000 | TRAP_READLINE, in, out);
+  if (vm->reg[R_R0] != 6 || vm->memory[0x4000] != 'h' || vm->memory[0x4005] != '\n' ||
+      vm->memory[0x4006] != 0) {
+    printf("Expected READLINE to read \"hello\\n\", got %d characters\n", vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  vm->reg[R_R0] = 0x4010;
+  vm->reg[R_R1] = 100;
+  vm_execute_trap(vm, 0xF000 | TRAP_READ, in, out);
+  if (vm->reg[R_R0] != 5 || vm->memory[0x4010] != 'w' || vm->memory[0x4014] != 'd') {
+    printf("Expected READ to read \"world\", got %d characters\n", vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  /* memset, then an overlapping copy of "hello" one word up */
+  vm->reg[R_R0] = 0x4020;
+  vm->reg[R_R1] = '.';
+  vm->reg[R_R2] = 8;
+  vm_execute_trap(vm, 0xF000 | TRAP_MEMSET, in, out);
+  vm->reg[R_R0] = 0x4001;
+  vm->reg[R_R1] = 0x4000;
+  vm->reg[R_R2] = 5;
+  vm_execute_trap(vm, 0xF000 | TRAP_MEMCPY, in, out);
+
+  vm->reg[R_R0] = 0x4000;
+  vm->reg[R_R1] = 6;
+  vm_execute_trap(vm, 0xF000 | TRAP_WRITE, in, out);
+  vm->reg[R_R0] = 0x4020;
+  vm->reg[R_R1] = 8;
+  vm_execute_trap(vm, 0xF000 | TRAP_WRITE, in, out);
+  fclose(in);
+  fclose(out);
+
+  if (strcmp(out_buf, "hhello........") != 0) {
+    printf("Expected output buffer to contain \"hhello........\", got \"%s\"\n", out_buf);
+    pass = 0;
+  }
+
+  /* and one down, which copies forward */
+  const uint16_t words[] = {1, 2, 3, 4, 5};
+  for (int i = 0; i < 5; i++) {
+    vm->memory[0x5000 + i] = words[i];
+  }
+  vm->reg[R_R0] = 0x4FFF;
+  vm->reg[R_R1] = 0x5000;
+  vm->reg[R_R2] = 4;
+  vm_execute_trap(vm, 0xF000 | TRAP_MEMCPY, NULL, NULL);
+  if (vm->memory[0x4FFF] != 1 || vm->memory[0x5000] != 2 || vm->memory[0x5002] != 4) {
+    printf("Expected a copy one word down to keep its source\n");
+    pass = 0;
+  }
+
+  return pass;
+}
+
+/* the benchmark kernels do the same work on every engine */
+int test_bench_kernels(struct lc3_vm *vm) {
+  int pass = 1;
+  const uint16_t *programs[] = {bench_add_kernel, bench_branch_kernel, bench_memory_kernel, bench_call_kernel};
+  size_t sizes[] = {sizeof(bench_add_kernel), sizeof(bench_branch_kernel),
+                    sizeof(bench_memory_kernel), sizeof(bench_call_kernel)};
+  struct run_result (*engines[])(struct lc3_vm *, uint64_t, FILE *) = {vm_run, vm_jit_run};
+
+  for (int k = 0; k < 4; k++) {
+    load_test_program(vm, programs[k], sizes[k]);
+    bench_switch_run(vm, 10007, NULL);
+    vm_sync_flags(vm);
+    static uint16_t expected_memory[UINT16_MAX + 1];
+    uint16_t expected_reg[R_COUNT];
+    memcpy(expected_memory, vm->memory, sizeof(vm->memory));
+    memcpy(expected_reg, vm->reg, sizeof(vm->reg));
+
+    for (int e = 0; e < 2; e++) {
+      load_test_program(vm, programs[k], sizes[k]);
+      struct run_result result = engines[e](vm, 10007, NULL);
+      if (result.retired != 10007 ||
+          memcmp(vm->reg, expected_reg, sizeof(expected_reg)) != 0 ||
+          memcmp(vm->memory, expected_memory, sizeof(expected_memory)) != 0) {
+        printf("Expected kernel %d on engine %d to match the reference run\n", k, e);
+        pass = 0;
+      }
+    }
+  }
+
+  return pass;
+}
+
+int test_profile(struct lc3_vm *vm) {
+  int pass = 1;
+  if (!PROFILING) {
+    return pass;
+  }
+
+  load_test_program(vm, engine_test_program, sizeof(engine_test_program));
+  if (!vm_attach_profile(vm)) {
+    printf("failed to attach profile\n");
+    return 0;
+  }
+
+  /* the reference core prints its HALT to the display */
+  char out_buf[64];
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  vm->display = out;
+  uint64_t retired = 0;
+  while (vm_read_and_execute_instruction(vm)) {
+    retired++;
+  }
+  retired++;
+  vm->display = stdout;
+  fclose(out);
+
+  struct profile *p = vm->profile;
+  char *csv;
+  size_t csv_len;
+  FILE *f = open_memstream(&csv, &csv_len);
+  vm_write_profile(vm, f, 1);
+  fclose(f);
+
+  uint64_t ops = 0;
+  uint64_t blocks = 0;
+  for (int i = 0; i < 16; i++) {
+    ops += p->ops[i];
+  }
+  for (int i = 0; i <= UINT16_MAX; i++) {
+    blocks += p->block_retired[i];
+    if (p->ops[OP_BR] && p->taken[i] + p->not_taken[i] != (vm->memory[i] >> 12 == OP_BR ? p->pcs[i] : 0)) {
+      printf("Expected every BR at 0x%x to be taken or not\n", i);
+      pass = 0;
+    }
+  }
+
+  if (p->retired != retired || ops != retired || blocks != retired) {
+    printf("Expected %d retired instructions, got %d, %d by opcode, %d by block\n",
+           (int)retired, (int)p->retired, (int)ops, (int)blocks);
+    pass = 0;
+  }
+
+  if (p->traps[TRAP_HALT] != 1) {
+    printf("Expected one HALT, got %d\n", (int)p->traps[TRAP_HALT]);
+    pass = 0;
+  }
+
+  char expected[64];
+  snprintf(expected, sizeof(expected), "retired,,%d,\n", (int)retired);
+  if (!strstr(csv, expected)) {
+    printf("Expected the CSV profile to contain %s", expected);
+    pass = 0;
+  }
+  free(csv);
+
+  return pass;
+}
+
+/* branches into the middle of the constant load at 0x3000 */
+uint16_t fused_jump_test_program[] = {
+  0x5260, /* 3000 AND R1, R1, #0 */
+  0x1265, /* 3001 ADD R1, R1, #5 */
+  0x14A1, /* 3002 ADD R2, R2, #1 */
+  0x16BE, /* 3003 ADD R3, R2, #-2 */
+  0x09FC, /* 3004 BRn #-4 (0x3001) */
+  0xF025  /* 3005 HALT */
+};
+
+/* patches the ADD of the constant load at 0x3000 on the first pass */
+uint16_t fused_patch_test_program[] = {
+  0x5260, /* 3000 AND R1, R1, #0 */
+  0x1261, /* 3001 ADD R1, R1, #1 */
+  0x2805, /* 3002 LD R4, #5 (0x3008) */
+  0x39FD, /* 3003 ST R4, #-3 (0x3001) */
+  0x14A1, /* 3004 ADD R2, R2, #1 */
+  0x16BE, /* 3005 ADD R3, R2, #-2 */
+  0x09F9, /* 3006 BRn #-7 (0x3000) */
+  0xF025, /* 3007 HALT */
+  0x1263  /* 3008 ADD R1, R1, #3 */
+};
+
+int test_superinstructions(struct lc3_vm *vm) {
+  int pass = check_engine(vm, vm_run_threaded, fused_jump_test_program,
+                          sizeof(fused_jump_test_program), 0x3005) &&
+             check_engine(vm, vm_run_threaded, fused_patch_test_program,
+                          sizeof(fused_patch_test_program), 0x3007);
+
+  /* the loads really were fused */
+  load_test_program(vm, fused_patch_test_program, sizeof(fused_patch_test_program));
+  vm_run(vm, 2, NULL);
+  int const_exec = vm->decode_cache[0x3000].exec;
+  vm_run(vm, 4, NULL);
+  if (const_exec != EXEC_CONST || vm->decode_cache[0x3005].exec != EXEC_ADD_BR) {
+    printf("Expected 0x3000 and 0x3005 to be fused, got %d and %d\n",
+           const_exec, vm->decode_cache[0x3005].exec);
+    pass = 0;
+  }
+
+  /* one instruction at a time never runs a whole sequence */
+  char out_buf[16];
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  load_test_program(vm, fused_patch_test_program, sizeof(fused_patch_test_program));
+  while (vm_run(vm, 1, out).exit == RUN_BUDGET) {
+  }
+  fclose(out);
+  if (vm->reg[R_R1] != 3 || vm->reg[R_PC] != 0x3008) {
+    printf("Expected R1 to contain 3 at 0x3008, got %d at 0x%x\n", vm->reg[R_R1], vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+/* waits on KBSR, then reads KBDR into R1 */
+uint16_t kbsr_test_program[] = {
+  0xA003, /* 3000 LDI R0, #3 (KBSR) */
+  0x07FE, /* 3001 BRzp #-2 */
+  0xA202, /* 3002 LDI R1, #2 (KBDR) */
+  0xF025, /* 3003 HALT */
+  0xFE00,
+  0xFE02
+};
+
+/* runs the reference core up to the HALT counting for the input log, a key
+ * goes into fd after 20 instructions */
+uint64_t run_logged(struct lc3_vm *vm, int fd) {
+  uint64_t steps = 0;
+  vm->input_log->counted = 1;
+  while (vm->reg[R_PC] != 0x3003 && steps < 100000) {
+    if (++steps == 20 && fd >= 0) {
+      write(fd, "q", 1);
+    }
+    vm->input_log->retired++;
+    vm_read_and_execute_instruction(vm);
+  }
+  return steps;
+}
+
+int test_input_log(struct lc3_vm *vm) {
+  int pass = 1;
+  int fds[2];
+  FILE *log = tmpfile();
+  if (!log || pipe(fds) != 0) {
+    printf("failed to create input log\n");
+    return 0;
+  }
+  FILE *kbd = fdopen(fds[0], "r");
+  char in_buf[] = {'z'};
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+
+  /* record a KBSR spin and two GETCs, the second at end of input */
+  load_test_program(vm, kbsr_test_program, sizeof(kbsr_test_program));
+  vm->kbd = kbd;
+  vm_attach_input_log(vm, log, INPUT_RECORD);
+  uint64_t recorded = run_logged(vm, fds[1]);
+  vm_execute_trap(vm, 0xF020, in, NULL);
+  vm_execute_trap(vm, 0xF020, in, NULL);
+  if (vm->reg[R_R1] != 'q' || vm->input_log->events != 3) {
+    printf("Expected R1 to contain %d after 3 events, got %d after %llu\n", 'q',
+           vm->reg[R_R1], (unsigned long long)vm->input_log->events);
+    pass = 0;
+  }
+  vm_input_log_destroy(vm->input_log);
+  vm->input_log = NULL;
+  vm->kbd = stdin;
+  fclose(in);
+  fclose(kbd);
+  close(fds[1]);
+
+  /* replaying makes the guest spin just as long, then runs dry like EOF */
+  for (int mode = INPUT_REPLAY; mode <= INPUT_REPLAY_SKIP; mode++) {
+    rewind(log);
+    load_test_program(vm, kbsr_test_program, sizeof(kbsr_test_program));
+    vm_attach_input_log(vm, log, mode);
+    uint64_t steps = run_logged(vm, -1);
+    uint64_t expected = mode == INPUT_REPLAY ? recorded : 3;
+    if (steps != expected || vm->reg[R_R1] != 'q') {
+      printf("Expected R1 to contain %d after %llu steps, got %d after %llu\n", 'q',
+             (unsigned long long)expected, vm->reg[R_R1], (unsigned long long)steps);
+      pass = 0;
+    }
+
+    uint16_t chars[3];
+    for (int i = 0; i < 3; i++) {
+      vm_execute_trap(vm, 0xF020, NULL, NULL);
+      chars[i] = vm->reg[R_R0];
+    }
+    if (chars[0] != 'z' || chars[1] != 0xFFFF || chars[2] != 0xFFFF ||
+        mem_read(vm, MR_KBSR) != (1 << 15) || vm->memory[MR_KBDR] != 0xFFFF) {
+      printf("Expected z and EOF from the replay, got %d %d %d\n", chars[0], chars[1], chars[2]);
+      pass = 0;
+    }
+    if (vm->input_log->diverged) {
+      printf("Expected the replay to match, diverged at %llu\n",
+             (unsigned long long)vm->input_log->diverged);
+      pass = 0;
+    }
+  }
+
+  /* a guest that asks for input in a different order is caught */
+  rewind(log);
+  vm_attach_input_log(vm, log, INPUT_REPLAY);
+  vm_execute_trap(vm, 0xF020, NULL, NULL);
+  if (vm->input_log->diverged != 1) {
+    printf("Expected the replay to diverge at event 1, got %llu\n",
+           (unsigned long long)vm->input_log->diverged);
+    pass = 0;
+  }
+
+  vm_input_log_destroy(vm->input_log);
+  vm->input_log = NULL;
+  fclose(log);
+  return pass;
+}
+
+/* two countdowns, the second one overshoots zero */
+uint16_t countdown_test_program[] = {
+  0x2206, /* 3000 LD R1, #6 (1000) */
+  0x127F, /* 3001 ADD R1, R1, #-1 */
+  0x03FE, /* 3002 BRp #-2 */
+  0x2404, /* 3003 LD R2, #4 (10) */
+  0x14BD, /* 3004 ADD R2, R2, #-3 */
+  0x03FE, /* 3005 BRp #-2 */
+  0xF025, /* 3006 HALT */
+  1000,
+  10
+};
+
+int test_idle_loops(struct lc3_vm *vm) {
+  int pass = 1;
+  vm->quiet_halt = 1;
+
+  /* a countdown retires every round whatever the budget is cut into */
+  const uint64_t budgets[] = {UINT64_MAX, 1, 2, 7, 101};
+  for (int i = 0; i < 5; i++) {
+    load_test_program(vm, countdown_test_program, sizeof(countdown_test_program));
+    uint64_t retired = 0;
+    struct run_result result;
+    do {
+      result = vm_run(vm, budgets[i], NULL);
+      retired += result.retired;
+    } while (result.exit == RUN_BUDGET);
+    if (retired != 2011 || vm->reg[R_R1] != 0 || vm->reg[R_R2] != (uint16_t)-2 ||
+        vm->reg[R_COND] != FL_NEG || vm->decode_cache[0x3001].exec != EXEC_COUNTDOWN) {
+      printf("Expected 2011 instructions to leave R1 0 and R2 -2 in budgets of %llu, "
+             "got %llu with %d and %d\n", (unsigned long long)budgets[i],
+             (unsigned long long)retired, vm->reg[R_R1], (int16_t)vm->reg[R_R2]);
+      pass = 0;
+    }
+  }
+
+  /* with no keyboard at all a KBSR spin goes through its budget at once */
+  load_test_program(vm, kbsr_test_program, sizeof(kbsr_test_program));
+  vm->kbd = NULL;
+  vm->kbd_empty_polls = 0;
+  struct run_result result = vm_run(vm, 1001, NULL);
+  if (result.retired != 1001 || vm->reg[R_PC] != 0x3001 || vm->kbd_empty_polls != 501 ||
+      vm->decode_cache[0x3000].exec != EXEC_KBSR_SPIN) {
+    printf("Expected 501 empty polls stopping at 0x3001, got %u at 0x%x\n",
+           vm->kbd_empty_polls, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  /* under the scheduler it hands the guest back to be parked, and picks up
+   * the key later */
+  int fds[2];
+  if (pipe(fds) != 0) {
+    printf("failed to create pipe\n");
+    return 0;
+  }
+  FILE *kbd = fdopen(fds[0], "r");
+  load_test_program(vm, kbsr_test_program, sizeof(kbsr_test_program));
+  vm->kbd = kbd;
+  vm->spin_yield = 1;
+  vm->spun = 0;
+  vm->kbd_empty_polls = 0;
+  vm->reg[R_R0] = 0x1234;
+  result = vm_run(vm, 1000, NULL);
+  if (result.exit != RUN_BUDGET || result.retired != 2 || vm->reg[R_PC] != 0x3000 ||
+      vm->reg[R_R0] != 0 || vm->reg[R_COND] != FL_ZRO || !vm->spun ||
+      vm->kbd_empty_polls != 1) {
+    printf("Expected the spin to yield at 0x3000 after one poll, got %llu instructions "
+           "at 0x%x with %u polls\n", (unsigned long long)result.retired, vm->reg[R_PC],
+           vm->kbd_empty_polls);
+    pass = 0;
+  }
+  write(fds[1], "k", 1);
+  result = vm_run(vm, 1000, NULL);
+  if (result.exit != RUN_HALTED || result.retired != 4 || vm->reg[R_R1] != 'k') {
+    printf("Expected the key to end the spin, got R1 %d\n", vm->reg[R_R1]);
+    pass = 0;
+  }
+  vm->kbd = stdin;
+  fclose(kbd);
+  close(fds[1]);
+
+  return pass;
+}
+
+/* stores R1 = 5 at 0x3005, the AND and ADD are fused */
+uint16_t debug_test_program[] = {
+  0x5260, /* 3000 AND R1, R1, #0 */
+  0x1265, /* 3001 ADD R1, R1, #5 */
+  0x3202, /* 3002 ST R1, #2 (0x3005) */
+  0x1461, /* 3003 ADD R2, R1, #1 */
+  0xF025, /* 3004 HALT */
+  0x0000
+};
+
+int test_debugger(struct lc3_vm *vm) {
+  int pass = 1;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    printf("failed to create socket pair\n");
+    return 0;
+  }
+  load_test_program(vm, debug_test_program, sizeof(debug_test_program));
+  vm->quiet_halt = 1;
+  vm_attach_debugger(vm, fds[0]);
+
+  /* a whole session, queued up front */
+  const char *session[][2] = {
+    {"qSupported:swbreak+", "PacketSize=1000;QStartNoAckMode+"},
+    {"?", "S05"},
+    {"Z0,3001,1", "OK"},
+    {"Z2,3005,1", "OK"},
+    {"c", "S05"},          /* in the middle of the fused pair */
+    {"p8", "3001"},
+    {"p1", "0000"},
+    {"c", "T05watch:3005;"}, /* right after the ST */
+    {"p8", "3003"},
+    {"m3005,1", "0005"},
+    {"M3006,1", "E01"},             /* no data */
+    {"Mffff,2:00010002", "E01"},    /* past the top of memory */
+    {"P2=0007", "OK"},
+    {"s", "S05"},
+    {"g", "0000000500060000000000000000000030048001"}, /* user mode, P */
+    {"Z0,fe00,1", "E01"},
+    {"c", "W00"}
+  };
+  const int count = sizeof(session) / sizeof(session[0]);
+  struct debugger client = {fds[1], 1, 0, 0, {0}};
+  for (int i = 0; i < count; i++) {
+    vm_debug_send(&client, session[i][0]);
+  }
+
+  if (vm_debug_serve(vm) != 0) {
+    printf("Expected the session to end with the guest\n");
+    pass = 0;
+  }
+  for (int i = 0; i < count; i++) {
+    const char *expected = session[i][1];
+    int len = vm_debug_receive(&client);
+    if (len < 0 || strcmp(client.packet, expected) != 0) {
+      printf("Expected %s to get %s, got %s\n", session[i][0], expected, len < 0 ? "nothing" : client.packet);
+      pass = 0;
+      break;
+    }
+  }
+
+  /* breakpoints cost nothing once gone */
+  vm_debug_set_break(vm, 0x3001, 0);
+  load_test_program(vm, debug_test_program, sizeof(debug_test_program));
+  struct run_result result = vm_run(vm, 10, NULL);
+  if (result.exit != RUN_HALTED || vm->decode_cache[0x3000].exec != EXEC_CONST) {
+    printf("Expected the program to run through once the breakpoint is cleared\n");
+    pass = 0;
+  }
+
+  /* the engines step over a breakpoint nobody is attached for */
+  struct debugger *dbg = vm->debug;
+  vm->debug = NULL;
+  load_test_program(vm, debug_test_program, sizeof(debug_test_program));
+  vm_debug_set_break(vm, 0x3002, 1);
+  vm_run_threaded(vm, vm->kbd, vm->display);
+  load_test_program(vm, debug_test_program, sizeof(debug_test_program));
+  vm_debug_set_break(vm, 0x3002, 1);
+  struct lc3_result lib_result = lc3_run(vm, LC3_ENGINE_THREADED, 100);
+  if (lib_result.exit != LC3_HALTED || lib_result.retired != 5 || vm->memory[0x3005] != 5) {
+    printf("Expected the run to go past a breakpoint without a debugger\n");
+    pass = 0;
+  }
+  vm->debug = dbg;
+
+  /* marks on pages nothing wrote to go with a reset too */
+  vm_debug_set_break(vm, 0x5000, 1);
+  vm_debug_set_watch(vm, 0x6000, 2, 1);
+  vm_reset(vm);
+  if (vm->code_map[0x5000] || vm->code_map[0x6000] || vm->code_map[0x6001]) {
+    printf("Expected a reset to clear breakpoints and watchpoints\n");
+    pass = 0;
+  }
+
+  vm_debug_destroy(vm->debug);
+  vm->debug = NULL;
+  close(fds[1]);
+  return pass;
+}
+
+/* stores each round of a long countdown, the trace runs over several chunks */
+uint16_t trace_test_program[] = {
+  0x2205, /* 3000 LD R1, #5 (30000) */
+  0x3205, /* 3001 ST R1, #5 (0x3007) */
+  0x127F, /* 3002 ADD R1, R1, #-1 */
+  0x03FD, /* 3003 BRp #-3 */
+  0xF025, /* 3004 HALT */
+  0x0000,
+  30000,
+  0x0000
+};
+
+int test_trace(struct lc3_vm *vm) {
+  int pass = 1;
+  if (!TRACING) {
+    return pass;
+  }
+
+  FILE *f = tmpfile();
+  vm->quiet_halt = 1;
+  if (!f || !vm_attach_trace(vm, f)) {
+    printf("failed to attach trace\n");
+    return 0;
+  }
+  /* loading resets the vm, the trace carries on through it */
+  load_test_program(vm, trace_test_program, sizeof(trace_test_program));
+  while (vm_read_and_execute_instruction(vm)) {
+  }
+  vm_detach_trace(vm);
+
+  /* LD, then ST, ADD and BR each round, then HALT */
+  rewind(f);
+  struct trace_reader *r = vm_trace_open(f);
+  struct trace_record rec;
+  const uint16_t pcs[] = {0x3001, 0x3002, 0x3003};
+  uint64_t count = 0;
+  int status;
+  while (r && pass && (status = vm_trace_next(r, &rec)) == 1) {
+    uint16_t round = count ? (count - 1) / 3 : 0;
+    uint16_t pc = count == 0 ? 0x3000 : count == 90001 ? 0x3004 : pcs[(count - 1) % 3];
+    if (rec.index != count || rec.pc != pc || rec.instr != vm->memory[pc]) {
+      printf("Expected record %llu at 0x%x, got %llu at 0x%x\n", (unsigned long long)count, pc,
+             (unsigned long long)rec.index, rec.pc);
+      pass = 0;
+    }
+    /* the ST writes the round's R1, the ADD is the only change to it */
+    int store = pc == 0x3001;
+    if (rec.write_count != (uint32_t)store ||
+        (store && (rec.writes[0][0] != 0x3007 || rec.writes[0][1] != 30000 - round))) {
+      printf("Expected record %llu to write %d words, got %u\n", (unsigned long long)count, store,
+             rec.write_count);
+      pass = 0;
+    }
+    if ((pc == 0x3002) != (rec.changed == 1 << R_R1 && rec.reg[R_R1] == 29999 - round)) {
+      printf("Expected record %llu to change R1 only on the ADD, got mask %x\n",
+             (unsigned long long)count, rec.changed);
+      pass = 0;
+    }
+    count++;
+  }
+  if (!r || (pass && (status != 0 || count != 90002 || rec.reg[R_R1] != 0 || rec.cond != FL_ZRO))) {
+    printf("Expected the trace to read back 90002 instructions, got %llu\n", (unsigned long long)count);
+    pass = 0;
+  }
+  vm_trace_reader_destroy(r);
+
+  /* a cut off trace is corrupt, not short */
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  char *buf = malloc(size);
+  size = fread(buf, 1, size, f);
+  FILE *cut = fmemopen(buf, size - 1, "rb");
+  r = cut ? vm_trace_open(cut) : NULL;
+  while (r && (status = vm_trace_next(r, &rec)) == 1) {
+  }
+  if (!r || status != -1) {
+    printf("Expected a truncated trace to be reported as corrupt\n");
+    pass = 0;
+  }
+  vm_trace_reader_destroy(r);
+  if (cut) {
+    fclose(cut);
+  }
+  free(buf);
+  fclose(f);
+
+  return pass;
+}
+
+/* reads KBSR through a pointer */
+uint16_t core_test_program[] = {
+  0xA202, /* 3000 LDI R1, #2 (KBSR) */
+  0x14A1, /* 3001 ADD R2, R2, #1 */
+  0xF025, /* 3002 HALT */
+  0xFE00
+};
+
+int test_core_variants(struct lc3_vm *vm) {
+  int pass = 1;
+  vm->quiet_halt = 1;
+  vm->kbd = NULL;
+
+  /* without MMIO the I/O page is memory like any other, KBSR isn't polled */
+  for (int plain = 0; plain < 2; plain++) {
+    load_test_program(vm, core_test_program, sizeof(core_test_program));
+    vm->plain_memory = plain;
+    vm->kbd_empty_polls = 0;
+    unsigned features = vm_core_features(vm);
+    struct run_result result = vm_core_loops[features](vm, 2);
+    if (features != (plain ? 0 : CORE_MMIO) || result.exit != RUN_BUDGET || result.retired != 2 ||
+        vm->reg[R_R2] != 1 || vm->kbd_empty_polls != (uint32_t)!plain) {
+      printf("Expected KBSR to read %s, got %u polls\n", plain ? "as memory" : "from the device",
+             vm->kbd_empty_polls);
+      pass = 0;
+    }
+  }
+  vm->plain_memory = 0;
+
+  /* a PC that wraps only stops the guest when asked to */
+  char out_buf[64];
+  for (int check = 0; check < 2; check++) {
+    FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+    vm->display = out;
+    vm_reset(vm);
+    vm->memory[UINT16_MAX] = 0x14A1; /* ADD R2, R2, #1 */
+    vm->memory[0] = 0xF025;          /* HALT */
+    vm_mark_dirty(vm, 0, 1);
+    vm_mark_dirty(vm, UINT16_MAX, 1);
+    vm->reg[R_PC] = UINT16_MAX;
+    vm->check_overflow = check;
+    struct run_result result = vm_core_loops[vm_core_features(vm)](vm, 10);
+    fclose(out);
+    if (result.exit != RUN_HALTED || result.retired != (uint64_t)(check ? 1 : 2) || vm->reg[R_R2] != 1 ||
+        (strcmp(out_buf, "Program counter overflow!") == 0) != check ||
+        vm->stop != (check ? STOP_OVERFLOW : STOP_HALT)) {
+      printf("Expected the wrap to %s the guest, got %llu instructions\n", check ? "stop" : "not stop",
+             (unsigned long long)result.retired);
+      pass = 0;
+    }
+  }
+  vm->check_overflow = 0;
+  vm->display = stdout;
+  vm->kbd = stdin;
+
+  return pass;
+}
+
+int test_batch_io(struct lc3_vm *vm) {
+  int pass = 1;
+  int fds[2];
+  if (pipe(fds) != 0) {
+    printf("failed to create pipe\n");
+    return 0;
+  }
+  write(fds[1], "k", 1);
+  close(fds[1]);
+  FILE *in = fdopen(fds[0], "r");
+  vm->kbd = in;
+  vm->kbd_blocking = 1;
+  vm->quiet_halt = 1;
+
+  /* every KBSR read has a key, the last one is EOF */
+  uint16_t first = mem_read(vm, MR_KBSR);
+  uint16_t key = mem_read(vm, MR_KBDR);
+  uint16_t second = mem_read(vm, MR_KBSR);
+  if (first != (1 << 15) || key != 'k' || second != (1 << 15) || vm->memory[MR_KBDR] != 0xFFFF) {
+    printf("Expected k then EOF from KBDR, got %d then %d\n", key, vm->memory[MR_KBDR]);
+    pass = 0;
+  }
+  vm->kbd = stdin;
+  fclose(in);
+
+  char out_buf[16] = {0};
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  int result = vm_execute_trap(vm, 0xF025, NULL, out);
+  fclose(out);
+  if (result != 0 || out_buf[0] != 0 || vm->stop != STOP_HALT) {
+    printf("Expected a silent HALT, got %d and \"%s\"\n", result, out_buf);
+    pass = 0;
+  }
+
+  /* GETC at end of input stops the guest instead of handing it 0xFFFF */
+  vm->eof_stops = 1;
+  vm->stop = STOP_NONE;
+  vm->reg[R_R0] = 0x1234;
+  in = fmemopen(out_buf, 1, "r");
+  fgetc(in);
+  result = vm_execute_trap(vm, 0xF000 | TRAP_GETC, in, NULL);
+  fclose(in);
+  vm->eof_stops = 0;
+  if (result != 0 || vm->stop != STOP_EOF || vm->reg[R_R0] != 0x1234) {
+    printf("Expected GETC to stop at end of input, got %d with stop %d\n", result, vm->stop);
+    pass = 0;
+  }
+
+  /* the IN prompt stays buffered, nothing waits on it */
+  char prompt_buf[32] = {0};
+  char key_buf[] = "x";
+  in = fmemopen(key_buf, 1, "r");
+  out = fmemopen(prompt_buf, sizeof(prompt_buf), "w");
+  vm_execute_trap(vm, 0xF000 | TRAP_IN, in, out);
+  int flushed = prompt_buf[0] != 0;
+  fclose(out);
+  fclose(in);
+  if (flushed || vm->reg[R_R0] != 'x' || strcmp(prompt_buf, "Enter a character: x") != 0) {
+    printf("Expected IN to leave its prompt buffered, got \"%s\"\n", prompt_buf);
+    pass = 0;
+  }
+  vm->unflushed = NULL;
+
+  return pass;
+}
+
+/* takes one keyboard interrupt while spinning on R1, the handler turns the
+ * interrupt off again */
+uint16_t interrupt_test_program[] = {
+  0x200D, /* 3000 LD R0, #13 (handler) */
+  0xB00D, /* 3001 STI R0, #13 (keyboard vector) */
+  0x200D, /* 3002 LD R0, #13 (KBSR_IE) */
+  0xB00D, /* 3003 STI R0, #13 (KBSR) */
+  0x1260, /* 3004 ADD R1, R1, #0 */
+  0x05FE, /* 3005 BRz #-2 */
+  0x15A0, /* 3006 ADD R2, R6, #0 */
+  0xF025, /* 3007 HALT */
+  0xA209, /* 3008 LDI R1, #9 (KBDR) */
+  0x5020, /* 3009 AND R0, R0, #0 */
+  0xB006, /* 300A STI R0, #6 (KBSR) */
+  0x16E1, /* 300B ADD R3, R3, #1 */
+  0x8000, /* 300C RTI */
+  0x0000,
+  0x3008,
+  IVT_BASE + VEC_KEYBOARD,
+  KBSR_IE,
+  MR_KBSR,
+  MR_KBDR
+};
+
+int test_interrupts(struct lc3_vm *vm) {
+  int pass = 1;
+  struct run_result (*engines[])(struct lc3_vm *, uint64_t, FILE *) = {
+    bench_switch_run, vm_run, vm_jit_run
+  };
+
+  for (int e = 0; e < 3; e++) {
+    char in_buf[] = {'x'};
+    FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+    load_test_program(vm, interrupt_test_program, sizeof(interrupt_test_program));
+    vm->kbd = in;
+    if (e == 0) {
+      /* the reference core would print HALT on stdout */
+      while (vm->reg[R_PC] != 0x3007) {
+        bench_switch_run(vm, 1, NULL);
+      }
+    }
+    else {
+      run_test_guest(vm, engines[e]);
+    }
+    vm->kbd = stdin;
+    fclose(in);
+
+    if (vm->reg[R_R1] != 'x' || vm->reg[R_R3] != 1) {
+      printf("Expected one interrupt reading %d on engine %d, got %d reading %d\n", 'x', e,
+             vm->reg[R_R3], vm->reg[R_R1]);
+      pass = 0;
+    }
+
+    /* back in user mode on the user stack, the PSR and PC went onto the
+     * supervisor stack */
+    if (vm->psr != PSR_USER || vm->reg[R_R2] != 0 || vm->reg[R_R6] != 0 ||
+        vm->saved_ssp != SSP_START) {
+      printf("Expected user mode on R6 0 on engine %d, got PSR 0x%x and R6 0x%x\n", e,
+             vm->psr, vm->reg[R_R6]);
+      pass = 0;
+    }
+    if (vm->memory[SSP_START - 1] != (PSR_USER | FL_ZRO) || vm->memory[SSP_START - 2] != 0x3004) {
+      printf("Expected PSR 0x%x and PC 0x3004 pushed on engine %d, got 0x%x and 0x%x\n",
+             PSR_USER | FL_ZRO, e, vm->memory[SSP_START - 1], vm->memory[SSP_START - 2]);
+      pass = 0;
+    }
+  }
+
+  /* reserved opcodes trap to the illegal opcode vector, and the priority
+   * masks the keyboard */
+  uint16_t program[] = {0xD000, 0xF025, 0x1021, 0x8000};
+  load_test_program(vm, program, sizeof(program));
+  vm->memory[IVT_BASE + VEC_ILLEGAL] = 0x3002;
+  vm->memory[MR_KBSR] = KBSR_READY | KBSR_IE;
+  vm->psr = PSR_USER | KBD_PRIORITY << PSR_PRIORITY_SHIFT;
+  bench_switch_run(vm, 1, NULL);
+  vm_check_interrupts(vm);
+  if (vm->reg[R_PC] != 0x3002 || vm->reg[R_R6] != SSP_START - 2 ||
+      (vm->psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT != KBD_PRIORITY) {
+    printf("Expected the illegal opcode handler at priority %d, got PC 0x%x\n",
+           KBD_PRIORITY, vm->reg[R_PC]);
+    pass = 0;
+  }
+  bench_switch_run(vm, 2, NULL);
+  if (vm->reg[R_PC] != 0x3001 || vm->reg[R_R0] != 1 || vm->psr != (PSR_USER | KBD_PRIORITY << PSR_PRIORITY_SHIFT)) {
+    printf("Expected RTI back to 0x3001, got PC 0x%x and PSR 0x%x\n", vm->reg[R_PC], vm->psr);
+    pass = 0;
+  }
+
+  /* supervisor code sets the condition codes through the PSR */
+  uint16_t psr_program[] = {0x2006, 0x1261, 0xB005, 0x0801, 0xF025, 0x14A1, 0xF025, FL_NEG, MR_PSR};
+  for (int e = 1; e < 3; e++) {
+    load_test_program(vm, psr_program, sizeof(psr_program));
+    vm->psr = 0;
+    run_test_guest(vm, engines[e]);
+    if (vm->reg[R_R2] != 1 || vm->reg[R_COND] != FL_POS) {
+      printf("Expected the PSR write to take the branch on engine %d\n", e);
+      pass = 0;
+    }
+  }
+
+  return pass;
+}
+
+int test_differential(struct lc3_vm *vm) {
+  return run_differential(1, 300, 6, 1) == 0;
+}
+
+const uint16_t cfg_test_program[] = {
+  0x5020, /* 3000 AND R0, R0, #0 */
+  0x1023, /* 3001 ADD R0, R0, #3 */
+  0x4804, /* 3002 JSR #4 (0x3007) */
+  0x103F, /* 3003 ADD R0, R0, #-1 */
+  0x03FD, /* 3004 BRp #-3 (0x3002) */
+  0xF025, /* 3005 HALT */
+  0x1234, /* 3006 data */
+  0x1261, /* 3007 ADD R1, R1, #1 */
+  0xC1C0  /* 3008 RET */
+};
+
+int test_cfg(struct lc3_vm *vm) {
+  int pass = 1;
+  load_test_program(vm, cfg_test_program, sizeof(cfg_test_program));
+  if (!vm_analyze(vm)) {
+    printf("failed to analyze image\n");
+    return 0;
+  }
+
+  const struct cfg_block expected[] = {
+    {0x3000, 0x3002, {0x3002}, 1, CFG_FALLTHROUGH},
+    {0x3002, 0x3003, {0x3003}, 1, CFG_CALL},
+    {0x3003, 0x3005, {0x3002, 0x3005}, 2, CFG_BRANCH},
+    {0x3005, 0x3006, {0}, 0, CFG_STOP},
+    {0x3007, 0x3009, {0}, 0, CFG_INDIRECT}
+  };
+  const struct cfg *cfg = vm->cfg;
+  int blocks_match = cfg->block_count == 5;
+  for (int i = 0; blocks_match && i < 5; i++) {
+    const struct cfg_block *b = &cfg->blocks[i], *e = &expected[i];
+    blocks_match = b->start == e->start && b->end == e->end && b->kind == e->kind &&
+                   b->succ_count == e->succ_count &&
+                   memcmp(b->succ, e->succ, e->succ_count * sizeof(b->succ[0])) == 0;
+  }
+  if (!blocks_match) {
+    printf("Expected the blocks of the test program, got\n");
+    vm_write_cfg(cfg, stdout);
+    pass = 0;
+  }
+  if (cfg->call_count != 1 || cfg->calls[0].from != 0x3002 || cfg->calls[0].to != 0x3007 ||
+      cfg->loop_count != 1 || cfg->loops[0].from != 0x3004 || cfg->loops[0].to != 0x3002) {
+    printf("Expected one call to 0x3007 and one loop back to 0x3002\n");
+    pass = 0;
+  }
+
+  /* reached code is decoded and fused, the data word isn't touched */
+  if (!vm->decode_cache[0x3003].valid || vm->decode_cache[0x3006].valid ||
+      vm->decode_cache[0x3000].exec != EXEC_CONST) {
+    printf("Expected the reachable code to be decoded up front\n");
+    pass = 0;
+  }
+  vm->quiet_halt = 1;
+  struct run_result result = vm_run(vm, 1000, NULL);
+  if (result.exit != RUN_HALTED || vm->reg[R_R1] != 3) {
+    printf("Expected the analyzed program to run as before\n");
+    pass = 0;
+  }
+  return pass;
+}
+
+/* an assembled image, origin first, words big endian */
+const uint8_t library_test_image[] = {
+  0x30, 0x00, /* origin 0x3000 */
+  0x20, 0x06, /* 3000 LD R0, #6 */
+  0xF0, 0x40, /* 3001 TRAP x40, doubles R0 */
+  0xF0, 0x21, /* 3002 OUT */
+  0xF0, 0x20, /* 3003 GETC */
+  0xF0, 0x21, /* 3004 OUT */
+  0xF0, 0x25, /* 3005 HALT */
+  0x00, 0x00, /* 3006 */
+  0x00, 0x21  /* 3007 '!' / 2 */
+};
+
+int library_test_double(struct lc3_vm *vm, uint8_t vector, struct lc3_view view, void *ctx) {
+  (*(int *)ctx)++;
+  lc3_set_reg(vm, LC3_R0, lc3_reg(vm, LC3_R0) * 2);
+  return 1;
+}
+
+/* calls a subroutine, has the host patch it through a view and calls it
+ * again */
+const uint16_t trap_view_test_program[] = {
+  0xE007, /* 3000 LEA R0, #7 (0x3008) */
+  0x5260, /* 3001 AND R1, R1, #0 */
+  0x1261, /* 3002 ADD R1, R1, #1 */
+  0x4804, /* 3003 JSR #4 (0x3008) */
+  0xF041, /* 3004 TRAP x41 */
+  0x4802, /* 3005 JSR #2 (0x3008) */
+  0xF025, /* 3006 HALT */
+  0x0000, /* 3007 */
+  0x14A1, /* 3008 ADD R2, R2, #1 */
+  0xC1C0  /* 3009 RET */
+};
+
+int trap_view_test_patch(struct lc3_vm *vm, uint8_t vector, struct lc3_view view, void *ctx) {
+  if (view.len != 1 || view.data[0] != 0x14A1) {
+    return 0;
+  }
+  view.data[0] = 0x14A2; /* ADD R2, R2, #2 */
+  return 1;
+}
+
+int test_trap_views(struct lc3_vm *vm) {
+  int pass = 1;
+  if (!lc3_set_trap(vm, 0x41, trap_view_test_patch, NULL) || lc3_set_trap(vm, TRAP_WRITE, NULL, NULL)) {
+    printf("Expected vectors past the block traps to take a host function\n");
+    pass = 0;
+  }
+  if (lc3_view(vm, MR_DEVICE_BASE - 1, 2).data || lc3_view(vm, 0xFFFF, 2).len ||
+      lc3_view(vm, MR_DEVICE_BASE - 2, 2).data != vm->memory + MR_DEVICE_BASE - 2) {
+    printf("Expected views to stay below the I/O page\n");
+    pass = 0;
+  }
+
+  /* the first call is decoded or compiled by the time the host patches it */
+  vm->quiet_halt = 1;
+  int engines[] = {LC3_ENGINE_THREADED, LC3_ENGINE_JIT};
+  for (int e = 0; e < 2; e++) {
+    load_test_program(vm, trap_view_test_program, sizeof(trap_view_test_program));
+    struct lc3_result result = lc3_run(vm, engines[e], 1000);
+    if (result.exit != LC3_HALTED || lc3_reg(vm, LC3_R2) != 3 || lc3_read(vm, 0x3008) != 0x14A2) {
+      printf("Expected engine %d to run the patched subroutine, R2 = %d\n", e, lc3_reg(vm, LC3_R2));
+      pass = 0;
+    }
+  }
+
+  /* the patch shows up in a trace like a store of the guest */
+  FILE *f = TRACING ? tmpfile() : NULL;
+  if (f && vm_attach_trace(vm, f)) {
+    load_test_program(vm, trap_view_test_program, sizeof(trap_view_test_program));
+    while (vm_read_and_execute_instruction(vm)) {
+    }
+    vm_detach_trace(vm);
+    rewind(f);
+    struct trace_reader *r = vm_trace_open(f);
+    struct trace_record rec;
+    int patched = 0;
+    while (r && vm_trace_next(r, &rec) == 1) {
+      for (uint32_t i = 0; i < rec.write_count; i++) {
+        patched += rec.writes[i][0] == 0x3008 && rec.writes[i][1] == 0x14A2;
+      }
+    }
+    vm_trace_reader_destroy(r);
+    if (patched != 1 || vm->reg[R_R2] != 3) {
+      printf("Expected the trace to have the patch once, got %d\n", patched);
+      pass = 0;
+    }
+  }
+  if (f) {
+    fclose(f);
+  }
+  return pass;
+}
+
+int test_library(struct lc3_vm *vm) {
+  int pass = 1;
+  struct lc3_vm *lib = lc3_create();
+  if (!lib) {
+    printf("failed to create vm\n");
+    return 0;
+  }
+  int calls = 0;
+  if (lc3_set_trap(lib, TRAP_HALT, library_test_double, &calls) ||
+      lc3_set_trap(lib, TRAP_MEMCPY, library_test_double, &calls) ||
+      !lc3_set_trap(lib, 0x40, library_test_double, &calls)) {
+    printf("Expected only vectors without a routine to take a host function\n");
+    pass = 0;
+  }
+
+  int engines[] = {LC3_ENGINE_THREADED, LC3_ENGINE_JIT};
+  for (int e = 0; e < 2; e++) {
+    char out_buf[16] = {0};
+    FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+    lc3_reset(lib);
+    lc3_set_io(lib, NULL, out);
+    calls = 0;
+
+    struct lc3_result budget = lc3_run(lib, engines[e], 0);
+    int loaded = lc3_load(lib, library_test_image, sizeof(library_test_image));
+    struct lc3_result first = lc3_run(lib, engines[e], 1000);
+    lc3_set_reg(lib, LC3_R0, '!');
+    struct lc3_result second = lc3_run(lib, engines[e], 1000);
+    fclose(out);
+
+    if (!loaded || budget.exit != LC3_BUDGET || budget.retired != 0 ||
+        first.exit != LC3_TRAP || first.trap != 0xF020 || first.retired != 4 ||
+        second.exit != LC3_HALTED || second.retired != 2 || calls != 1 ||
+        strcmp(out_buf, "B!") != 0) {
+      printf("Expected engine %d to run the image through the library, got \"%s\"\n", e, out_buf);
+      pass = 0;
+    }
+  }
+
+  /* carry on from a snapshot taken at the GETC on another vm */
+  char out_buf[16] = {0};
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  lc3_reset(lib);
+  lc3_set_io(lib, NULL, out);
+  lc3_load(lib, library_test_image, sizeof(library_test_image));
+  lc3_run(lib, LC3_ENGINE_JIT, 1000);
+  struct lc3_snapshot *snap = lc3_snapshot(lib);
+  lc3_set_io(vm, NULL, out);
+  vm->quiet_halt = 1;
+  if (!snap || !lc3_restore(vm, snap)) {
+    printf("failed to restore snapshot\n");
+    pass = 0;
+  }
+  else {
+    lc3_set_reg(vm, LC3_R0, '?');
+    struct lc3_result result = lc3_run(vm, LC3_ENGINE_THREADED, 1000);
+    fflush(out);
+    if (result.exit != LC3_HALTED || strcmp(out_buf, "B?") != 0 || lc3_read(vm, 0x3007) != 0x21) {
+      printf("Expected the restored vm to finish the image\n");
+      pass = 0;
+    }
+  }
+  fclose(out);
+  vm->display = stdout;
+  lc3_snapshot_destroy(snap);
+
+  /* register numbers past LC3_COND don't reach the rest of the vm */
+  uint16_t psr = lib->psr;
+  lc3_set_reg(lib, LC3_COND + 1, 0x1234);
+  lc3_set_reg(lib, -1, 0x1234);
+  if (lc3_reg(lib, LC3_COND + 1) != 0 || lc3_reg(lib, -1) != 0 || lib->psr != psr) {
+    printf("Expected out of range registers to be ignored\n");
+    pass = 0;
+  }
+  lc3_destroy(lib);
+  return pass;
+}
+
+int run_tests() {
+  int (*tests[])(struct lc3_vm *) = {
+    test_add_instr_1,
+    test_add_instr_2,
+    test_and_instr_1,
+    test_and_instr_2,
+    test_not_instr,
+    test_br_instr_1,
+    test_br_instr_2,
+    test_br_instr_3,
+    test_br_instr_4,
+    test_br_lazy_flags,
+    test_jmp_instr,
+    test_jsr_instr_1,
+    test_jsr_instr_2,
+    test_ld_instr,
+    test_ldi_instr,
+    test_ldr_instr,
+    test_lea_instr,
+    test_st_instr,
+    test_sti_instr,
+    test_str_instr,
+    test_trap_getc,
+    test_trap_out,
+    test_trap_puts,
+    test_trap_in,
+    test_trap_putsp,
+    test_string_traps,
+    test_bulk_traps,
+    test_decode_cache_invalidation,
+    test_memory_top,
+    test_devices,
+    test_threaded_engine,
+    test_superinstructions,
+    test_interrupts,
+    test_differential,
+    test_library,
+    test_trap_views,
+    test_cfg,
+    test_idle_loops,
+    test_debugger,
+    test_trace,
+    test_core_variants,
+    test_jit_engine,
+    test_read_image,
+    test_vm_run_budget,
+    test_vm_run_exits,
+    test_jit_run_budget,
+    test_snapshot,
+    test_dirty_pages,
+    test_load_pages,
+    test_bench_kernels,
+    test_profile,
+    test_scheduler,
+    test_keyboard,
+    test_input_log,
+    test_batch_io,
+    test_output_buffering,
+    NULL
+  };
+
+  int i, result, ok = 1;
+  for (i = 0; tests[i] != NULL; i++) {
+    /* every test gets a freshly powered on machine */
+    struct lc3_vm *vm = vm_create();
+    if (!vm) {
+      printf("failed to create vm\n");
+      return 1;
+    }
+
+    result = tests[i](vm);
+    vm_destroy(vm);
+    if (!result) {
+      printf("Test %d failed!\n", i);
+      ok = 0;
+    }
+  }
+
+  if (ok) {
+    printf("All tests passed!\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* terminal input setup */
+struct termios original_tio;
+
+void disable_input_buffering() {
+  tcgetattr(STDIN_FILENO, &original_tio);
+  struct termios new_tio = original_tio;
+  new_tio.c_lflag &= ~ICANON & ~ECHO;
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering() {
+  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+void handle_interrupt(int signal) {
+  restore_input_buffering();
+  printf("\n");
+  exit(-2);
+}
+
+/* exit status of a run for each way the guest can stop, 1 and 2 are left
+ * for images and options that could not be used */
+enum {
+  EXIT_MCR = 3,  /* the guest switched the MCR clock off */
+  EXIT_OVERFLOW, /* the PC ran off the top of memory */
+  EXIT_EOF,      /* the guest asked for input past its end, see --batch */
+  EXIT_DIVERGED  /* the guest went another way than the recording */
+};
+
+const int stop_status[] = {
+  [STOP_NONE] = 0, [STOP_HALT] = 0, [STOP_MCR] = EXIT_MCR,
+  [STOP_OVERFLOW] = EXIT_OVERFLOW, [STOP_EOF] = EXIT_EOF
+};
+
+/* main program */
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    /* show usage string */
+    printf("lc3 --test | --bench [--engine=switch|threaded|jit] | --diff[=cases[,seed]] |\n"
+           "    [--engine=switch|threaded|jit] [--idle-sleep] [--profile[=file[.csv]]]\n"
+           "    [--record=file | --replay=file [--skip-spins]] [--batch] [--analyze] [--debug=port]\n"
+           "    [--trace=file] [--no-mmio] [--check-overflow] [image-file1] ...\n"
+           "the jit engine is x86-64 only, other hosts run the threaded engine instead\n");
+    exit(2);
+  }
+
+  if (strcmp(argv[1], "--test") == 0) {
+    exit(run_tests());
+  }
+
+  if (strncmp(argv[1], "--diff", 6) == 0 && (argv[1][6] == '\0' || argv[1][6] == '=')) {
+    unsigned cases = 10000, seed = 1;
+    if (argv[1][6] == '=') {
+      sscanf(argv[1] + 7, "%u,%u", &cases, &seed);
+    }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int failed = run_differential(seed, cases, threads > 0 ? threads : 1, 1);
+    printf("%u cases from seed %u: %d failed\n", cases, seed, failed);
+    exit(failed != 0);
+  }
+
+  struct lc3_vm *vm = vm_create();
+  if (!vm) {
+    printf("failed to create vm\n");
+    exit(1);
+  }
+
+  int engine = DEFAULT_ENGINE;
+  int engine_given = 0;
+  int idle_sleep = 0;
+  int bench = 0;
+  int profile = 0;
+  const char *profile_path = NULL;
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  int skip_spins = 0;
+  int batch = 0;
+  int analyze = 0;
+  int debug_port = 0;
+  const char *trace_path = NULL;
+  for (int j = 1; j < argc; ++j) {
+    if (strcmp(argv[j], "--no-mmio") == 0) {
+      vm->plain_memory = 1;
+      continue;
+    }
+
+    if (strcmp(argv[j], "--check-overflow") == 0) {
+      vm->check_overflow = 1;
+      continue;
+    }
+
+    if (strncmp(argv[j], "--trace=", 8) == 0) {
+      trace_path = argv[j] + 8;
+      continue;
+    }
+
+    if (strncmp(argv[j], "--debug=", 8) == 0) {
+      debug_port = atoi(argv[j] + 8);
+      continue;
+    }
+
+    if (strcmp(argv[j], "--analyze") == 0) {
+      analyze = 1;
+      continue;
+    }
+
+    if (strcmp(argv[j], "--batch") == 0) {
+      batch = 1;
+      continue;
+    }
+
+    if (strncmp(argv[j], "--record=", 9) == 0) {
+      record_path = argv[j] + 9;
+      continue;
+    }
+
+    if (strncmp(argv[j], "--replay=", 9) == 0) {
+      replay_path = argv[j] + 9;
+      continue;
+    }
+
+    if (strcmp(argv[j], "--skip-spins") == 0) {
+      skip_spins = 1;
+      continue;
+    }
+
+    if (strncmp(argv[j], "--profile", 9) == 0 && (argv[j][9] == '\0' || argv[j][9] == '=')) {
+      profile = 1;
+      profile_path = argv[j][9] ? argv[j] + 10 : NULL;
+      continue;
+    }
+
+    if (strcmp(argv[j], "--bench") == 0) {
+      bench = 1;
+      continue;
+    }
+
+    if (strcmp(argv[j], "--idle-sleep") == 0) {
+      idle_sleep = 1;
+      continue;
+    }
+
+    if (strncmp(argv[j], "--engine=", 9) == 0) {
+      const char *name = argv[j] + 9;
+      if (strcmp(name, "switch") == 0) {
+        engine = ENGINE_SWITCH;
+      }
+      else if (strcmp(name, "threaded") == 0) {
+        engine = ENGINE_THREADED;
+      }
+      else if (strcmp(name, "jit") == 0) {
+        engine = ENGINE_JIT;
+      }
+      else {
+        printf("unknown engine: %s\n", name);
+        exit(2);
+      }
+      engine_given = 1;
+      continue;
+    }
+
+    if (!vm_read_image(vm, argv[j])) {
+      printf("failed to load image: %s\n", argv[j]);
+      exit(1);
+    }
+  }
+
+  static char output_buffer[OUTPUT_BUFFER_SIZE];
+  vm_set_output_mode(stdout, output_buffer, sizeof(output_buffer),
+                  isatty(STDOUT_FILENO) && !bench && !batch ? OUTPUT_INTERACTIVE : OUTPUT_BATCH);
+
+  /* batch jobs read their input from a file or pipe in large blocks straight
+   * through stdio: no terminal setup, no reader thread and KBSR never makes
+   * the guest wait. they report HALT through the exit status only */
+  int headless = replay_path || (batch && !isatty(STDIN_FILENO));
+  if (batch) {
+    static char input_buffer[INPUT_BUFFER_SIZE];
+    setvbuf(stdin, input_buffer, _IOFBF, sizeof(input_buffer));
+    vm->kbd_blocking = !isatty(STDIN_FILENO);
+    vm->quiet_halt = 1;
+    vm->eof_stops = 1;
+  }
+
+  if (bench) {
+    vm_destroy(vm);
+    exit(run_bench(engine_given ? engine : -1));
+  }
+
+  /* index the image and warm up the decode cache, --analyze just prints it */
+  int analyzed = vm_analyze(vm);
+  if (analyze) {
+    if (analyzed) {
+      vm_write_cfg(vm->cfg, stdout);
+    }
+    vm_destroy(vm);
+    exit(!analyzed);
+  }
+
+  /* only the reference core keeps a profile */
+  if (profile) {
+    if (!PROFILING || !vm_attach_profile(vm)) {
+      printf("profiling is not available\n");
+      exit(2);
+    }
+    engine = ENGINE_SWITCH;
+  }
+
+  /* a recording gets instruction counts from the reference core, a replay
+   * never touches the terminal */
+  FILE *input_file = NULL;
+  if (record_path || replay_path) {
+    input_file = fopen(record_path ? record_path : replay_path, record_path ? "wb" : "rb");
+    if (!input_file || !vm_attach_input_log(vm, input_file, record_path ? INPUT_RECORD :
+                                            skip_spins ? INPUT_REPLAY_SKIP : INPUT_REPLAY)) {
+      printf("failed to open input log: %s\n", record_path ? record_path : replay_path);
+      exit(1);
+    }
+    if (record_path) {
+      engine = ENGINE_SWITCH;
+    }
+  }
+
+  /* so does a trace */
+  FILE *trace_file = NULL;
+  if (trace_path) {
+    if (!TRACING) {
+      printf("tracing is not available\n");
+      exit(2);
+    }
+    trace_file = fopen(trace_path, "wb");
+    if (!trace_file || !vm_attach_trace(vm, trace_file)) {
+      printf("failed to open trace: %s\n", trace_path);
+      exit(1);
+    }
+    engine = ENGINE_SWITCH;
+  }
+
+  if (debug_port) {
+    fprintf(stderr, "waiting for a debugger on port %d\n", debug_port);
+    if (!vm_attach_debugger(vm, vm_debug_accept(debug_port))) {
+      printf("failed to accept a debugger on port %d\n", debug_port);
+      exit(1);
+    }
+  }
+
+  if (!headless) {
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
+    /* without the reader thread every KBSR read falls back to select() */
+    vm_attach_keyboard(vm, idle_sleep);
+  }
+
+  /* under a debugger the guest only runs on by itself once it detaches */
+  int detached = !vm->debug || vm_debug_serve(vm);
+  vm_debug_destroy(vm->debug);
+  vm->debug = NULL;
+  if (detached) {
+    vm_run_engine(vm, engine);
+  }
+
+  /* 0 once the guest halts, otherwise what stopped it */
+  int status = stop_status[vm->stop];
+  if (replay_path && vm->input_log->diverged) {
+    fprintf(stderr, "replay diverged at input event %llu\n",
+            (unsigned long long)vm->input_log->diverged);
+    status = EXIT_DIVERGED;
+  }
+  if (!headless) {
+    restore_input_buffering();
+  }
+  if (profile) {
+    FILE *f = profile_path ? fopen(profile_path, "w") : stderr;
+    size_t len = profile_path ? strlen(profile_path) : 0;
+    if (f) {
+      vm_write_profile(vm, f, len > 4 && strcmp(profile_path + len - 4, ".csv") == 0);
+      if (f != stderr) {
+        fclose(f);
+      }
+    }
+    else {
+      printf("failed to write profile: %s\n", profile_path);
+    }
+  }
+  vm_destroy(vm);
+  if (input_file) {
+    fclose(input_file);
+  }
+  if (trace_file) {
+    fclose(trace_file);
+  }
+  return status;
 }